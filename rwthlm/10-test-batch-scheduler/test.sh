@@ -0,0 +1,20 @@
+#!/bin/bash
+
+# The batch scheduler collects the steps of the sessions that arrive within a
+# window of time and evaluates them as one batch (see --batch-window). It
+# prints histograms of queue depth and latency at the end.
+#
+# With this test we want to verify whether batching the steps of concurrent
+# sessions leads to the same word probabilities as the perplexity evaluation.
+#
+# At the end, "testppl" and "testscheduler" should be the same, apart from
+# the histograms.
+
+../rwthlm --vocab v --train a --dev a --learning-rate 0.1 --batch-size 7 --max-epoch 1 --word-wrapping verbatim tmp/test-r10-R10-M10-L10
+
+../rwthlm --vocab v --ppl a --batch-size 1 --word-wrapping verbatim --verbose tmp/test-r10-R10-M10-L10 > tmp/testppl
+../rwthlm --vocab v --ppl a --batch-size 1 --word-wrapping verbatim --verbose --sessions --threads 4 --batch-window 1000 --check-sessions tmp/test-r10-R10-M10-L10 | grep -v -e "^bucket" -e "^< " > tmp/testscheduler
+
+diff tmp/testppl tmp/testscheduler
+rm tmp/test-r10-R10-M10-L10
+rm tmp/testppl tmp/testscheduler
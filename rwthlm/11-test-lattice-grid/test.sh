@@ -0,0 +1,26 @@
+#!/bin/bash
+
+# With --lambda-grid and --lm-scale-grid, each lattice is rescored once for
+# all combinations of interpolation weight and LM scale, and one output per
+# combination is written next to the lattice.
+#
+# With this test we want to verify whether the grid leads to the same
+# rescored lattices as separate runs with --lambda and --lm-scale.
+#
+# At the end, the rescored lattices of the grid and of the separate runs
+# should be the same.
+
+../rwthlm --vocab v --train a --dev a --learning-rate 0.1 --batch-size 7 --max-epoch 1 --word-wrapping verbatim tmp/test-r10-R10-M10-L10
+
+cp lattice0.lat lattice1.lat tmp/
+../rwthlm --vocab v --lambda-grid 0.5,1 --lm-scale-grid 5,10 --pruning-threshold 200 tmp/lattice0.lat tmp/lattice1.lat tmp/test-r10-R10-M10-L10
+for lambda in 0.5 1; do
+  for lm_scale in 5 10; do
+    ../rwthlm --vocab v --lambda $lambda --lm-scale $lm_scale --pruning-threshold 200 tmp/lattice0.lat tmp/lattice1.lat tmp/test-r10-R10-M10-L10
+    for lattice in lattice0 lattice1; do
+      diff tmp/$lattice.lat.lambda$lambda-lm-scale$lm_scale.rescored tmp/$lattice.lat.rescored
+    done
+  done
+done
+rm tmp/test-r10-R10-M10-L10
+rm tmp/lattice0.lat* tmp/lattice1.lat*
@@ -0,0 +1,19 @@
+#!/bin/bash
+
+# With --shared-prefixes, each distinct prefix of the sequences is evaluated
+# only once, and the sequences are scored from a trie of their prefixes.
+#
+# With this test we want to verify whether the prefix trie leads to the same
+# word probabilities as the perplexity evaluation of the sequences one by
+# one, for sequences that share prefixes and one that occurs twice.
+#
+# At the end, "testppl" and "testprefixes" should be the same.
+
+../rwthlm --vocab v --train a --dev a --learning-rate 0.1 --batch-size 7 --max-epoch 1 --word-wrapping verbatim tmp/test-r10-R10-M10-L10
+
+../rwthlm --vocab v --ppl b --batch-size 1 --word-wrapping verbatim --verbose tmp/test-r10-R10-M10-L10 > tmp/testppl
+../rwthlm --vocab v --ppl b --batch-size 1 --word-wrapping verbatim --verbose --shared-prefixes tmp/test-r10-R10-M10-L10 > tmp/testprefixes
+
+diff tmp/testppl tmp/testprefixes
+rm tmp/test-r10-R10-M10-L10
+rm tmp/testppl tmp/testprefixes
@@ -0,0 +1,50 @@
+#!/bin/bash
+
+# With --nbest, the hypotheses of n-best lists are rescored through a prefix
+# trie, in which each distinct prefix is evaluated only once.
+#
+# With this test we want to verify whether rescoring the lists in parallel
+# leads to the same lists as rescoring them one by one, and whether the trie
+# leads to the same sentence log probabilities as the perplexity evaluation
+# (with lambda 1, the new LM scores are the network log probabilities).
+#
+# At the end, the rescored lists with and without threads should be the same,
+# and no sentence should be reported as different.
+
+../rwthlm --vocab v --train a --dev a --learning-rate 0.1 --batch-size 7 --max-epoch 1 --word-wrapping verbatim tmp/test-r10-R10-M10-L10
+
+cp nbest0 nbest1 tmp/
+../rwthlm --vocab v --nbest --lambda 0.5 --lm-scale 10 tmp/nbest0 tmp/nbest1 tmp/test-r10-R10-M10-L10
+mv tmp/nbest0.rescored tmp/nbest0.serial
+mv tmp/nbest1.rescored tmp/nbest1.serial
+../rwthlm --vocab v --nbest --lambda 0.5 --lm-scale 10 --threads 2 tmp/nbest0 tmp/nbest1 tmp/test-r10-R10-M10-L10
+diff tmp/nbest0.serial tmp/nbest0.rescored
+diff tmp/nbest1.serial tmp/nbest1.rescored
+
+../rwthlm --vocab v --nbest --lambda 1 --log-linear tmp/nbest0 tmp/nbest1 tmp/test-r10-R10-M10-L10
+cat nbest0 nbest1 | cut -d ' ' -f 4- > tmp/sentences
+../rwthlm --vocab v --ppl tmp/sentences --batch-size 1 --word-wrapping verbatim --verbose tmp/test-r10-R10-M10-L10 > tmp/testppl
+# sum of the natural log probabilities of the words of each sentence and <sb>
+awk 'FNR == NR {
+       if ($1 == "p(") {
+         sum += log($8)
+         if ($2 == "<sb>") {
+           sums[sentence] = sum
+           sentence = ""
+           sum = 0
+         } else {
+           sentence = sentence " " $2
+         }
+       }
+       next
+     }
+     {
+       sentence = ""
+       for (i = 4; i <= NF; ++i)
+         sentence = sentence " " $i
+       if (!(sentence in sums) || $2 - sums[sentence] > 1e-5 ||
+           sums[sentence] - $2 > 1e-5)
+         print "different:" sentence
+     }' tmp/testppl tmp/nbest0.rescored tmp/nbest1.rescored
+rm tmp/test-r10-R10-M10-L10
+rm tmp/nbest0* tmp/nbest1* tmp/sentences tmp/testppl
@@ -0,0 +1,62 @@
+#!/bin/bash
+
+# With --scores, the log probabilities of the sentences (and of their tokens,
+# with --token-scores) are written to a file for programs that rank
+# candidates, see ScoreWriter: tab-separated with --score-format tsv, or as
+# "RWTHLMS1", an int32 flag of the token scores, then per sentence int64 ID,
+# int32 number of tokens, double total and the doubles of the tokens with
+# --score-format binary.
+#
+# With this test we want to verify whether the token scores are the ones of
+# the verbose perplexity evaluation, and whether the binary file holds the
+# same records as the tab-separated one.
+#
+# At the end, "testverbose" and "testtsv" as well as "testtsv" and "testbinary"
+# should be the same, and no error about the binary files should be printed.
+
+../rwthlm --vocab v --train a --dev a --learning-rate 0.1 --batch-size 7 --max-epoch 1 --word-wrapping verbatim tmp/test-r10-R10-M10-L10
+
+../rwthlm --vocab v --ppl b --batch-size 1 --word-wrapping verbatim --verbose tmp/test-r10-R10-M10-L10 > tmp/testppl
+../rwthlm --vocab v --ppl b --batch-size 1 --word-wrapping verbatim --scores tmp/scores.tsv --token-scores tmp/test-r10-R10-M10-L10
+../rwthlm --vocab v --ppl b --batch-size 1 --word-wrapping verbatim --scores tmp/scores.bin --score-format binary --token-scores tmp/test-r10-R10-M10-L10
+../rwthlm --vocab v --ppl b --batch-size 1 --word-wrapping verbatim --scores tmp/scores0.bin --score-format binary tmp/test-r10-R10-M10-L10
+
+# ID, number of tokens and the log10 probabilities of the verbose output
+awk '$1 == "p(" {
+       tokens = tokens (tokens == "" ? "" : " ") $10
+       ++n
+       if ($2 == "<sb>") {
+         print i++ "\t" n "\t" tokens
+         tokens = ""
+         n = 0
+       }
+     }' tmp/testppl > tmp/testverbose
+cut -f 1,2,4 tmp/scores.tsv > tmp/testtsv
+diff tmp/testverbose tmp/testtsv
+
+# the records of the binary file in the format of the tab-separated one
+Read() {
+  od -A n -t $1 -j $2 -N $3 tmp/scores.bin | tr -s ' \n' '  '
+}
+[ "$(head -c 8 tmp/scores.bin)" == RWTHLMS1 ] || echo "wrong magic"
+[ $(Read d4 8 4) -eq 1 ] || echo "wrong flag"
+size=$(stat -c %s tmp/scores.bin)
+offset=12
+while [ $offset -lt $size ]; do
+  id=$(Read d8 $offset 8)
+  n=$(Read d4 $((offset + 8)) 4)
+  total=$(Read f8 $((offset + 12)) 8)
+  printf "%d\t%d\t%.5f\t" $id $n $total
+  printf "%.5f\n" $(Read f8 $((offset + 20)) $((8 * n))) | paste -s -d ' '
+  offset=$((offset + 20 + 8 * n))
+done > tmp/testbinary
+[ $offset -eq $size ] || echo "wrong size"
+diff tmp/scores.tsv tmp/testbinary
+
+# without token scores: the flag and only the totals
+[ "$(head -c 8 tmp/scores0.bin)" == RWTHLMS1 ] || echo "wrong magic"
+[ $(od -A n -t d4 -j 8 -N 4 tmp/scores0.bin) -eq 0 ] || echo "wrong flag"
+[ $(stat -c %s tmp/scores0.bin) -eq $((12 + 20 * $(wc -l < tmp/scores.tsv))) ] || echo "wrong size"
+
+rm tmp/test-r10-R10-M10-L10
+rm tmp/testppl tmp/testverbose tmp/testtsv tmp/testbinary tmp/scores.tsv tmp/scores.bin tmp/scores0.bin
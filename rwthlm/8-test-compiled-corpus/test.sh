@@ -0,0 +1,24 @@
+#!/bin/bash
+
+# A compiled corpus (see --compile-corpus) holds the same sentences as the
+# text file it was compiled from, only pre-tokenized.
+#
+# With this test we want to verify whether training on the compiled corpus
+# leads to the same result as training on the text file, including the
+# shuffling of the training data.
+#
+# At the end, "test1ona" and "test2ona" should be the same except that models
+# were read from different files for the gradient test.
+
+../rwthlm --vocab v --train a --compile-corpus tmp/a.corpus
+
+../rwthlm --vocab v --train a           --dev a --learning-rate 0.1 --batch-size 7 --max-epoch 2 --word-wrapping verbatim tmp/test1-r10-R10-M10-L10
+../rwthlm --vocab v --train tmp/a.corpus --dev a --learning-rate 0.1 --batch-size 7 --max-epoch 2 --word-wrapping verbatim tmp/test2-r10-R10-M10-L10
+
+../rwthlm --vocab v --train a --word-wrapping verbatim --batch-size 7 --self-test tmp/test1-r10-R10-M10-L10 > tmp/test1ona
+../rwthlm --vocab v --train a --word-wrapping verbatim --batch-size 7 --self-test tmp/test2-r10-R10-M10-L10 > tmp/test2ona
+
+diff tmp/test[12]ona
+rm tmp/a.corpus
+rm tmp/test[12]-r10-R10-M10-L10{,.bk}
+rm tmp/test[12]ona
@@ -0,0 +1,20 @@
+#!/bin/bash
+
+# The inference engine scores each sentence word by word as a session of its
+# own, with several sessions at a time (see --sessions). With --check-sessions,
+# each word is also rolled back, scored and appended again, and the results
+# must agree.
+#
+# With this test we want to verify whether scoring the sentences this way
+# leads to the same word probabilities as the perplexity evaluation.
+#
+# At the end, "testppl" and "testsessions" should be the same.
+
+../rwthlm --vocab v --train a --dev a --learning-rate 0.1 --batch-size 7 --max-epoch 1 --word-wrapping verbatim tmp/test-r10-R10-M10-L10
+
+../rwthlm --vocab v --ppl a --batch-size 1 --word-wrapping verbatim --verbose tmp/test-r10-R10-M10-L10 > tmp/testppl
+../rwthlm --vocab v --ppl a --batch-size 1 --word-wrapping verbatim --verbose --sessions --threads 4 --check-sessions tmp/test-r10-R10-M10-L10 > tmp/testsessions
+
+diff tmp/testppl tmp/testsessions
+rm tmp/test-r10-R10-M10-L10
+rm tmp/testppl tmp/testsessions
@@ -0,0 +1,118 @@
+/*
+ * Copyright 2014 RWTH Aachen University. All rights reserved.
+ *
+ * Licensed under the RWTH LM License (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <cassert>
+#include <iomanip>
+#include <iostream>
+#include "batchscheduler.h"
+
+BatchScheduler::BatchScheduler(InferenceEngine *engine,
+                               const int max_batch_size,
+                               const std::chrono::microseconds window)
+    : engine_(engine),
+      max_batch_size_(max_batch_size),
+      window_(window),
+      queue_depths_(kNumBuckets, 0),
+      latencies_(kNumBuckets, 0),
+      is_stopping_(false) {
+  assert(max_batch_size > 0);
+  thread_ = std::thread(&BatchScheduler::Run, this);
+}
+
+BatchScheduler::~BatchScheduler() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    is_stopping_ = true;
+  }
+  request_arrived_.notify_one();
+  thread_.join();
+}
+
+Real BatchScheduler::Submit(const int session,
+                            const int word,
+                            const bool is_advance) {
+  Request request;
+  request.step.session = session;
+  request.step.word = word;
+  request.step.is_advance = is_advance;
+  request.arrival = Clock::now();
+  request.is_done = false;
+  std::unique_lock<std::mutex> lock(mutex_);
+  assert(!is_stopping_);
+  queue_.push_back(&request);
+  request_arrived_.notify_one();
+  batch_done_.wait(lock, [&request] { return request.is_done; });
+  return request.step.log_probability;
+}
+
+void BatchScheduler::Run() {
+  std::vector<Request *> batch;
+  std::vector<InferenceEngine::Step> steps;
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    request_arrived_.wait(lock, [this] {
+      return is_stopping_ || !queue_.empty();
+    });
+    if (queue_.empty())
+      return;
+    // wait for more steps until the oldest one has waited for the window
+    const Clock::time_point deadline = queue_.front()->arrival + window_;
+    request_arrived_.wait_until(lock, deadline, [this] {
+      return is_stopping_ ||
+             static_cast<int>(queue_.size()) >= max_batch_size_;
+    });
+    ++queue_depths_[GetBucket(queue_.size())];
+    batch.clear();
+    steps.clear();
+    while (!queue_.empty() &&
+           static_cast<int>(batch.size()) < max_batch_size_) {
+      batch.push_back(queue_.front());
+      steps.push_back(queue_.front()->step);
+      queue_.pop_front();
+    }
+
+    // new steps queue up during the evaluation
+    lock.unlock();
+    engine_->EvaluateBatch(&steps);
+    lock.lock();
+
+    const Clock::time_point now = Clock::now();
+    for (size_t i = 0; i < batch.size(); ++i) {
+      Request *request = batch[i];
+      request->step.log_probability = steps[i].log_probability;
+      const int64_t latency = std::chrono::duration_cast<
+          std::chrono::microseconds>(now - request->arrival).count();
+      ++latencies_[GetBucket(latency)];
+      request->is_done = true;
+    }
+    batch_done_.notify_all();
+  }
+}
+
+void BatchScheduler::GetHistograms(std::vector<int64_t> *queue_depths,
+                                   std::vector<int64_t> *latencies) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  *queue_depths = queue_depths_;
+  *latencies = latencies_;
+}
+
+void BatchScheduler::PrintHistograms() {
+  std::vector<int64_t> queue_depths, latencies;
+  GetHistograms(&queue_depths, &latencies);
+  std::cout << "bucket\tqueue depth\tlatency (microseconds)" << std::endl;
+  for (int i = 0; i < kNumBuckets; ++i) {
+    if (queue_depths[i] == 0 && latencies[i] == 0)
+      continue;
+    std::cout << "< " << std::setw(10) << (int64_t(1) << i) << '\t' <<
+                 queue_depths[i] << '\t' << latencies[i] << std::endl;
+  }
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright 2014 RWTH Aachen University. All rights reserved.
+ *
+ * Licensed under the RWTH LM License (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "inferenceengine.h"
+
+// Dynamic batching of the steps of concurrent sessions: Score() and Advance()
+// block until the thread of the scheduler has evaluated their step together
+// with the steps that arrived within window after the oldest waiting one, up
+// to max_batch_size steps, see InferenceEngine::EvaluateBatch(). This trades
+// a bounded delay for fewer, larger matrix multiplications.
+//
+// The histograms help tuning the window: the queue depth when a batch is
+// formed and the latency of each step from arrival to result, both in
+// buckets of powers of two (bucket i: [2^(i-1), 2^i), bucket 0: 0).
+class BatchScheduler {
+public:
+  static const int kNumBuckets = 32;
+
+  BatchScheduler(InferenceEngine *engine,
+                 const int max_batch_size,
+                 const std::chrono::microseconds window);
+
+  // evaluates the remaining steps
+  ~BatchScheduler();
+
+  Real Score(const int session, const int word) {
+    return Submit(session, word, false);
+  }
+
+  Real Advance(const int session, const int word) {
+    return Submit(session, word, true);
+  }
+
+  // number of batches by queue depth, number of steps by latency in
+  // microseconds
+  void GetHistograms(std::vector<int64_t> *queue_depths,
+                     std::vector<int64_t> *latencies);
+
+  void PrintHistograms();
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Request {
+    InferenceEngine::Step step;
+    Clock::time_point arrival;
+    bool is_done;
+  };
+
+  static int GetBucket(const int64_t value) {
+    int bucket = 0;
+    for (int64_t v = value; v > 0 && bucket < kNumBuckets - 1; v >>= 1)
+      ++bucket;
+    return bucket;
+  }
+
+  Real Submit(const int session, const int word, const bool is_advance);
+
+  void Run();
+
+  InferenceEngine *const engine_;
+  const int max_batch_size_;
+  const std::chrono::microseconds window_;
+  std::mutex mutex_;
+  std::condition_variable request_arrived_, batch_done_;
+  std::deque<Request *> queue_;
+  std::vector<int64_t> queue_depths_, latencies_;
+  bool is_stopping_;
+  std::thread thread_;
+};
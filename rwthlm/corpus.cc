@@ -0,0 +1,87 @@
+/*
+ * Copyright 2014 RWTH Aachen University. All rights reserved.
+ *
+ * Licensed under the RWTH LM License (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <cassert>
+#include <cstring>
+#include <fstream>
+#include <boost/filesystem/operations.hpp>
+#include "corpus.h"
+#include "data.h"
+#include "file.h"
+
+const char CompiledCorpus::kMagic[8] = { 'r', 'w', 't', 'h', 'l', 'm', 'c',
+                                         '\0' };
+
+CompiledCorpus::CompiledCorpus(const std::string &file_name,
+                               const Vocabulary &vocabulary)
+    : file_(file_name) {
+  assert(file_.is_open() && file_.size() >= sizeof(Header));
+  header_ = reinterpret_cast<const Header *>(file_.data());
+  assert(memcmp(header_->magic, kMagic, sizeof(kMagic)) == 0);
+  assert(header_->version == kVersion);
+  // word indices are only valid for the vocabulary used for compiling
+  assert(header_->vocabulary_checksum == vocabulary.ComputeChecksum());
+  assert(header_->word_size == sizeof(uint16_t) ||
+         header_->word_size == sizeof(uint32_t));
+  offsets_ = reinterpret_cast<const uint64_t *>(header_ + 1);
+  words_ = offsets_ + header_->num_sentences + 1;
+  assert(file_.size() == sizeof(Header) + (header_->num_sentences + 1) *
+         sizeof(uint64_t) + header_->num_words * header_->word_size);
+}
+
+bool CompiledCorpus::IsCompiledCorpus(const std::string &file_name) {
+  assert(boost::filesystem::exists(file_name));
+  std::ifstream file(file_name.c_str(), std::ios::in | std::ios::binary);
+  char magic[sizeof(kMagic)];
+  file.read(magic, sizeof(magic));
+  return file.good() && memcmp(magic, kMagic, sizeof(kMagic)) == 0;
+}
+
+void CompiledCorpus::Compile(const std::string &text_file_name,
+                             const std::string &file_name,
+                             const Vocabulary &vocabulary) {
+  assert(!IsCompiledCorpus(text_file_name));
+  std::vector<uint64_t> offsets(1, 0);
+  std::vector<int> indices;
+  ReadableFile text_file(text_file_name);
+  std::string line;
+  while (text_file.GetLine(&line)) {
+    Data::ConvertWords(vocabulary, &line, &indices);
+    offsets.push_back(indices.size());
+  }
+
+  Header header;
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.word_size = vocabulary.GetVocabularySize() <= 65536 ?
+                     sizeof(uint16_t) : sizeof(uint32_t);
+  header.vocabulary_checksum = vocabulary.ComputeChecksum();
+  header.num_sentences = offsets.size() - 1;
+  header.num_words = indices.size();
+
+  std::ofstream file(file_name.c_str(), std::ios::out | std::ios::binary);
+  assert(file.good());
+  file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char *>(offsets.data()),
+             offsets.size() * sizeof(uint64_t));
+  if (header.word_size == sizeof(uint16_t)) {
+    const std::vector<uint16_t> words(indices.begin(), indices.end());
+    file.write(reinterpret_cast<const char *>(words.data()),
+               words.size() * sizeof(uint16_t));
+  } else {
+    const std::vector<uint32_t> words(indices.begin(), indices.end());
+    file.write(reinterpret_cast<const char *>(words.data()),
+               words.size() * sizeof(uint32_t));
+  }
+  assert(file.good());
+  file.close();
+}
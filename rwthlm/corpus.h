@@ -0,0 +1,84 @@
+/*
+ * Copyright 2014 RWTH Aachen University. All rights reserved.
+ *
+ * Licensed under the RWTH LM License (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include "vocabulary.h"
+
+// Pre-tokenized text (see --compile-corpus): the word indices of all
+// sentences (without sentence boundary tokens), 16 bit if the vocabulary
+// permits, preceded by the sentence offsets and the checksum of the
+// vocabulary. Reading maps the file into memory instead of parsing it.
+class CompiledCorpus {
+public:
+  CompiledCorpus(const std::string &file_name,
+                 const Vocabulary &vocabulary);
+
+  static bool IsCompiledCorpus(const std::string &file_name);
+
+  static void Compile(const std::string &text_file_name,
+                      const std::string &file_name,
+                      const Vocabulary &vocabulary);
+
+  size_t num_sentences() const {
+    return header_->num_sentences;
+  }
+
+  size_t num_words() const {
+    return header_->num_words;
+  }
+
+  // calls add(begin, end) with the word indices of the i-th sentence in the
+  // mapped file, of type uint16_t or uint32_t, e.g., to copy them without
+  // an intermediate vector
+  template <typename F>
+  void VisitSentence(const size_t i, F &add) const {
+    const uint64_t begin = offsets_[i], end = offsets_[i + 1];
+    if (header_->word_size == sizeof(uint16_t)) {
+      const uint16_t *words = static_cast<const uint16_t *>(words_);
+      add(words + begin, words + end);
+    } else {
+      const uint32_t *words = static_cast<const uint32_t *>(words_);
+      add(words + begin, words + end);
+    }
+  }
+
+  // appends the word indices of the i-th sentence
+  void GetSentence(const size_t i, std::vector<int> *indices) const {
+    const uint64_t begin = offsets_[i], end = offsets_[i + 1];
+    if (header_->word_size == sizeof(uint16_t)) {
+      const uint16_t *words = static_cast<const uint16_t *>(words_);
+      indices->insert(indices->end(), words + begin, words + end);
+    } else {
+      const uint32_t *words = static_cast<const uint32_t *>(words_);
+      indices->insert(indices->end(), words + begin, words + end);
+    }
+  }
+
+private:
+  struct Header {
+    char magic[8];
+    uint32_t version, word_size;
+    uint64_t vocabulary_checksum, num_sentences, num_words;
+  };
+
+  static const char kMagic[8];
+  static const uint32_t kVersion = 1;
+
+  boost::iostreams::mapped_file_source file_;
+  const Header *header_;
+  const uint64_t *offsets_;
+  const void *words_;
+};
@@ -12,21 +12,99 @@
  */
 #include <cassert>
 #include <cstdint>  // for int64_t
+#include <iterator>
+#include <numeric>
 #include <sstream>
 #include <boost/algorithm/string/trim.hpp>
+#include "corpus.h"
 #include "data.h"
 #include "file.h"
 
+namespace {
+
+// appends the words of a sentence of a compiled corpus, see ReadIndices()
+struct AddWordsTo {
+  SequenceStorage *data;
+
+  template <typename T>
+  void operator()(const T *begin, const T *end) {
+    data->AddWords(begin, end);
+  }
+};
+
+}  // namespace
+
+BatchMatrix::BatchMatrix(const Batch &batch) {
+  const SequenceStorage &sequences = *batch.sequences_;
+  if (batch.rows_) {
+    // continuous batching: rows are sorted by decreasing number of steps
+    const std::vector<SegmentVector> &rows = *batch.rows_;
+    width_ = rows.size();
+    int length = 0;
+    for (const Segment &segment : rows.front())
+      length += segment.end - segment.begin;
+    inputs_.resize(length * width_);
+    targets_.resize(length * width_);
+    sizes_.resize(length, 0);
+    resets_.resize(length * width_, false);
+    has_resets_.resize(length, false);
+    for (int i = 0; i < width_; ++i) {
+      int t = 0;
+      for (const Segment &segment : rows[i]) {
+        const int *words = sequences.GetWords(segment.sequence);
+        if (t > 0) {
+          resets_[t * width_ + i] = true;
+          has_resets_[t] = true;
+        }
+        for (int j = segment.begin; j < segment.end; ++j, ++t) {
+          inputs_[t * width_ + i] = words[j];
+          targets_[t * width_ + i] = words[j + 1];
+          ++sizes_[t];
+        }
+      }
+      assert(i == 0 || sizes_[t - 1] == i + 1);
+    }
+    return;
+  }
+
+  width_ = batch.end_index_ - batch.begin_index_;
+  const int length = width_ > 0 ?
+                     std::max(sequences.GetLength(*batch.begin_index_) - 1,
+                              0) : 0;
+  inputs_.resize(length * width_);
+  targets_.resize(length * width_);
+  sizes_.resize(length, 0);
+  has_resets_.resize(length, false);
+  // a sequence is active as long as all previous sequences are
+  int i = 0, active_length = length;
+  for (auto it = batch.begin_index_; it != batch.end_index_; ++it, ++i) {
+    active_length = std::min(active_length, sequences.GetLength(*it) - 1);
+    const int *words = sequences.GetWords(*it);
+    for (int t = 0; t < active_length; ++t) {
+      inputs_[t * width_ + i] = words[t];
+      targets_[t * width_ + i] = words[t + 1];
+      ++sizes_[t];
+    }
+  }
+}
+
 Data::Data(const std::string &data_file_name,
            const int max_batch_size,
            const int max_sequence_length,
            const WordWrappingType word_wrapping_type,
            const bool debug_no_sb,
+           const bool bucketing,
            ConstVocabularyPointer vocabulary)
     : max_batch_size_(max_batch_size),
       max_sequence_length_(max_sequence_length),
       debug_no_sb_(debug_no_sb),
-      vocabulary_(vocabulary) {
+      bucketing_(bucketing),
+      vocabulary_(vocabulary),
+      word_wrapping_type_(word_wrapping_type),
+      shard_size_(0),
+      num_prefetched_batches_(0),
+      is_shuffled_(false),
+      shuffle_seed_(0) {
   switch (word_wrapping_type) {
   case kConcatenated:
     PrepareDataSequenceWise(data_file_name, true);
@@ -37,149 +115,502 @@ Data::Data(const std::string &data_file_name,
   case kFixed:
     PrepareDataWithFixedLength(data_file_name);
     break;
+  case kContinuous:
+    PrepareDataSequenceWise(data_file_name, false);
+    break;
   }
+  FormBatches(sequences_, order_, ConstShardPointer(), &batches_);
 }
 
 Data::Data(const SequenceVector data,
            const int max_batch_size,
            const int max_sequence_length,
            ConstVocabularyPointer vocabulary)
-    : data_(data),
-      max_batch_size_(max_batch_size),
+    : max_batch_size_(max_batch_size),
       max_sequence_length_(max_sequence_length),
       debug_no_sb_(false),
-      vocabulary_(vocabulary) {
+      bucketing_(false),
+      vocabulary_(vocabulary),
+      word_wrapping_type_(kVerbatim),
+      shard_size_(0),
+      num_prefetched_batches_(0),
+      is_shuffled_(false),
+      shuffle_seed_(0) {
+  for (const Sequence &sequence : data) {
+    sequences_.AddSequence();
+    sequences_.AddWords(sequence.data(), sequence.data() + sequence.size());
+  }
+  order_.resize(sequences_.size());
+  std::iota(order_.begin(), order_.end(), 0);
+  FormBatches(sequences_, order_, ConstShardPointer(), &batches_);
+}
+
+Data::Data(const std::string &data_file_name,
+           const int max_batch_size,
+           const int max_sequence_length,
+           const WordWrappingType word_wrapping_type,
+           const bool debug_no_sb,
+           const bool bucketing,
+           ConstVocabularyPointer vocabulary,
+           const int shard_size,
+           const int num_prefetched_batches)
+    : max_batch_size_(max_batch_size),
+      max_sequence_length_(max_sequence_length),
+      debug_no_sb_(debug_no_sb),
+      bucketing_(bucketing),
+      vocabulary_(vocabulary),
+      data_file_name_(data_file_name),
+      word_wrapping_type_(word_wrapping_type),
+      shard_size_(shard_size),
+      num_prefetched_batches_(num_prefetched_batches),
+      is_shuffled_(false),
+      shuffle_seed_(0) {
+  assert(shard_size > 0 && num_prefetched_batches > 0);
+  assert(boost::filesystem::exists(data_file_name));
 }
 
 int64_t Data::ReadIndices(const std::string &data_file_name,
                           const ConstVocabularyPointer &vocabulary,
-                          SequenceVector *data) {
-  int64_t num_running_words = 0;
-  assert(data->empty());
+                          const bool is_arranged,
+                          SequenceStorage *data) {
+  assert(data->size() == 0);
+  const int sb = vocabulary->sb_index();
+  const bool prepends_sb = is_arranged && !debug_no_sb_;
   // read text from file
+  if (CompiledCorpus::IsCompiledCorpus(data_file_name)) {
+    // no parsing needed: copied from the mapped file in one pass
+    const CompiledCorpus corpus(data_file_name, *vocabulary);
+    const size_t num_sentences = corpus.num_sentences();
+    const int num_sbs = (debug_no_sb_ ? 0 : 1) + (prepends_sb ? 1 : 0);
+    data->Reserve(num_sentences,
+                  corpus.num_words() + num_sbs * num_sentences);
+    AddWordsTo add_words = { data };
+    for (size_t i = 0; i < num_sentences; ++i) {
+      data->AddSequence();
+      if (prepends_sb)
+        data->AddWord(sb);
+      corpus.VisitSentence(i, add_words);
+      if (!debug_no_sb_)
+        data->AddWord(sb);
+    }
+    return data->num_words();
+  }
+  Sequence indices;
   ReadableFile file(data_file_name);
-  std::string line, word;
+  std::string line;
   while (file.GetLine(&line)) {
-    // istringstream does not work with trailing whitespace (duplicate words)
-    boost::trim(line);
-    assert(!boost::algorithm::starts_with(line, "<s>"));
-    assert(!boost::algorithm::ends_with(line, "</s>"));
-    std::istringstream iss(line);
-    std::vector<int> indices;
-    while (!iss.eof()) {
-      iss >> word;
-      indices.push_back(vocabulary->GetIndex(word));
-    }
-    assert(!vocabulary->IsSentenceBoundary(word));
-    if (!debug_no_sb_)
-      indices.push_back(vocabulary->sb_index());
-    num_running_words += indices.size();
-    data->push_back(indices);
+    indices.clear();
+    ConvertLine(&line, &indices);
+    data->AddSequence();
+    if (prepends_sb)
+      data->AddWord(sb);
+    data->AddWords(indices.data(), indices.data() + indices.size());
   }
-  return num_running_words;
+  return data->num_words();
+}
+
+void Data::ConvertWords(const Vocabulary &vocabulary,
+                        std::string *line,
+                        Sequence *indices) {
+  if (vocabulary.is_character_level()) {
+    vocabulary.ConvertCharacters(*line, indices);
+    return;
+  }
+  // istringstream does not work with trailing whitespace (duplicate words)
+  boost::trim(*line);
+  assert(!boost::algorithm::starts_with(*line, "<s>"));
+  assert(!boost::algorithm::ends_with(*line, "</s>"));
+  std::istringstream iss(*line);
+  std::string word;
+  while (!iss.eof()) {
+    iss >> word;
+    indices->push_back(vocabulary.GetIndex(word));
+  }
+  assert(!vocabulary.IsSentenceBoundary(word));
+}
+
+int64_t Data::ConvertLine(std::string *line, Sequence *indices) const {
+  ConvertWords(*vocabulary_, line, indices);
+  if (!debug_no_sb_)
+    indices->push_back(vocabulary_->sb_index());
+  return indices->size();
 }
 
 void Data::PrepareDataSequenceWise(const std::string &data_file_name,
                                    const bool concatenate) {
-  SequenceVector indices;
-  ReadIndices(data_file_name, vocabulary_, &indices);
-  for (Sequence line : indices) {
-    Append(max_sequence_length_ - 1, concatenate, &line);
+  if (concatenate) {
+    SequenceStorage lines;
+    ReadIndices(data_file_name, vocabulary_, false, &lines);
+    int last_word = vocabulary_->sb_index();
+    ArrangeSequenceWise(concatenate, lines, &last_word, &sequences_);
+  } else {
+    // the lines are the sequences
+    ReadIndices(data_file_name, vocabulary_, true, &sequences_);
+  }
+  order_.resize(sequences_.size());
+  std::iota(order_.begin(), order_.end(), 0);
+  // continuous batching cuts sequences at the end of a batch
+  if (word_wrapping_type_ == kContinuous)
+    return;
+  Sort(sequences_, nullptr, &order_);
+  for (size_t i = 0; i < sequences_.size(); ++i) {
+    assert(sequences_.GetLength(i) <= max_sequence_length_);
   }
+}
 
+void Data::PrepareDataWithFixedLength(const std::string &data_file_name) {
+  SequenceStorage lines;
+  ReadIndices(data_file_name, vocabulary_, false, &lines);
+  int last_word = vocabulary_->sb_index();
+  ArrangeWithFixedLength(lines, &last_word, &sequences_);
+  order_.resize(sequences_.size());
+  std::iota(order_.begin(), order_.end(), 0);
+}
+
+void Data::ArrangeSequenceWise(const bool concatenate,
+                               const SequenceStorage &lines,
+                               int *last_word,
+                               SequenceStorage *data) const {
+  assert(data->size() == 0);
+  const int max_length = max_sequence_length_ - 1;
+  // number of words of the current sequence, excl. the prepended word
+  int length = 0;
   // prepend last token of previous sequence
-  if (!debug_no_sb_) {
-    for (size_t i = 0; i < data_.size(); ++i) {
-      data_[i].insert(data_[i].begin(),
-                      i == 0 ? vocabulary_->sb_index() : data_[i - 1].back());
+  auto add_sequence = [&]() {
+    data->AddSequence();
+    if (!debug_no_sb_)
+      data->AddWord(*last_word);
+    length = 0;
+  };
+  auto add_words = [&](const int *begin, const int *end) {
+    data->AddWords(begin, end);
+    length += end - begin;
+    if (end > begin)
+      *last_word = end[-1];
+  };
+
+  for (size_t i = 0; i < lines.size(); ++i) {
+    const int *begin = lines.GetWords(i), *end = begin + lines.GetLength(i);
+    if (!concatenate) {
+      add_sequence();
+      add_words(begin, end);
+      continue;
+    }
+    if (data->size() == 0)
+      add_sequence();
+    if (length + (end - begin) <= max_length) {
+      // sentence can be appended
+      add_words(begin, end);
+    } else if (end - begin <= max_length) {
+      // sentence alone is not too long
+      add_sequence();
+      add_words(begin, end);
+    } else {
+      // break at maximum lengths + append
+      while (begin != end) {
+        const int size = std::min<int64_t>(max_length - length, end - begin);
+        add_words(begin, begin + size);
+        begin += size;
+        if (begin != end)
+          add_sequence();
+      }
     }
-  }
-  SortBatches();
-  for (auto &sentence : data_) {
-    assert(sentence.size() <= static_cast<size_t>(max_sequence_length_));
   }
 }
 
-void Data::PrepareDataWithFixedLength(const std::string &data_file_name) {
-  SequenceVector indices;
-  int64_t num_running_words = ReadIndices(data_file_name, vocabulary_,
-                                          &indices);
-  assert(data_.empty());
-  data_.resize(max_batch_size_, Sequence());
-  int j = 0,
-      batch = 0,
-      // number of words per batch (incl. final <sb>, excl. overlapping words)
-      n = static_cast<int>(num_running_words / max_batch_size_) +
-          (static_cast<int>(num_running_words % max_batch_size_) > 0),
-      last_word = vocabulary_->sb_index();
-  for (Sequence line : indices) {
-    // split current line into BPTT sequences
-    while (line.size() > 0) {
+void Data::ArrangeWithFixedLength(const SequenceStorage &lines,
+                                  int *last_word,
+                                  SequenceStorage *data) const {
+  assert(data->size() == 0);
+  const int64_t num_running_words = lines.num_words();
+  if (num_running_words == 0)
+    return;
+  // the words are split into max_batch_size_ consecutive parts, part b
+  // starting at word begin[b], each of which is processed by one row of the
+  // batches (incl. final <sb>, excl. overlapping words)
+  const int *words = lines.GetWords(0);
+  std::vector<int64_t> begin(max_batch_size_ + 1, 0);
+  for (int b = 0; b < max_batch_size_; ++b) {
+    begin[b + 1] = begin[b] + num_running_words / max_batch_size_ +
+                   (b < num_running_words % max_batch_size_);
+  }
+  // split parts into BPTT sequences, the first part is the longest
+  const int length = max_sequence_length_ - 1;
+  for (int64_t offset = 0; offset < begin[1]; offset += length) {
+    for (int b = 0; b < max_batch_size_; ++b) {
+      const int64_t first = begin[b] + offset;
+      if (first >= begin[b + 1])
+        break;
+      const int64_t last = std::min(first + length, begin[b + 1]);
+      data->AddSequence();
       // last word used for probability computation, but not yet for training
-      if (data_[j].empty())
-        data_[j].push_back(last_word);
-      const int num_move = std::min(std::min(static_cast<int>(line.size()),
-          max_sequence_length_ - static_cast<int>(data_[j].size())), n);
-      data_[j].insert(data_[j].end(), line.begin(), line.begin() + num_move);
-      line.erase(line.begin(), line.begin() + num_move);
-      n -= num_move;
-      last_word = data_[j].back();
-      // next BPTT sequence?
-      if (data_[j].size() == max_sequence_length_) {
-        if (batch == 0)
-          data_.resize(data_.size() + max_batch_size_, Sequence());
-        j += max_batch_size_;
-      }
-      // next batch?
-      if (n == 0 && batch != max_batch_size_ - 1) {
-        n = static_cast<int>(num_running_words / max_batch_size_) +
-            (++batch < static_cast<int>(num_running_words % max_batch_size_));
-        j = batch;
+      data->AddWord(first == 0 ? *last_word : words[first - 1]);
+      data->AddWords(words + first, words + last);
+    }
+  }
+  *last_word = words[num_running_words - 1];
+}
+
+void Data::SortLexicographically(const SequenceStorage &sequences,
+                                 IndexVector *order) {
+  order->resize(sequences.size());
+  std::iota(order->begin(), order->end(), 0);
+  std::sort(order->begin(), order->end(), [&sequences](int i, int j)
+            { return sequences.IsLess(i, j); });
+}
+
+void Data::SortBatches(const SequenceStorage &sequences,
+                       IndexVector *order) const {
+  IndexVector::iterator begin = order->begin(), end;
+  while (begin != order->end()) {
+    end = order->end() - begin >= max_batch_size_ ?
+          begin + max_batch_size_ : order->end();
+    std::sort(begin, end, [&sequences](int i, int j)
+              { return sequences.GetLength(i) > sequences.GetLength(j); });
+    begin = end;
+  }
+}
+
+void Data::FormBatches(const SequenceStorage &sequences,
+                       const IndexVector &order,
+                       ConstShardPointer shard,
+                       BatchVector *batches) const {
+  batches->clear();
+  if (word_wrapping_type_ == kContinuous) {
+    PackContinuously(sequences, order, shard, batches);
+    return;
+  }
+  for (size_t i = 0; i < order.size(); i += max_batch_size_) {
+    batches->push_back(Batch(&sequences,
+                             order.begin() + i,
+                             order.begin() + std::min<size_t>(
+                                 i + max_batch_size_, order.size()),
+                             shard));
+  }
+}
+
+void Data::PackContinuously(const SequenceStorage &sequences,
+                            const IndexVector &order,
+                            ConstShardPointer shard,
+                            BatchVector *batches) const {
+  const int length = max_sequence_length_ - 1;
+  assert(length > 0);
+  // per row: the current sequence (-1 if none) and its next step
+  std::vector<int> current(max_batch_size_, -1), position(max_batch_size_, 0);
+  size_t next = 0;
+  auto fetch = [&](const int i) {
+    current[i] = -1;
+    // a sequence of less than two words has nothing to predict
+    while (next < order.size() && sequences.GetLength(order[next]) < 2)
+      ++next;
+    if (next < order.size()) {
+      current[i] = order[next++];
+      position[i] = 0;
+    }
+  };
+  for (int i = 0; i < max_batch_size_; ++i)
+    fetch(i);
+
+  while (true) {
+    std::vector<SegmentVector> segments(max_batch_size_);
+    std::vector<int> num_steps(max_batch_size_, 0);
+    while (true) {
+      // the row whose sequence ends first takes the next sequence
+      int i = -1;
+      for (int j = 0; j < max_batch_size_; ++j) {
+        if (current[j] >= 0 && num_steps[j] < length &&
+            (i < 0 || num_steps[j] < num_steps[i]))
+          i = j;
       }
+      if (i < 0)
+        break;
+      const int last = sequences.GetLength(current[i]) - 1,
+                end = std::min(last, position[i] + length - num_steps[i]);
+      segments[i].push_back(Segment{current[i], position[i], end});
+      num_steps[i] += end - position[i];
+      position[i] = end;
+      if (end == last)
+        fetch(i);
+    }
+
+    // rows running out of sequences go last (only in the final batches)
+    IndexVector rows_order;
+    for (int i = 0; i < max_batch_size_; ++i) {
+      if (num_steps[i] > 0)
+        rows_order.push_back(i);
     }
+    if (rows_order.empty())
+      break;
+    std::stable_sort(rows_order.begin(), rows_order.end(),
+                     [&num_steps](int i, int j)
+                     { return num_steps[i] > num_steps[j]; });
+    std::shared_ptr<std::vector<SegmentVector>> rows =
+        std::make_shared<std::vector<SegmentVector>>();
+    for (int i : rows_order)
+      rows->push_back(segments[i]);
+    batches->push_back(Batch(&sequences, rows, shard));
   }
-  // we may have added too many empty lines in advance
-  while (data_.back().empty())
-    data_.pop_back();
 }
 
-void Data::Append(const size_t max_length,
-                  const bool concatenate,
-                  Sequence *current) {
-  if (concatenate) {
-    if (data_.empty())
-      data_.push_back(Sequence());
-    Sequence *last = &data_.back();
-    if (last->size() + current->size() <= max_length) {
-      // sentence can be appended
-      last->insert(last->end(), current->begin(), current->end());
-    } else if (current->size() <= max_length) {
-      // sentence alone is not too long
-      data_.push_back(*current);
+void Data::TruncateSequences(const int length) {
+  SequenceStorage sequences;
+  for (size_t i = 0; i < sequences_.size(); ++i) {
+    assert(sequences_.GetLength(i) >= length);
+    sequences.AddSequence();
+    sequences.AddWords(sequences_.GetWords(i),
+                       sequences_.GetWords(i) + length);
+  }
+  sequences_ = sequences;
+  FormBatches(sequences_, order_, ConstShardPointer(), &batches_);
+}
+
+void Data::SortBuckets(const SequenceStorage &sequences,
+                       Random *random,
+                       IndexVector *order) const {
+  // stable: sequences of equal length stay in random order
+  std::stable_sort(order->begin(), order->end(), [&sequences](int i, int j)
+                   { return sequences.GetLength(i) > sequences.GetLength(j); });
+  if (random == nullptr)
+    return;
+  // shuffle full batches, a final partial batch stays last
+  const size_t num_batches = order->size() / max_batch_size_;
+  IndexVector batches(num_batches);
+  std::iota(batches.begin(), batches.end(), 0);
+  std::random_shuffle(batches.begin(), batches.end(), *random);
+  const IndexVector sorted_order(*order);
+  for (size_t i = 0; i < num_batches; ++i) {
+    std::copy(sorted_order.begin() + batches[i] * max_batch_size_,
+              sorted_order.begin() + (batches[i] + 1) * max_batch_size_,
+              order->begin() + i * max_batch_size_);
+  }
+}
+
+DataStream::DataStream(const Data &data)
+    : data_(data),
+      is_finished_(false),
+      is_stopped_(false),
+      thread_(&DataStream::Read, this) {
+}
+
+DataStream::~DataStream() {
+  // the trainer may stop before the end of the data
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    is_stopped_ = true;
+  }
+  is_not_full_.notify_all();
+  thread_.join();
+}
+
+bool DataStream::Next(Batch *batch) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  is_not_empty_.wait(lock, [this] { return !batches_.empty() ||
+                                           is_finished_; });
+  if (batches_.empty())
+    return false;
+  *batch = batches_.front();
+  batches_.pop_front();
+  lock.unlock();
+  is_not_full_.notify_one();
+  return true;
+}
+
+void DataStream::Read() {
+  Random random(data_.shuffle_seed_);
+  // a compiled corpus is read sentence by sentence from the mapped file
+  std::unique_ptr<CompiledCorpus> corpus;
+  std::unique_ptr<ReadableFile> file;
+  if (CompiledCorpus::IsCompiledCorpus(data_.data_file_name_))
+    corpus.reset(new CompiledCorpus(data_.data_file_name_, *data_.vocabulary_));
+  else
+    file.reset(new ReadableFile(data_.data_file_name_));
+  SequenceStorage lines;
+  Sequence indices;
+  int last_word = data_.vocabulary_->sb_index();
+  std::string line;
+  size_t num_sentences = 0;
+  bool is_stopped = false;
+  while (!is_stopped) {
+    indices.clear();
+    if (corpus) {
+      if (num_sentences == corpus->num_sentences())
+        break;
+      corpus->GetSentence(num_sentences, &indices);
+      if (!data_.debug_no_sb_)
+        indices.push_back(data_.vocabulary_->sb_index());
     } else {
-      // break at maximum lengths + append
-      while (current->size() > 0) {
-        const int size = std::min(max_length - last->size(), current->size());
-        last->insert(last->end(), current->begin(), current->begin() + size);
-        current->erase(current->begin(), current->begin() + size);
-        if (current->size() > 0) {
-          data_.push_back(std::vector<int>());
-          last = &data_.back();
-        }
-      }
+      if (!file->GetLine(&line))
+        break;
+      data_.ConvertLine(&line, &indices);
     }
-  } else {
-    data_.push_back(*current);
+    lines.AddSequence();
+    lines.AddWords(indices.data(), indices.data() + indices.size());
+    ++num_sentences;
+    if (lines.size() == static_cast<size_t>(data_.shard_size_)) {
+      is_stopped = !ProcessShard(lines, &random, &last_word);
+      lines = SequenceStorage();
+    }
+  }
+  if (!is_stopped && lines.size() > 0)
+    ProcessShard(lines, &random, &last_word);
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    is_finished_ = true;
   }
+  is_not_empty_.notify_all();
 }
 
-void Data::SortBatches() {
-  SequenceVector::iterator begin = data_.begin(), end;
-  while (begin != data_.end()) {
-    end = data_.end() - begin >= max_batch_size_ ?
-          begin + max_batch_size_ : data_.end();
-    std::sort(begin, end, [](const Sequence &s, const Sequence &t)
-              { return s.size() > t.size(); });
-    begin = end;
+bool DataStream::ProcessShard(const SequenceStorage &lines,
+                              Random *random,
+                              int *last_word) {
+  std::shared_ptr<Shard> shard = std::make_shared<Shard>();
+  switch (data_.word_wrapping_type_) {
+  case kConcatenated:
+    data_.ArrangeSequenceWise(true, lines, last_word, &shard->sequences);
+    break;
+  case kVerbatim:
+  case kContinuous:
+    data_.ArrangeSequenceWise(false, lines, last_word, &shard->sequences);
+    break;
+  case kFixed:
+    data_.ArrangeWithFixedLength(lines, last_word, &shard->sequences);
+    break;
   }
+  // same order as for data held in memory
+  IndexVector &order = shard->order;
+  if (data_.is_shuffled_) {
+    Data::SortLexicographically(shard->sequences, &order);
+    std::random_shuffle(order.begin(), order.end(), *random);
+  } else {
+    order.resize(shard->sequences.size());
+    std::iota(order.begin(), order.end(), 0);
+  }
+  if ((data_.is_shuffled_ || data_.word_wrapping_type_ != kFixed) &&
+      data_.word_wrapping_type_ != kContinuous) {
+    data_.Sort(shard->sequences,
+               data_.is_shuffled_ ? random : nullptr,
+               &order);
+  }
+
+  BatchVector batches;
+  data_.FormBatches(shard->sequences, order, shard, &batches);
+  for (const Batch &batch : batches) {
+    if (!Push(batch))
+      return false;
+  }
+  return true;
+}
+
+bool DataStream::Push(const Batch &batch) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  is_not_full_.wait(lock, [this] {
+      return batches_.size() < static_cast<size_t>(
+          data_.num_prefetched_batches_) || is_stopped_; });
+  if (is_stopped_)
+    return false;
+  batches_.push_back(batch);
+  lock.unlock();
+  is_not_empty_.notify_one();
+  return true;
 }
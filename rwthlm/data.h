@@ -13,158 +13,255 @@
 #pragma once
 #include <cassert>
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <numeric>
+#include <thread>
 #include <vector>
 #include <boost/iterator/iterator_facade.hpp>
+#include "function.h"
 #include "random.h"
 #include "vocabulary.h"
 
 typedef std::vector<int> Sequence;
 typedef std::vector<Sequence> SequenceVector;
+typedef std::vector<int> IndexVector;
 
 enum WordWrappingType {
-  kConcatenated, kFixed, kVerbatim
+  kConcatenated, kFixed, kVerbatim, kContinuous
 };
 
-class BatchIterator : public boost::iterator_facade<BatchIterator,
-    const Sequence, boost::bidirectional_traversal_tag> {
+// All sequences in one array: sequence i consists of the words
+// words_[offsets_[i]], ..., words_[offsets_[i + 1] - 1].
+class SequenceStorage {
 public:
-  BatchIterator() : position_(0), offset_(0) {
-    // forward traversal iterators require default constructor (17.6.3.1)
-  }
-
-  BatchIterator(const SequenceVector::const_iterator &begin,
-                const SequenceVector::const_iterator &end,
-                const int position, const int offset)
-      : begin_(begin), end_(end), position_(position), offset_(offset) {
-    assert(offset == 0 || offset == 1);
-    for (auto it = begin; it != end && !it->empty(); ++it) {
-      if (position >= static_cast<int>(it->size() - 1) + offset)
-        break;
-      slice_.push_back(it->at(position));
-    }
+  SequenceStorage() : offsets_(1, 0) {
   }
 
-private:
-  friend class boost::iterator_core_access;
+  size_t size() const {
+    return offsets_.size() - 1;
+  }
 
-  void increment() {
-    ++position_;
-    slice_.clear();
-    for (auto it = begin_; it != end_; ++it) {
-      if (position_ >= static_cast<int>(it->size()) -1 + offset_)
-        break;
-      slice_.push_back((*it)[position_]);
-    }
+  int64_t num_words() const {
+    return words_.size();
   }
 
-  void decrement() {
-    slice_.clear();
-    --position_;
-    for (auto it = begin_; it != end_; ++it) {
-      if (position_ < offset_ || position_ >= 
-          static_cast<int>(it->size()) - 1 + offset_)
-        break;
-      slice_.push_back((*it)[position_]);
-    }
+  int GetLength(const int i) const {
+    return static_cast<int>(offsets_[i + 1] - offsets_[i]);
   }
 
-  bool equal(const BatchIterator &other) const {
-    return position_ == other.position_;
+  const int *GetWords(const int i) const {
+    return words_.data() + offsets_[i];
   }
 
-  const Sequence &dereference() const {
-    return slice_;
+  int GetWord(const int i, const int position) const {
+    return words_[offsets_[i] + position];
   }
 
-  int position_;
-  Sequence slice_;
-  const int offset_;
-  const SequenceVector::const_iterator begin_, end_;
-};
+  // starts a new, empty sequence
+  void AddSequence() {
+    offsets_.push_back(words_.size());
+  }
 
-class Batch {
-public:
-  Batch(const SequenceVector::const_iterator &begin_sequence,
-        const SequenceVector::const_iterator &end_sequence)
-      : begin_sequence_(begin_sequence), end_sequence_(end_sequence) {
+  // the following append to the last sequence
+  void AddWord(const int word) {
+    assert(size() > 0);
+    words_.push_back(word);
+    ++offsets_.back();
   }
 
-  BatchIterator Begin(const int offset) const {
-    return BatchIterator(begin_sequence(), end_sequence(), offset, offset);
+  template <typename T>
+  void AddWords(const T *begin, const T *end) {
+    assert(size() > 0);
+    words_.insert(words_.end(), begin, end);
+    offsets_.back() = words_.size();
   }
 
-  BatchIterator End(const int offset) const {
-    return BatchIterator(begin_sequence(), end_sequence(),
-                         begin_sequence()->size() - 1 + offset, offset);
+  void Reserve(const size_t num_sequences, const int64_t num_words) {
+    offsets_.reserve(offsets_.size() + num_sequences);
+    words_.reserve(words_.size() + num_words);
   }
 
-  BatchIterator begin() const {
-    return Begin(1);
+  // lexicographical order of sequences
+  bool IsLess(const int i, const int j) const {
+    return std::lexicographical_compare(GetWords(i),
+                                        GetWords(i) + GetLength(i),
+                                        GetWords(j),
+                                        GetWords(j) + GetLength(j));
   }
 
-  BatchIterator end() const {
-    return End(1);
+private:
+  std::vector<int> words_;
+  std::vector<size_t> offsets_;
+};
+
+// a shard of streamed data, see DataStream
+struct Shard {
+  SequenceStorage sequences;
+  IndexVector order;
+};
+
+typedef std::shared_ptr<const Shard> ConstShardPointer;
+
+// Continuous batching: a row of a batch runs the steps [begin, end) of a
+// sequence, step j predicting word j + 1 from word j.
+struct Segment {
+  int sequence, begin, end;
+};
+
+typedef std::vector<Segment> SegmentVector;
+// the segments of each row of a batch, one after another
+typedef std::shared_ptr<const std::vector<SegmentVector>> ConstRowsPointer;
+
+// The sequences of a batch are given by a range of sequence indices, or with
+// continuous batching by the segments of each row.
+class Batch {
+public:
+  Batch() : sequences_(nullptr) {
+  }
+
+  // a batch of streamed data keeps its shard alive
+  Batch(const SequenceStorage *sequences,
+        const IndexVector::const_iterator &begin_index,
+        const IndexVector::const_iterator &end_index,
+        ConstShardPointer shard)
+      : sequences_(sequences), begin_index_(begin_index),
+        end_index_(end_index), shard_(shard) {
+  }
+
+  Batch(const SequenceStorage *sequences,
+        ConstRowsPointer rows,
+        ConstShardPointer shard)
+      : sequences_(sequences), rows_(rows), shard_(shard) {
   }
 
 private:
-  friend class DataIterator;
+  friend class BatchMatrix;
+
+  const SequenceStorage *sequences_;
+  IndexVector::const_iterator begin_index_, end_index_;
+  ConstRowsPointer rows_;
+  ConstShardPointer shard_;
+};
+
+typedef std::vector<Batch> BatchVector;
+
+// A batch in time-major order, built once per batch: at time step t, the i-th
+// row of the batch predicts targets_[t * width_ + i] from inputs_[t * width_ +
+// i]. Rows are sorted by decreasing length, so at time step t only the first
+// rows of the batch are active. With continuous batching, resets_ marks the
+// rows starting a new sentence.
+class BatchMatrix {
+public:
+  explicit BatchMatrix(const Batch &batch);
 
-  SequenceVector::const_iterator begin_sequence() const {
-    return begin_sequence_;
+  // number of time steps
+  int length() const {
+    return sizes_.size();
   }
 
-  SequenceVector::const_iterator end_sequence() const {
-    return end_sequence_;
+  // the words to be predicted at time step t
+  Slice GetSlice(const int t) const {
+    return Slice(targets_.data() + t * width_,
+                 sizes_[t],
+                 GetResets(t),
+                 t + 1 < length() ? GetResets(t + 1) : nullptr);
   }
 
-  void set_begin_sequence(const SequenceVector::const_iterator &begin_sequence) {
-    begin_sequence_ = begin_sequence;
+  // the words the prediction at time step t is based on
+  const int *GetInputs(const int t) const {
+    return inputs_.data() + t * width_;
   }
 
-  void set_end_sequence(const SequenceVector::const_iterator &end_sequence) {
-    end_sequence_ = end_sequence;
+private:
+  const char *GetResets(const int t) const {
+    return has_resets_[t] ? resets_.data() + t * width_ : nullptr;
   }
 
-  SequenceVector::const_iterator begin_sequence_, end_sequence_;
+  int width_;
+  std::vector<int> inputs_, targets_, sizes_;
+  std::vector<char> resets_, has_resets_;
 };
 
+class Data;
+
+// Reads training data in a background thread: The lines of a shard are
+// converted into sequences and batches just like Data does it for the whole
+// file, and the batches are queued until the trainer asks for them. At most
+// num_prefetched_batches batches are kept in memory (plus the current shard).
+class DataStream {
+public:
+  DataStream(const Data &data);
+
+  virtual ~DataStream();
+
+  // Waits for the next batch, returns false at the end of the data.
+  bool Next(Batch *batch);
+
+private:
+  void Read();
+
+  bool ProcessShard(const SequenceStorage &lines,
+                    Random *random,
+                    int *last_word);
+
+  bool Push(const Batch &batch);
+
+  const Data &data_;
+  std::mutex mutex_;
+  std::condition_variable is_not_empty_, is_not_full_;
+  std::deque<Batch> batches_;
+  bool is_finished_, is_stopped_;
+  std::thread thread_;
+};
+
+typedef std::shared_ptr<DataStream> DataStreamPointer;
+
 class DataIterator : public boost::iterator_facade<DataIterator, const Batch,
     boost::incrementable_traversal_tag> {
 public:
-  DataIterator(const SequenceVector::const_iterator &begin,
-               const SequenceVector::const_iterator &end,
-               const int max_batch_size)
-      : batch_(begin, end - begin >= max_batch_size ?
-               begin + max_batch_size : end),
-        data_end_(end),
-        max_batch_size_(max_batch_size) {
+  DataIterator(const BatchVector::const_iterator &batch)
+      : batch_(batch),
+        is_streaming_(false) {
+  }
+
+  // streamed data, the end is denoted by a null stream
+  DataIterator(DataStreamPointer stream)
+      : is_streaming_(true),
+        stream_(stream) {
+    increment();
   }
 
 private:
   friend class boost::iterator_core_access;
 
   void increment() {
-    batch_.set_begin_sequence(data_end_ - batch_.begin_sequence() >
-                              max_batch_size_ ? batch_.begin_sequence() +
-                              max_batch_size_ : data_end_);
-    batch_.set_end_sequence(data_end_ - batch_.end_sequence() >
-                            max_batch_size_ ? batch_.end_sequence() +
-                            max_batch_size_ : data_end_);
+    if (is_streaming_) {
+      if (!stream_ || !stream_->Next(&streamed_batch_))
+        stream_.reset();
+      return;
+    }
+    ++batch_;
   }
 
   bool equal(const DataIterator &other) const {
-    return batch_.begin_sequence() == other.batch_.begin_sequence();
+    if (is_streaming_)
+      return stream_ == other.stream_;
+    return batch_ == other.batch_;
   }
 
   const Batch &dereference() const {
-    return batch_;
+    return is_streaming_ ? streamed_batch_ : *batch_;
   }
 
-  const int max_batch_size_;
-  const SequenceVector::const_iterator data_end_;
-  Batch batch_;
+  BatchVector::const_iterator batch_;
+  Batch streamed_batch_;
+  const bool is_streaming_;
+  DataStreamPointer stream_;
 };
 
 class Data {
@@ -174,6 +271,7 @@ public:
        const int max_sequence_length,
        const WordWrappingType word_wrapping_type,
        const bool debug_no_sb,
+       const bool bucketing,
        ConstVocabularyPointer vocabulary);
 
   Data(const SequenceVector data,
@@ -181,22 +279,49 @@ public:
        const int max_sequence_length,
        ConstVocabularyPointer vocabulary);
 
+  // Streaming: data is read in shards of shard_size lines while iterating.
+  // Each shard is arranged (and shuffled) on its own.
+  Data(const std::string &data_file_name,
+       const int max_batch_size,
+       const int max_sequence_length,
+       const WordWrappingType word_wrapping_type,
+       const bool debug_no_sb,
+       const bool bucketing,
+       ConstVocabularyPointer vocabulary,
+       const int shard_size,
+       const int num_prefetched_batches);
+
   void Shuffle(Random *random) {
-    // sort: current shuffling result shall not depend on previous shuffling
-    std::sort(data_.begin(), data_.end());
-    std::random_shuffle(data_.begin(), data_.end(), *random);
-    SortBatches();
+    if (is_streaming()) {
+      // the next stream shuffles its shards with this seed
+      shuffle_seed_ = (*random)(std::numeric_limits<int>::max());
+      is_shuffled_ = true;
+      return;
+    }
+    // start from sorted order: current shuffling result shall not depend on
+    // previous shuffling
+    if (sorted_order_.empty())
+      SortLexicographically(sequences_, &sorted_order_);
+    order_ = sorted_order_;
+    std::random_shuffle(order_.begin(), order_.end(), *random);
+    if (word_wrapping_type_ != kContinuous)
+      Sort(sequences_, random, &order_);
+    FormBatches(sequences_, order_, ConstShardPointer(), &batches_);
+  }
+
+  bool is_streaming() const {
+    return shard_size_ > 0;
   }
 
   int64_t CountNumRunningWords() const {
+    assert(!is_streaming());
     // subtract one for sentence begin token
-    return std::accumulate(data_.begin(), data_.end(), 0LL,
-                           [](const int64_t sum, const Sequence &s)
-                           { return sum + s.size() - 1; });
+    return sequences_.num_words() - sequences_.size();
   }
 
   int GetNumBatches() const {
-    return (data_.size() + max_batch_size() - 1) / max_batch_size();
+    assert(!is_streaming());
+    return batches_.size();
   }
 
   int GetVocabularySize() const {
@@ -204,39 +329,119 @@ public:
   }
 
   DataIterator begin() const {
-    return DataIterator(data_.begin(), data_.end(), max_batch_size_);
+    if (is_streaming())
+      return DataIterator(std::make_shared<DataStream>(*this));
+    return DataIterator(batches_.begin());
   }
 
   DataIterator end() const {
-    return DataIterator(data_.end(), data_.end(), max_batch_size_);
+    if (is_streaming())
+      return DataIterator(DataStreamPointer());
+    return DataIterator(batches_.end());
   }
 
   int max_batch_size() const {
     return max_batch_size_;
   }
 
+  // each starting with the history of its first prediction, e.g., <sb>
+  const SequenceStorage &sequences() const {
+    assert(!is_streaming());
+    return sequences_;
+  }
+
+  // Converts the words (or with a character level vocabulary, the characters)
+  // of a line to indices, without sentence boundaries.
+  static void ConvertWords(const Vocabulary &vocabulary,
+                           std::string *line,
+                           Sequence *indices);
+
 private:
+  friend class DataStream;
   friend class GradientTest;
 
+  // With is_arranged, each line becomes a sequence that starts with <sb>
+  // (unless debug_no_sb), as ArrangeSequenceWise() without concatenation
+  // would arrange it, so that there is no second copy of the data.
   int64_t ReadIndices(const std::string &data_file_name,
                       const ConstVocabularyPointer &vocabulary,
-                      SequenceVector *data);
+                      const bool is_arranged,
+                      SequenceStorage *data);
+
+  int64_t ConvertLine(std::string *line, Sequence *indices) const;
 
   void PrepareDataSequenceWise(const std::string &data_file_name,
                                const bool concatenate);
 
   void PrepareDataWithFixedLength(const std::string &data_file_name);
 
-  void Append(const size_t max_length,
-              const bool concatenate,
-              Sequence *current);
+  // Both arrange lines into sequences, starting with last_word (the last
+  // word of the previous sequence), and update last_word.
+  void ArrangeSequenceWise(const bool concatenate,
+                           const SequenceStorage &lines,
+                           int *last_word,
+                           SequenceStorage *data) const;
+
+  void ArrangeWithFixedLength(const SequenceStorage &lines,
+                              int *last_word,
+                              SequenceStorage *data) const;
+
+  static void SortLexicographically(const SequenceStorage &sequences,
+                                    IndexVector *order);
+
+  void SortBatches(const SequenceStorage &sequences,
+                   IndexVector *order) const;
+
+  // Sorts all sequences (not only those of a batch) by decreasing length, so
+  // that a batch keeps its full width for (nearly) all time steps. Given
+  // random, the order of the batches is shuffled.
+  void SortBuckets(const SequenceStorage &sequences,
+                   Random *random,
+                   IndexVector *order) const;
+
+  // sorts batches or buckets, see above
+  void Sort(const SequenceStorage &sequences,
+            Random *random,
+            IndexVector *order) const {
+    if (bucketing_)
+      SortBuckets(sequences, random, order);
+    else
+      SortBatches(sequences, order);
+  }
 
-  void SortBatches();
+  // Cuts the sequences in the given order into batches of consecutive
+  // sequences, or packs them continuously, see below.
+  void FormBatches(const SequenceStorage &sequences,
+                   const IndexVector &order,
+                   ConstShardPointer shard,
+                   BatchVector *batches) const;
+
+  // Continuous batching: Each row of a batch runs max_sequence_length_ - 1
+  // time steps. As soon as the sentence of a row ends, the next sentence
+  // takes its place (with a reset of the row's state). A sentence not
+  // finished at the end of a batch is continued in the next batch, starting
+  // with the previous word like a BPTT sequence with --word-wrapping fixed.
+  void PackContinuously(const SequenceStorage &sequences,
+                        const IndexVector &order,
+                        ConstShardPointer shard,
+                        BatchVector *batches) const;
+
+  // for testing only
+  void TruncateSequences(const int length);
 
   const int max_batch_size_, max_sequence_length_;
-  const bool debug_no_sb_;
+  const bool debug_no_sb_, bucketing_;
   const ConstVocabularyPointer vocabulary_;
-  SequenceVector data_;
+  SequenceStorage sequences_;
+  // batches are consecutive ranges of order_ (unless packed continuously)
+  IndexVector order_, sorted_order_;
+  BatchVector batches_;
+  // streaming only
+  const std::string data_file_name_;
+  const WordWrappingType word_wrapping_type_;
+  const int shard_size_, num_prefetched_batches_;
+  bool is_shuffled_;
+  int shuffle_seed_;
 };
 
 typedef std::shared_ptr<Data> DataPointer;
@@ -41,6 +41,14 @@ public:
     return getline(stream_, *line);
   }
 
+  // the rest of the (decompressed) file
+  void Read(std::string *contents) {
+    contents->clear();
+    char buffer[1 << 16];
+    while (stream_.read(buffer, sizeof(buffer)) || stream_.gcount() > 0)
+      contents->append(buffer, stream_.gcount());
+  }
+
 private:
   std::ifstream file_;
   boost::iostreams::filtering_stream<boost::iostreams::input> stream_;
@@ -67,6 +75,10 @@ public:
     return stream_ << t;
   }
 
+  void Write(const char data[], const size_t size) {
+    stream_.write(data, size);
+  }
+
 private:
   std::ofstream file_;
   boost::iostreams::filtering_ostream stream_;
@@ -13,7 +13,9 @@
 #pragma once
 #include <cassert>
 #include <fstream>
+#include <initializer_list>
 #include <memory>
+#include <utility>
 #include <vector>
 #include "fast.h"
 #include "random.h"
@@ -43,7 +45,116 @@ public:
 class Function;
 typedef std::shared_ptr<Function> FunctionPointer;
 typedef std::unique_ptr<ActivationFunction> ActivationFunctionPointer;
-typedef std::vector<int> Slice;
+
+// The words of one time step, one per active sequence of a batch. A slice
+// does not own its words. With continuous batching, a sequence i of the batch
+// may start a new sentence at this (the next) time step, given by resets[i]
+// (next_resets[i]); the arrays are null if there is no such sequence.
+class Slice {
+public:
+  Slice()
+      : words_(nullptr),
+        size_(0),
+        resets_(nullptr),
+        next_resets_(nullptr) {
+  }
+
+  Slice(const int words[],
+        const size_t size,
+        const char resets[] = nullptr,
+        const char next_resets[] = nullptr)
+      : words_(words),
+        size_(size),
+        resets_(resets),
+        next_resets_(next_resets) {
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  bool empty() const {
+    return size_ == 0;
+  }
+
+  int operator[](const size_t i) const {
+    return words_[i];
+  }
+
+  const int *begin() const {
+    return words_;
+  }
+
+  const int *end() const {
+    return words_ + size_;
+  }
+
+  const char *resets() const {
+    return resets_;
+  }
+
+  const char *next_resets() const {
+    return next_resets_;
+  }
+
+private:
+  const int *words_;
+  size_t size_;
+  const char *resets_, *next_resets_;
+};
+
+// Continuous batching: Zeroes the columns (vectors of the given dimension)
+// of the sequences i with resets[i] in the given matrices of the neighbouring
+// time step, so that recurrent computations do not cross the start of a
+// sentence. The columns are restored on destruction. Does nothing for null
+// resets.
+class ResetMask {
+public:
+  ResetMask(const char resets[],
+            const size_t batch_size,
+            const int dimension,
+            std::initializer_list<Real *> matrices)
+      : resets_(resets),
+        batch_size_(batch_size),
+        dimension_(dimension) {
+    if (resets_ == nullptr)
+      return;
+    matrices_.assign(matrices.begin(), matrices.end());
+    for (Real *matrix : matrices_) {
+      for (size_t i = 0; i < batch_size_; ++i) {
+        if (!resets_[i])
+          continue;
+        Real *column = matrix + i * dimension_;
+        columns_.insert(columns_.end(), column, column + dimension_);
+        FastZero(dimension_, column);
+      }
+    }
+  }
+
+  ~ResetMask() {
+    if (resets_ == nullptr)
+      return;
+    const Real *value = columns_.data();
+    for (Real *matrix : matrices_) {
+      for (size_t i = 0; i < batch_size_; ++i) {
+        if (!resets_[i])
+          continue;
+        FastCopy(value, dimension_, matrix + i * dimension_);
+        value += dimension_;
+      }
+    }
+  }
+
+private:
+  const char *resets_;
+  const size_t batch_size_;
+  const int dimension_;
+  std::vector<Real *> matrices_;
+  std::vector<Real> columns_;
+};
+
+// memory a function accumulates its weight updates in (pointer, size)
+typedef std::vector<std::pair<Real *, int>> BufferVector;
 typedef std::vector<Real> ProbabilitySequence;
 typedef std::vector<ProbabilitySequence> ProbabilitySequenceVector;
 
@@ -52,42 +163,70 @@ public:
   Function(const int input_dimension,
            const int output_dimension,
            const int max_batch_size,
-           const int max_sequence_length) 
+           const int max_sequence_length,
+           const bool is_trainable = true)
       : input_dimension_(input_dimension),
         output_dimension_(output_dimension),
         max_batch_size_(max_batch_size),
-        max_sequence_length_(max_sequence_length) {
+        max_sequence_length_(max_sequence_length),
+        is_trainable_(is_trainable),
+        shares_weights_(false) {
   }
 
   virtual ~Function() {
   }
 
-  virtual const Real *Evaluate(const Slice &slice, const Real x[]) = 0;
-  
   virtual void ComputeDelta(const Slice &slice, FunctionPointer f) = 0;
 
-  virtual const Real *UpdateWeights(const Slice &slice,
-                                    const Real learning_rate,
-                                    const Real x[]) = 0;
-
   virtual void UpdateMomentumWeights(const Real momentum) = 0;
 
   virtual void ResetMomentum() = 0;
 
   virtual void AddDelta(const Slice &slice, Real delta_t[]) = 0;
 
+  // is_dependent: each sequence of the batch continues from the last time
+  // step evaluated, which becomes the previous time step
   virtual void Reset(const bool is_dependent) = 0;
 
   virtual void ExtractState(State *state) const = 0;
 
   virtual void SetState(const State &state, const int i = 0) = 0;
 
+  // Batched evaluation of independent sequences (see InferenceEngine): the
+  // state of the j-th sequence of the batch only, in the layout of a batch
+  // size of 1, as one array of GetSequenceStateSize() values, e.g., for the
+  // fixed-size slots of a StateArena. A missing history is stored as such, so
+  // that the size does not depend on the sequence.
+  virtual int GetSequenceStateSize() const = 0;
+
+  virtual void ExtractSequenceState(const int j, Real state[]) const = 0;
+
+  virtual void SetSequenceState(const Real state[], const int j) = 0;
+
   virtual void RandomizeWeights(Random *random) = 0;
 
   virtual void Read(std::ifstream *input_stream) = 0;
 
   virtual void Write(std::ofstream *output_stream) = 0;
 
+  // Data-parallel training: From now on, read the weights of f (a function of
+  // identical type and dimensions) instead of the own ones. UpdateWeights()
+  // then only writes to private memory, see GetUpdateBuffers(), except for
+  // sparse updates (rows of table lookup and output word weights) if
+  // share_sparse_updates is set: these are applied to the weights of f
+  // directly and without locking (asynchronous training).
+  // A function that is not trainable (see Net::CloneForEvaluation()) only
+  // allocates its activations, but neither weights nor deltas nor update
+  // buffers. It has to share the weights of a trainable function before it is
+  // evaluated, and share_sparse_updates is ignored.
+  virtual void ShareWeights(const Function &f,
+                            const bool share_sparse_updates) = 0;
+
+  // Appends the buffers UpdateWeights() accumulates into, always in the same
+  // order. For a function that shares weights, these are private buffers that
+  // have to be added to the buffers of the owning function.
+  virtual void GetUpdateBuffers(BufferVector *buffers) = 0;
+
   virtual Real ComputeLogProbability(
       const Slice &slice,
       const Real x[],
@@ -116,6 +255,14 @@ public:
     return max_sequence_length_;
   }
 
+  bool shares_weights() const {
+    return shares_weights_;
+  }
+
+  bool is_trainable() const {
+    return is_trainable_;
+  }
+
 protected:
   virtual int GetOffset() const {
     return output_dimension() * max_batch_size();
@@ -125,7 +272,36 @@ protected:
     output_dimension_ = output_dimension;
   }
 
+  void set_shares_weights(const bool shares_weights) {
+    shares_weights_ = shares_weights;
+  }
+
 private:
   int output_dimension_;
   const int input_dimension_, max_batch_size_, max_sequence_length_;
+  const bool is_trainable_;
+  bool shares_weights_;
+};
+
+// A function of the activations x of the function below it, i.e., every layer
+// of a network but the table lookup, which is a function of word indices.
+class Layer : public Function {
+public:
+  Layer(const int input_dimension,
+        const int output_dimension,
+        const int max_batch_size,
+        const int max_sequence_length,
+        const bool is_trainable = true)
+      : Function(input_dimension,
+                 output_dimension,
+                 max_batch_size,
+                 max_sequence_length,
+                 is_trainable) {
+  }
+
+  virtual const Real *Evaluate(const Slice &slice, const Real x[]) = 0;
+
+  virtual const Real *UpdateWeights(const Slice &slice,
+                                    const Real learning_rate,
+                                    const Real x[]) = 0;
 };
@@ -23,10 +23,7 @@ GradientTest::GradientTest(const uint32_t seed,
       epsilon_(1e-5),
       trainer_(trainer) {
   if (is_feedforward) {
-    for (auto &indices : trainer_->training_data_->data_) {
-      assert(indices.size() >= 2);
-      indices.resize(2);
-    }
+    trainer_->training_data_->TruncateSequences(2);
   }
   num_running_words_ = trainer_->training_data_->CountNumRunningWords();
 }
@@ -10,102 +10,156 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#include <cctype>
 #include <cmath>
 #include <algorithm>
 #include <functional>
 #include <sstream>
-#include <boost/algorithm/string/trim.hpp>
+#include <tuple>
+#include <boost/iostreams/device/mapped_file.hpp>
 #include <boost/range/adaptor/reversed.hpp>
 #include "file.h"
 #include "htklatticerescorer.h"
 
-std::pair<size_t, size_t> HtkLatticeRescorer::ParseField(
-    const std::string &line,
-    const std::string &field,
-    int *const result) const {
-  std::string s;
-  const auto match = ParseField(line, field, &s);
-  std::istringstream(s) >> *result;
-  return match;
+namespace {
+
+template <typename T>
+void WriteArray(const T *data, const size_t size, std::ostream *out) {
+  out->write(reinterpret_cast<const char *>(data), size * sizeof(T));
+}
+
+template <typename T>
+void ReadArray(const char **position, const size_t size, std::vector<T> *v) {
+  v->resize(size);
+  memcpy(v->data(), *position, size * sizeof(T));
+  *position += size * sizeof(T);
 }
 
-std::pair<size_t, size_t> HtkLatticeRescorer::ParseField(
-    const std::string &line,
-    const std::string &field,
-    Real *const result) const {
-  std::string s;
-  const auto match = ParseField(line, field, &s);
-  std::istringstream(s) >> *result;
-  return match;
+}  // namespace
+
+bool HtkLatticeRescorer::NextLine(const char **position,
+                                  const char *end,
+                                  const char **line_begin,
+                                  const char **line_end) {
+  const char *begin = *position;
+  if (begin >= end)
+    return false;
+  const char *last = static_cast<const char *>(memchr(begin, '\n', end - begin));
+  if (last == nullptr)
+    last = end;
+  *position = last + 1;
+  // trimmed
+  while (begin < last && isspace(*begin))
+    ++begin;
+  while (last > begin && isspace(last[-1]))
+    --last;
+  *line_begin = begin;
+  *line_end = last;
+  return true;
 }
 
-std::pair<size_t, size_t> HtkLatticeRescorer::ParseField(
-    const std::string &line,
-    const std::string &field,
-    std::string *const result) const {
-  size_t start = line.find(field + '='), end;
-  assert(start != std::string::npos);
-  assert(line.find(field + '=', start + 1) == std::string::npos);
-  const size_t start0 = start;
-  start += field.length() + 1;
-  if (line[start] == '"') {
-      end = line.find('"', ++start + 1);
+bool HtkLatticeRescorer::NextField(const char **position,
+                                   const char *end,
+                                   Field *field) {
+  const char *p = *position;
+  while (p < end && (*p == ' ' || *p == '\t'))
+    ++p;
+  if (p == end)
+    return false;
+  field->begin = p;
+  while (p < end && *p != '=' && *p != ' ' && *p != '\t')
+    ++p;
+  field->name_length = p - field->begin;
+  if (p < end && *p == '=')
+    ++p;
+  if (p < end && *p == '"') {
+    field->value = ++p;
+    while (p < end && *p != '"')
+      ++p;
+    field->value_length = p - field->value;
+    if (p < end)
+      ++p;
   } else {
-      end = std::min(line.find(' ', start + 1), line.find('\t', start + 1));
-      if (end == std::string::npos)
-          end = line.size();
+    field->value = p;
+    while (p < end && *p != ' ' && *p != '\t')
+      ++p;
+    field->value_length = p - field->value;
+  }
+  field->end = p;
+  *position = p;
+  return true;
+}
+
+void HtkLatticeRescorer::ParseFields(const char *begin,
+                                     const char *end,
+                                     std::initializer_list<const char *> names,
+                                     Field fields[]) {
+  for (size_t i = 0; i < names.size(); ++i)
+    fields[i].begin = nullptr;
+  Field field;
+  while (NextField(&begin, end, &field)) {
+    Field *f = fields;
+    for (const char *name : names) {
+      if (field.Is(name)) {
+        assert(f->begin == nullptr);
+        *f = field;
+        break;
+      }
+      ++f;
+    }
   }
-  if (result != nullptr)
-    *result = line.substr(start, end - start);
-  return std::make_pair(start0, end - start0 + 1);
+  for (size_t i = 0; i < names.size(); ++i)
+    assert(fields[i].begin != nullptr);
 }
 
-void HtkLatticeRescorer::ParseLine(const std::string &line, int *num_links) {
+void HtkLatticeRescorer::ParseLine(const char *begin,
+                                   const char *end,
+                                   int *num_links) {
   // log base e is default in HTK SLF
-  assert(!boost::algorithm::starts_with(line, "base") ||
-         boost::algorithm::starts_with(line, "base=2.718"));
-  if (line[0] == 'N' || line[0] == 'L') {
-    int n;
-    std::istringstream tokenizer;
-    tokenizer.str(line);
-    while (!tokenizer.eof()) {
-      std::string token;
-      tokenizer >> token;
-      if (token[0] == 'N') {
-        ParseField(token, token[1] == '=' ? "N" : "NODES", &n);
+  assert(!StartsWith(begin, end, "base") ||
+         StartsWith(begin, end, "base=2.718"));
+  if (begin == end)
+    return;
+  if (*begin == 'N' || *begin == 'L') {
+    Field field;
+    while (NextField(&begin, end, &field)) {
+      if (field.Is("N") || field.Is("NODES")) {
+        const int n = field.ToInt();
         successor_links_.resize(n);
         hypotheses_.resize(n);
-      } else {
-        ParseField(line, line[1] == '=' ? "L" : "LINKS", &n);
-        links_.resize(n);
+      } else if (field.Is("L") || field.Is("LINKS")) {
+        links_.resize(field.ToInt());
       }
     }
-  } else if (line[0] == 'I') {
+  } else if (*begin == 'I') {
+    Field fields[2];
+    ParseFields(begin, end, {"I", "t"}, fields);
     Node node;
-    ParseField(line, "I", &node.id);
-    Real time;
-    ParseField(line, "t", &time);
+    node.id = fields[0].ToInt();
+    const Real time = fields[1].ToReal();
     node.time = static_cast<int>(floor(100. * time + .5));
     node.look_ahead_score = std::numeric_limits<Real>::infinity();
     nodes_.push_back(node);
     nodes_by_time_[node.time].push_back(node.id);
   }
-  else if (line[0] == 'J') {
-    int id;
+  else if (*begin == 'J') {
     ++*num_links;
+    Field fields[7];
+    ParseFields(begin, end, {"J", "S", "E", "l", "a", "v", "W"}, fields);
+    const Field &lm_score = fields[3], &am_score = fields[4], &word = fields[6];
+    const int id = fields[0].ToInt();
     Link link;
-    ParseField(line, "J", &id);
-    ParseField(line, "S", &link.from);
-    ParseField(line, "E", &link.to);
+    link.from = fields[1].ToInt();
+    link.to = fields[2].ToInt();
     assert(link.to != 0);  // assumption: start node == 0
-    ParseField(line, "l", &link.lm_score);
+    link.lm_score = lm_score.ToReal();
     assert(link.lm_score <= 0.);
-    ParseField(line, "a", &link.am_score);
+    link.am_score = am_score.ToReal();
     assert(link.am_score <= 0.);
-    ParseField(line, "v", &link.pronunciation);
+    link.pronunciation = fields[5].ToInt();
 
     if (clear_initial_links_ && link.from == 0) {
-      std::cout << "Setting score of initial epsilon link " << id <<
+      log_stream() << "Setting score of initial epsilon link " << id <<
                    " to zero!" << std::endl;
       assert(link.lm_score != 0.);
       assert(link.am_score != 0.);
@@ -121,16 +175,44 @@ void HtkLatticeRescorer::ParseLine(const std::string &line, int *num_links) {
       nodes_[link.from].time == 0));
     link.lm_score = -link.lm_score;  // our scores are positive!
     link.am_score = -link.am_score;
-    std::string word;
-    ParseField(line, "W", &word);
-    link.word = vocabulary_->GetIndex(word);
+    const std::string w(word.value, word.value_length);
+    link.word = vocabulary_->GetIndex(w);
     if (link.word == unk_index_)
-      oov_by_link_[id] = word;
+      oov_by_link_[id] = w;
     links_[id] = link;
     successor_links_[link.from].push_back(id);
+    // written back with new LM scores
+    if (output_format_ == kLattice) {
+      LinkText text;
+      text.link_id = id;
+      text.am_score_begin = am_score.begin - buffer_.data();
+      text.am_score_end = am_score.end - buffer_.data();
+      text.lm_score_begin = lm_score.begin - buffer_.data();
+      text.lm_score_end = lm_score.end - buffer_.data();
+      link_texts_.push_back(text);
+    }
   }
 }
 
+RescorerPointer HtkLatticeRescorer::Clone(const NetPointer &net) const {
+  return RescorerPointer(new HtkLatticeRescorer(vocabulary_,
+                                                net,
+                                                output_format_,
+                                                num_oov_words_,
+                                                semiring_,
+                                                pruning_threshold_,
+                                                pruning_limit_,
+                                                dp_order_,
+                                                is_dependent_,
+                                                cache_size_,
+                                                is_cache_persistent_,
+                                                clear_initial_links_,
+                                                set_sb_next_to_last_links_,
+                                                set_sb_last_links_,
+                                                use_lattice_cache_,
+                                                settings_));
+}
+
 void HtkLatticeRescorer::Reset() {
   // create initial hypothesis
   Hypothesis hypothesis;
@@ -145,17 +227,23 @@ void HtkLatticeRescorer::Reset() {
     // use zero state
     net_->Reset(false);
     net_->ResetHistories();
-    net_->ExtractState(&hypothesis.state);
+    hypothesis.state = states_.Allocate();
+    net_->ExtractSequenceState(0, states_.Get(hypothesis.state));
   } else {
     // use best ending state of previous lattice
     const int final_node_id = sorted_nodes_.back()->id;
     assert(successor_links_[final_node_id].empty());
     auto &node_hypotheses = hypotheses_[final_node_id];
     assert(!node_hypotheses.empty());
-    while (node_hypotheses.size() > 1)
+    while (node_hypotheses.size() > 1) {
+      states_.Release(node_hypotheses.top().state);
       node_hypotheses.pop();
+    }
     hypothesis.state = node_hypotheses.top().state;
+    node_hypotheses.pop();
   }
+  for (auto &node_hypotheses : hypotheses_)
+    ReleaseHypotheses(&node_hypotheses);
   net_->Reset(true);  // resets last sequence element, too
   nodes_.clear();
   single_best_.clear();
@@ -170,42 +258,136 @@ void HtkLatticeRescorer::Reset() {
   traceback_.clear();
   oov_by_link_.clear();
   topological_order_.clear();
+  buffer_.clear();
+  link_texts_.clear();
+  if (!is_cache_persistent_)
+    ClearCache();
+  num_cache_lookups_ = 0;
+  num_cache_hits_ = 0;
+  ClearEvaluations();
+  if (settings_.size() > 1) {
+    const Evaluation evaluation = {0., hypothesis.state};
+    states_.AddReference(evaluation.state);
+    evaluations_.push_back(evaluation);
+  }
   AddTraceback(-1,  // illegal link ID
                vocabulary_->sb_index(),
                0,  // predecessor traceback ID
                0.);  // initial cost
 }
 
+void HtkLatticeRescorer::ReleaseHypotheses(
+    std::priority_queue<Hypothesis> *hypotheses) {
+  while (!hypotheses->empty()) {
+    states_.Release(hypotheses->top().state);
+    hypotheses->pop();
+  }
+}
+
+void HtkLatticeRescorer::ClearCache() {
+  for (const CacheEntry &entry : cache_)
+    states_.Release(entry.state);
+  cache_.clear();
+  cache_by_key_.clear();
+}
+
+void HtkLatticeRescorer::ClearEvaluations() {
+  for (const Evaluation &evaluation : evaluations_)
+    states_.Release(evaluation.state);
+  evaluations_.clear();
+  evaluation_by_history_.clear();
+  num_evaluation_lookups_ = 0;
+  num_evaluation_hits_ = 0;
+}
+
 void HtkLatticeRescorer::SortTopologically() {
   sorted_nodes_.clear();
-  std::unordered_set<int> visited;
-  SortTopologicallyHelper(0, &visited);
-  assert(visited.size() == nodes_.size());
+  // depth-first search with an explicit stack of (node ID, index of the next
+  // successor link), nodes in post-order
+  std::vector<bool> visited(nodes_.size(), false);
+  std::vector<std::pair<int, size_t>> stack;
+  size_t num_visited = 1;
+  visited[0] = true;
+  stack.push_back(std::make_pair(0, 0));
+  while (!stack.empty()) {
+    const int node_id = stack.back().first;
+    const std::vector<int> &successors = successor_links_[node_id];
+    if (stack.back().second < successors.size()) {
+      const int to = links_[successors[stack.back().second++]].to;
+      if (!visited[to]) {
+        visited[to] = true;
+        ++num_visited;
+        stack.push_back(std::make_pair(to, 0));
+      }
+    } else {
+      sorted_nodes_.push_back(&nodes_[node_id]);
+      stack.pop_back();
+    }
+  }
+  assert(num_visited == nodes_.size());
   std::reverse(sorted_nodes_.begin(), sorted_nodes_.end());
 }
 
-void HtkLatticeRescorer::SortTopologicallyHelper(
-    const int node_id,
-    std::unordered_set<int> *visited) {
-  if (visited->count(node_id))
-    return;
-  visited->insert(node_id);
-  for (const int link_id : successor_links_[node_id])
-    SortTopologicallyHelper(links_[link_id].to, visited);
-  sorted_nodes_.push_back(&nodes_[node_id]);
+void HtkLatticeRescorer::ReadLattice(const std::string &file_name) {
+  if (!use_lattice_cache_ || !ReadLatticeCache(file_name)) {
+    ParseLattice(file_name);
+    ComputeLookAheadScores();
+    if (use_lattice_cache_)
+      WriteLatticeCache(file_name);
+  }
 }
 
-void HtkLatticeRescorer::ReadLattice(const std::string &file_name) {
-  // read lattice from htk file
-  ReadableFile file(file_name);
-  std::string line, token;
-  std::istringstream tokenizer, parser;
+void HtkLatticeRescorer::SelectSetting(const int i) {
+  if (i == 0 && settings_.size() > 1) {
+    lm_scores_.clear();
+    for (const Link &link : links_)
+      lm_scores_.push_back(link.lm_score);
+  } else if (i > 0) {
+    // a new search from the initial state
+    for (size_t j = 0; j < links_.size(); ++j)
+      links_[j].lm_score = lm_scores_[j];
+    for (auto &node_hypotheses : hypotheses_)
+      ReleaseHypotheses(&node_hypotheses);
+    Hypothesis hypothesis;
+    hypothesis.state = evaluations_[0].state;
+    states_.AddReference(hypothesis.state);
+    hypotheses_[0].push(hypothesis);
+    single_best_.clear();
+    best_score_by_time_.clear();
+    traceback_.clear();
+    AddTraceback(-1, vocabulary_->sb_index(), 0, 0.);
+  }
+  setting_ = i;
+  const Setting &setting = settings_[i];
+  nn_lambda_ = setting.nn_lambda;
+  lm_scale_ = setting.lm_scale;
+  if (look_ahead_lm_scale_ != setting.look_ahead_lm_scale) {
+    look_ahead_lm_scale_ = setting.look_ahead_lm_scale;
+    ComputeLookAheadScores();
+  }
+  if (settings_.size() > 1) {
+    // independent of the format of log_stream()
+    std::ostringstream text;
+    text << "setting: lambda=" << nn_lambda_ << " lm-scale=" << lm_scale_ <<
+            " look-ahead-lm-scale=" << look_ahead_lm_scale_;
+    log_stream() << text.str() << std::endl;
+  }
 
+  // update initial hypothesis
+  traceback_[0].score = nodes_[0].look_ahead_score;
+  Hypothesis hypothesis = hypotheses_[0].top();
+  hypotheses_[0].pop();
+  hypothesis.score = nodes_[0].look_ahead_score;
+  hypotheses_[0].push(hypothesis);
+}
+
+void HtkLatticeRescorer::ParseLattice(const std::string &file_name) {
+  // read lattice from htk file
+  ReadableFile(file_name).Read(&buffer_);
   int num_links = 0;
-  while (file.GetLine(&line)) {
-    boost::trim(line);
-    ParseLine(line, &num_links);
-  }
+  const char *position = buffer_.data(), *begin, *end;
+  while (NextLine(&position, buffer_.data() + buffer_.size(), &begin, &end))
+    ParseLine(begin, end, &num_links);
   assert(nodes_.size() == successor_links_.size());
   assert(links_.size() == num_links);
 
@@ -215,7 +397,7 @@ void HtkLatticeRescorer::ReadLattice(const std::string &file_name) {
     if (set_sb_last_links_ && successors.empty() ||
         set_sb_next_to_last_links_ && !successors.empty() &&
         successor_links_[links_[successors[0]].to].empty()) {
-      std::cout << "Setting final epsilon link " <<
+      log_stream() << "Setting final epsilon link " <<
                    (&link - &links_[0]) << " to <sb>!" << std::endl;
       assert(link.word == unk_index_ || link.word == vocabulary_->sb_index());
       assert(link.lm_score > 0.);
@@ -234,8 +416,136 @@ void HtkLatticeRescorer::ReadLattice(const std::string &file_name) {
   int i = 0;
   for (const Node *const node : sorted_nodes_)
     topological_order_[node->id] = i++;
+}
+
+bool HtkLatticeRescorer::ReadLatticeCache(const std::string &file_name) {
+  const std::string cache_file_name = file_name + ".cache";
+  if (!boost::filesystem::exists(cache_file_name))
+    return false;
+  boost::iostreams::mapped_file_source file(cache_file_name);
+  if (!file.is_open() || file.size() < sizeof(LatticeCacheHeader))
+    return false;
+  LatticeCacheHeader header;
+  memcpy(&header, file.data(), sizeof(header));
+  const uint64_t num_nodes = header.num_nodes, num_links = header.num_links,
+                 num_oov_words = header.num_oov_words;
+  const uint64_t size = sizeof(header) + num_nodes * sizeof(Node) +
+      num_links * sizeof(Link) + num_nodes * sizeof(int) +
+      (num_nodes + 1) * sizeof(int) + num_links * sizeof(int) +
+      num_oov_words * sizeof(int) + (num_oov_words + 1) * sizeof(uint64_t) +
+      header.oov_text_size + header.num_link_texts * sizeof(LinkText);
+  if (memcmp(header.magic, "RWTHLMC1", sizeof(header.magic)) != 0 ||
+      header.source_size != boost::filesystem::file_size(file_name) ||
+      header.source_time != boost::filesystem::last_write_time(file_name) ||
+      header.vocabulary_checksum != vocabulary_checksum_ ||
+      header.clear_initial_links != clear_initial_links_ ||
+      header.set_sb_next_to_last_links != set_sb_next_to_last_links_ ||
+      header.set_sb_last_links != set_sb_last_links_ ||
+      num_nodes == 0 || file.size() != size)
+    return false;
+  // the lines to write back are not part of the cache
+  if (output_format_ == kLattice) {
+    if (header.num_link_texts != num_links)
+      return false;
+    ReadableFile(file_name).Read(&buffer_);
+  }
+
+  const char *position = file.data() + sizeof(header);
+  ReadArray(&position, num_nodes, &nodes_);
+  ReadArray(&position, num_links, &links_);
+  std::vector<int> ids, offsets;
+  ReadArray(&position, num_nodes, &ids);
+  sorted_nodes_.clear();
+  topological_order_.resize(num_nodes);
+  for (const int id : ids) {
+    topological_order_[id] = sorted_nodes_.size();
+    sorted_nodes_.push_back(&nodes_[id]);
+  }
+  ReadArray(&position, num_nodes + 1, &offsets);
+  ReadArray(&position, num_links, &ids);
+  successor_links_.resize(num_nodes);
+  for (uint64_t i = 0; i < num_nodes; ++i) {
+    successor_links_[i].assign(ids.begin() + offsets[i],
+                               ids.begin() + offsets[i + 1]);
+  }
+  std::vector<uint64_t> text_offsets;
+  ReadArray(&position, num_oov_words, &ids);
+  ReadArray(&position, num_oov_words + 1, &text_offsets);
+  for (uint64_t i = 0; i < num_oov_words; ++i) {
+    oov_by_link_[ids[i]].assign(position + text_offsets[i],
+                                position + text_offsets[i + 1]);
+  }
+  position += header.oov_text_size;
+  if (output_format_ == kLattice)
+    ReadArray(&position, num_links, &link_texts_);
+  for (const Node &node : nodes_)
+    nodes_by_time_[node.time].push_back(node.id);
+  hypotheses_.resize(num_nodes);
 
-  ComputeLookAheadScores();
+  // look-ahead scores for other settings
+  if (header.semiring != semiring_ ||
+      header.look_ahead_lm_scale != look_ahead_lm_scale_)
+    ComputeLookAheadScores();
+  log_stream() << "read lattice cache '" << cache_file_name << "'" <<
+                  std::endl;
+  return true;
+}
+
+void HtkLatticeRescorer::WriteLatticeCache(const std::string &file_name) {
+  const std::string cache_file_name = file_name + ".cache",
+                    temporary_file_name = cache_file_name + ".tmp";
+  std::ofstream out(temporary_file_name.c_str(),
+                    std::ios::out | std::ios::binary);
+  if (!out.good()) {
+    log_stream() << "cannot write lattice cache '" << cache_file_name <<
+                    "'" << std::endl;
+    return;
+  }
+
+  std::vector<int> oov_ids;
+  std::vector<uint64_t> text_offsets(1, 0);
+  std::string oov_text;
+  for (const auto &oov : oov_by_link_) {
+    oov_ids.push_back(oov.first);
+    oov_text += oov.second;
+    text_offsets.push_back(oov_text.size());
+  }
+  LatticeCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "RWTHLMC1", sizeof(header.magic));
+  header.source_size = boost::filesystem::file_size(file_name);
+  header.source_time = boost::filesystem::last_write_time(file_name);
+  header.vocabulary_checksum = vocabulary_checksum_;
+  header.clear_initial_links = clear_initial_links_;
+  header.set_sb_next_to_last_links = set_sb_next_to_last_links_;
+  header.set_sb_last_links = set_sb_last_links_;
+  header.semiring = semiring_;
+  header.look_ahead_lm_scale = look_ahead_lm_scale_;
+  header.num_nodes = nodes_.size();
+  header.num_links = links_.size();
+  header.num_oov_words = oov_ids.size();
+  header.oov_text_size = oov_text.size();
+  header.num_link_texts = link_texts_.size();
+  WriteArray(&header, 1, &out);
+  WriteArray(nodes_.data(), nodes_.size(), &out);
+  WriteArray(links_.data(), links_.size(), &out);
+  for (const Node *node : sorted_nodes_)
+    WriteArray(&node->id, 1, &out);
+  int offset = 0;
+  WriteArray(&offset, 1, &out);
+  for (const std::vector<int> &successors : successor_links_) {
+    offset += successors.size();
+    WriteArray(&offset, 1, &out);
+  }
+  for (const std::vector<int> &successors : successor_links_)
+    WriteArray(successors.data(), successors.size(), &out);
+  WriteArray(oov_ids.data(), oov_ids.size(), &out);
+  WriteArray(text_offsets.data(), text_offsets.size(), &out);
+  WriteArray(oov_text.data(), oov_text.size(), &out);
+  WriteArray(link_texts_.data(), link_texts_.size(), &out);
+  out.close();
+  // readers never see a partial cache
+  boost::filesystem::rename(temporary_file_name, cache_file_name);
 }
 
 void HtkLatticeRescorer::ComputeLookAheadScores() {
@@ -263,12 +573,6 @@ void HtkLatticeRescorer::ComputeLookAheadScores() {
     }
     node->look_ahead_score = look_ahead_score;
   }
-  // update initial hypothesis
-  traceback_[0].score = nodes_[0].look_ahead_score;
-  Hypothesis hypothesis = hypotheses_[0].top();
-  hypotheses_[0].pop();
-  hypothesis.score = nodes_[0].look_ahead_score;
-  hypotheses_[0].push(hypothesis);
 }
 
 void HtkLatticeRescorer::Prune(const int time) {
@@ -291,26 +595,34 @@ void HtkLatticeRescorer::Prune(const int time) {
     // due to epsilon arcs, for some nodes there may not be hypotheses yet
     while (!node_hypotheses.empty()) {
       const Hypothesis &hypothesis = node_hypotheses.top();
+      // the state of a pruned or recombined hypothesis, if any
+      int released_state = hypothesis.state;
       // ensure at least one hypothesis per node survives
       if (hypothesis.score <= threshold || node_hypotheses.size() == 1) {
         // dynamic programming recombination
         Hypothesis &best = recombined_hypotheses[Hash(hypothesis.traceback_id)];
-        if (best.score == 0. || best.score > hypothesis.score)
+        if (best.score == 0. || best.score > hypothesis.score) {
+          released_state = best.state;
           best = hypothesis;
+        }
       }
+      if (released_state >= 0)
+        states_.Release(released_state);
       node_hypotheses.pop();
     }
     // write back surviving hypotheses
     for (const std::pair<size_t, Hypothesis> &pair : recombined_hypotheses)
       node_hypotheses.push(pair.second);
     // cardinality pruning
-    while (node_hypotheses.size() > pruning_limit_)
+    while (node_hypotheses.size() > pruning_limit_) {
+      states_.Release(node_hypotheses.top().state);
       node_hypotheses.pop();
+    }
     min_num_after = std::min(min_num_after, node_hypotheses.size());
     max_num_after = std::max(max_num_after, node_hypotheses.size());
     num_after += node_hypotheses.size();
   }
-  std::cout << "t=" << std::setw(5) << std::right << time << 
+  log_stream() << "t=" << std::setw(5) << std::right << time << 
                " #hyps/#nodes: " << std::setw(5) << num_before << "/" <<
                std::setw(3) << nodes_by_time_[time].size() << " (min: " <<
                std::setw(3) << min_num_before << ", max: " << std::setw(4) <<
@@ -320,7 +632,9 @@ void HtkLatticeRescorer::Prune(const int time) {
 }
 
 void HtkLatticeRescorer::RescoreLattice() {
-  assert(net_->max_batch_size() == 1);
+  std::vector<Hypothesis> expanded_hypotheses;
+  std::vector<Expansion> expansions;
+  std::vector<int> evaluated_expansions;
   int last_time = sorted_nodes_[0]->time;
   for (const Node *const node : sorted_nodes_) {
     if (node->id == sorted_nodes_.back()->id)
@@ -331,43 +645,211 @@ void HtkLatticeRescorer::RescoreLattice() {
     }
     std::priority_queue<Hypothesis> &node_hypotheses = hypotheses_[node->id];
     assert(!node_hypotheses.empty());
+    expanded_hypotheses.clear();
     while (!node_hypotheses.empty()) {
-      const Hypothesis &hypothesis = node_hypotheses.top();
+      expanded_hypotheses.push_back(node_hypotheses.top());
+      node_hypotheses.pop();
+    }
+    expansions.clear();
+    evaluated_expansions.clear();
+    for (size_t i = 0; i < expanded_hypotheses.size(); ++i) {
       for (const int link_id : successor_links_[node->id]) {
-        const Link &link = links_[link_id];
-        net_->SetState(hypothesis.state);
-        Hypothesis new_hypothesis;
-        new_hypothesis.score = hypothesis.score + link.am_score -
-            node->look_ahead_score + nodes_[link.to].look_ahead_score;
-        const int history_word = GetHistoryWord(hypothesis.traceback_id);
+        expansions.push_back(Expansion());
+        Expansion &expansion = expansions.back();
+        expansion.hypothesis = i;
+        expansion.link_id = link_id;
+        expansion.evaluation = -1;
         // links with lm_score == 0. will not be evaluated
-        if (link.lm_score == 0.) {
-          new_hypothesis.state = hypothesis.state;
+        if (links_[link_id].lm_score == 0.)
+          continue;
+        if (settings_.size() > 1) {
+          expansion.evaluation = LookUpEvaluation(
+              expanded_hypotheses[i].evaluation,
+              links_[link_id].word);
+          if (expansion.evaluation >= 0) {
+            const Evaluation &evaluation = evaluations_[expansion.evaluation];
+            expansion.probability = evaluation.probability;
+            expansion.state = evaluation.state;
+            states_.AddReference(expansion.state);
+            continue;
+          }
+        }
+        const CacheEntry *entry = nullptr;
+        if (cache_size_ > 0) {
+          GetCacheKey(expanded_hypotheses[i].traceback_id,
+                      links_[link_id].word,
+                      &cache_key_);
+          entry = LookUpCache(cache_key_);
+        }
+        if (entry != nullptr) {
+          expansion.probability = entry->probability;
+          expansion.state = entry->state;
+          states_.AddReference(expansion.state);
         } else {
-          const Slice slice(1, link.word);
-		  const Real x = history_word,
-                     *y = net_->Evaluate(slice, &x);
-          new_hypothesis.score -= log((1. - nn_lambda_) * exp(-link.lm_score) +
-              nn_lambda_ * exp(net_->ComputeLogProbability(slice, y, false)) /
-              (link.word == unk_index_ ? num_oov_words_ + 1. : 1.)) * lm_scale_;
-          net_->Reset(true);
-          net_->ExtractState(&new_hypothesis.state);
+          evaluated_expansions.push_back(expansions.size() - 1);
         }
-        // This must be done, independent of whether we have an LM score or not!
-        Real &best_score = best_score_by_time_[nodes_[link.to].time];
-        if (best_score == 0. || new_hypothesis.score < best_score)
-          best_score = new_hypothesis.score;
-        new_hypothesis.traceback_id = AddTraceback(
-            link_id,
-            link.lm_score == 0. ? history_word : link.word,
-            hypothesis.traceback_id,
-            new_hypothesis.score);
-        hypotheses_[link.to].push(new_hypothesis);
       }
-      node_hypotheses.pop();
     }
+    EvaluateExpansions(expanded_hypotheses,
+                       evaluated_expansions,
+                       &expansions);
+    for (size_t i = 0; cache_size_ > 0 && i < evaluated_expansions.size();
+         ++i) {
+      const Expansion &expansion = expansions[evaluated_expansions[i]];
+      GetCacheKey(expanded_hypotheses[expansion.hypothesis].traceback_id,
+                  links_[expansion.link_id].word,
+                  &cache_key_);
+      AddToCache(cache_key_, expansion);
+    }
+    for (Expansion &expansion : expansions) {
+      if (settings_.size() > 1 && expansion.evaluation < 0 &&
+          links_[expansion.link_id].lm_score != 0.) {
+        AddEvaluation(expanded_hypotheses[expansion.hypothesis].evaluation,
+                      links_[expansion.link_id].word,
+                      &expansion);
+      }
+    }
+
+    for (Expansion &expansion : expansions) {
+      const Hypothesis &hypothesis = expanded_hypotheses[expansion.hypothesis];
+      const Link &link = links_[expansion.link_id];
+      Hypothesis new_hypothesis;
+      new_hypothesis.score = hypothesis.score + link.am_score -
+          node->look_ahead_score + nodes_[link.to].look_ahead_score;
+      const int history_word = GetHistoryWord(hypothesis.traceback_id);
+      if (link.lm_score == 0.) {
+        new_hypothesis.state = hypothesis.state;
+        new_hypothesis.evaluation = hypothesis.evaluation;
+        states_.AddReference(new_hypothesis.state);
+      } else {
+        new_hypothesis.evaluation = expansion.evaluation;
+        new_hypothesis.score -= log((1. - nn_lambda_) * exp(-link.lm_score) +
+            nn_lambda_ * expansion.probability /
+            (link.word == unk_index_ ? num_oov_words_ + 1. : 1.)) * lm_scale_;
+        // the reference of the expansion
+        new_hypothesis.state = expansion.state;
+      }
+      // This must be done, independent of whether we have an LM score or not!
+      Real &best_score = best_score_by_time_[nodes_[link.to].time];
+      if (best_score == 0. || new_hypothesis.score < best_score)
+        best_score = new_hypothesis.score;
+      new_hypothesis.traceback_id = AddTraceback(
+          expansion.link_id,
+          link.lm_score == 0. ? history_word : link.word,
+          hypothesis.traceback_id,
+          new_hypothesis.score);
+      hypotheses_[link.to].push(new_hypothesis);
+    }
+    for (const Hypothesis &hypothesis : expanded_hypotheses)
+      states_.Release(hypothesis.state);
   }
   TraceBack();
+  if (cache_size_ > 0) {
+    log_stream() << "cache hits: " << num_cache_hits_ << '/' <<
+                 num_cache_lookups_ << " (" << std::fixed <<
+                 std::setprecision(2) << (num_cache_lookups_ == 0 ? 0. :
+                 100. * num_cache_hits_ / num_cache_lookups_) << "%), " <<
+                 cache_.size() << " entries" << std::endl;
+  }
+  if (settings_.size() > 1) {
+    log_stream() << "shared evaluations: " << num_evaluation_hits_ << '/' <<
+                 num_evaluation_lookups_ << " (" << std::fixed <<
+                 std::setprecision(2) << (num_evaluation_lookups_ == 0 ? 0. :
+                 100. * num_evaluation_hits_ / num_evaluation_lookups_) <<
+                 "%), " << evaluations_.size() << " evaluations" << std::endl;
+  }
+}
+
+int HtkLatticeRescorer::LookUpEvaluation(const int evaluation,
+                                         const int word) {
+  ++num_evaluation_lookups_;
+  const auto it = evaluation_by_history_.find(std::make_pair(evaluation,
+                                                             word));
+  if (it == evaluation_by_history_.end())
+    return -1;
+  ++num_evaluation_hits_;
+  return it->second;
+}
+
+void HtkLatticeRescorer::AddEvaluation(const int evaluation,
+                                       const int word,
+                                       Expansion *expansion) {
+  // the same history may have been evaluated twice for one node
+  const auto result = evaluation_by_history_.insert(std::make_pair(
+      std::make_pair(evaluation, word), static_cast<int>(evaluations_.size())));
+  expansion->evaluation = result.first->second;
+  if (!result.second)
+    return;
+  const Evaluation new_evaluation = {expansion->probability, expansion->state};
+  states_.AddReference(new_evaluation.state);
+  evaluations_.push_back(new_evaluation);
+}
+
+const HtkLatticeRescorer::CacheEntry *HtkLatticeRescorer::LookUpCache(
+    const std::vector<int> &key) {
+  ++num_cache_lookups_;
+  const auto it = cache_by_key_.find(key);
+  if (it == cache_by_key_.end())
+    return nullptr;
+  ++num_cache_hits_;
+  cache_.splice(cache_.begin(), cache_, it->second);
+  return &cache_.front();
+}
+
+void HtkLatticeRescorer::AddToCache(const std::vector<int> &key,
+                                    const Expansion &expansion) {
+  // the same key may have been evaluated twice for one node
+  if (cache_by_key_.count(key))
+    return;
+  if (cache_.size() == cache_size_) {
+    cache_by_key_.erase(cache_.back().key);
+    states_.Release(cache_.back().state);
+    cache_.pop_back();
+  }
+  cache_.push_front(CacheEntry());
+  CacheEntry &entry = cache_.front();
+  entry.key = key;
+  entry.probability = expansion.probability;
+  entry.state = expansion.state;
+  states_.AddReference(entry.state);
+  cache_by_key_[key] = cache_.begin();
+}
+
+void HtkLatticeRescorer::EvaluateExpansions(
+    const std::vector<Hypothesis> &hypotheses,
+    const std::vector<int> &evaluated_expansions,
+    std::vector<Expansion> *expansions) {
+  const size_t max_batch_size = net_->max_batch_size();
+  for (size_t begin = 0;
+       begin < evaluated_expansions.size();
+       begin += max_batch_size) {
+    const size_t size = std::min(evaluated_expansions.size() - begin,
+                                 max_batch_size);
+    // each sequence of the batch continues the state of its hypothesis
+    net_->Reset(true);
+    net_->ResetHistories();
+    batch_words_.resize(size);
+    batch_targets_.resize(size);
+    for (size_t j = 0; j < size; ++j) {
+      const Expansion &expansion =
+          (*expansions)[evaluated_expansions[begin + j]];
+      const Hypothesis &hypothesis = hypotheses[expansion.hypothesis];
+      net_->SetSequenceState(states_.Get(hypothesis.state), j);
+      batch_words_[j] = GetHistoryWord(hypothesis.traceback_id);
+      batch_targets_[j] = links_[expansion.link_id].word;
+    }
+    const Slice slice(batch_targets_.data(), size);
+    const Real *y = net_->Evaluate(slice, batch_words_.data());
+    batch_probabilities_.assign(size, ProbabilitySequence());
+    net_->ComputeLogProbability(slice, y, false, &batch_probabilities_);
+    net_->Reset(true);
+    for (size_t j = 0; j < size; ++j) {
+      Expansion &expansion = (*expansions)[evaluated_expansions[begin + j]];
+      expansion.probability = batch_probabilities_[j].front();
+      expansion.state = states_.Allocate();
+      net_->ExtractSequenceState(j, states_.Get(expansion.state));
+    }
+  }
 }
 
 void HtkLatticeRescorer::TraceBack() {
@@ -404,12 +886,12 @@ void HtkLatticeRescorer::TraceBack() {
     }
     fill_single_best = false;
   }
-  std::cout << "single best: " << std::setw(10) << std::fixed <<
+  log_stream() << "single best: " << std::setw(10) << std::fixed <<
                std::setprecision(5) <<
                traceback_[ordered_traceback[0]].score << '\n';
   for (const int link_id : boost::adaptors::reverse(single_best_)) {
     const int word = links_[link_id].word;
-    std::cout << "\tW=" << std::left << std::setw(20) <<
+    log_stream() << "\tW=" << std::left << std::setw(20) <<
                  (word == unk_index_ ? oov_by_link_[link_id] :
                  vocabulary_->GetWord(word)) << "\tJ=" <<
                  std::setw(6) << link_id << "\tl=" << std::fixed <<
@@ -433,9 +915,20 @@ void HtkLatticeRescorer::WriteLattice(const std::string &file_name) {
   }
 }
 
+std::string HtkLatticeRescorer::GetSettingSuffix() const {
+  if (settings_.size() == 1)
+    return "";
+  std::ostringstream suffix;
+  suffix << ".lambda" << nn_lambda_ << "-lm-scale" << lm_scale_;
+  if (look_ahead_lm_scale_ != lm_scale_)
+    suffix << "-look-ahead-lm-scale" << look_ahead_lm_scale_;
+  return suffix.str();
+}
+
 void HtkLatticeRescorer::WriteCtm(const std::string &file_name) {
   const std::string file_name_prefix(ExtendedFileName(file_name, ""));
-  WritableFile out_file(ExtendedFileName(file_name, ".ctm"));
+  WritableFile out_file(ExtendedFileName(file_name,
+                                        GetSettingSuffix() + ".ctm"));
 
   // leave out final token (which is <sb> and should not occur in a ctm file)
   for (auto it = single_best_.rbegin(); it + 1 != single_best_.rend(); ++it) {
@@ -455,31 +948,38 @@ void HtkLatticeRescorer::WriteCtm(const std::string &file_name) {
 
 void HtkLatticeRescorer::WriteHtkLattice(const std::string &file_name) {
   // write back file
-  ReadableFile in_file(file_name);
-  WritableFile out_file(ExtendedFileName(file_name, ".rescored"));
-
-  std::string line, token;
-  while (in_file.GetLine(&line)) {
-    boost::trim(line);
-    if (line[0] == 'J') {
-      int link_id;
-      ParseField(line, "J", &link_id);
-      
-      const Link &link = links_[link_id];
+  WritableFile out_file(ExtendedFileName(file_name,
+                                        GetSettingSuffix() + ".rescored"));
+
+  // the lines as read, except for the replaced fields of the links
+  const char *data = buffer_.data(), *position = data, *begin, *end;
+  auto link_text = link_texts_.begin();
+  while (NextLine(&position, data + buffer_.size(), &begin, &end)) {
+    if (begin != end && *begin == 'J') {
+      const Link &link = links_[link_text->link_id];
+      // (begin, end, text) in the order of the line
+      std::vector<std::tuple<size_t, size_t, std::string>> replacements;
       if (clear_initial_links_ && link.from == 0) {
-        const auto match = ParseField(line, "a");
-        line.replace(match.first, match.second, "a=0.0 ");
+        replacements.push_back(std::make_tuple(link_text->am_score_begin,
+                                               link_text->am_score_end,
+                                               "a=0.0"));
       }
-
-      const auto match = ParseField(line, "l");
-      out_file << line.replace(
-          match.first,  // position
-          match.second,  // length
-          "l=" + std::to_string(-link.lm_score)) << '\n';
-    } else {
-      out_file << line << '\n';
+      replacements.push_back(std::make_tuple(
+          link_text->lm_score_begin,
+          link_text->lm_score_end,
+          "l=" + std::to_string(-link.lm_score)));
+      std::sort(replacements.begin(), replacements.end());
+      for (const auto &replacement : replacements) {
+        out_file.Write(begin, data + std::get<0>(replacement) - begin);
+        out_file << std::get<2>(replacement);
+        begin = data + std::get<1>(replacement);
+      }
+      ++link_text;
     }
+    out_file.Write(begin, end - begin);
+    out_file << '\n';
   }
+  assert(link_text == link_texts_.end());
 }
 
 void HtkLatticeRescorer::WriteExpandedHtkLattice(const std::string &file_name) {
@@ -519,7 +1019,8 @@ void HtkLatticeRescorer::WriteExpandedHtkLattice(const std::string &file_name) {
     std::sort(traceback_ids.begin(), traceback_ids.end(), score_comparator);
 
   // HTK SLF header
-  WritableFile out_file(ExtendedFileName(file_name, ".rescored"));
+  WritableFile out_file(ExtendedFileName(file_name,
+                                        GetSettingSuffix() + ".rescored"));
   out_file << "VERSION=1.0\nUTTERANCE=" <<
               FileNameWithoutExtension(file_name) << "\nlmscale=" <<
               lm_scale_ << '\n';
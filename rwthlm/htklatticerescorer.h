@@ -12,6 +12,11 @@
  */
 #pragma once
 #include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <list>
 #include <queue>
 #include <unordered_map>
 #include <unordered_set>
@@ -20,6 +25,7 @@
 #include "fast.h"
 #include "function.h"
 #include "rescorer.h"
+#include "statearena.h"
 
 class HtkLatticeRescorer : public Rescorer {
 public:
@@ -31,44 +37,74 @@ public:
     kCtm, kLattice, kExpandedLattice
   };
 
+  // a rescoring pass over a lattice
+  struct Setting {
+    Real nn_lambda, look_ahead_lm_scale, lm_scale;
+  };
+
+  // Each lattice is rescored with each of the settings (at least one), see
+  // SelectSetting(). The passes share the network evaluations of equal
+  // histories, see evaluations_.
   HtkLatticeRescorer(const ConstVocabularyPointer &vocabulary,
                      const NetPointer &net,
                      const OutputFormat output_format,
                      const int num_oov_words,
-                     const Real nn_lambda,
                      const LookAheadSemiring semiring,
-                     const Real look_ahead_lm_scale,
-					 const Real lm_scale,
                      const Real pruning_threshold,
                      const size_t pruning_limit,
                      const int dp_order,
                      const bool is_dependent,
+                     const size_t cache_size,
+                     const bool is_cache_persistent,
                      const bool clear_initial_links,
                      const bool set_sb_next_to_last_links,
-                     const bool set_sb_last_links)
-      : Rescorer(vocabulary, net, num_oov_words, nn_lambda),
-        unk_index_(vocabulary_->HasUnk() ?
-                   vocabulary_->GetIndex(vocabulary_->unk()) : -1),
+                     const bool set_sb_last_links,
+                     const bool use_lattice_cache,
+                     const std::vector<Setting> &settings,
+                     const int num_threads = 1)
+      : Rescorer(vocabulary,
+                 net,
+                 num_oov_words,
+                 settings.front().nn_lambda,
+                 num_threads),
+        unk_index_(vocabulary_->unk_index()),
         output_format_(output_format),
         pruning_limit_(pruning_limit),
         semiring_(semiring),
-        look_ahead_lm_scale_(look_ahead_lm_scale),
-		lm_scale_(lm_scale),
         pruning_threshold_(pruning_threshold),
         epsilon_(1e-8),
         dp_order_(dp_order),
+        look_ahead_lm_scale_(settings.front().look_ahead_lm_scale),
+        lm_scale_(settings.front().lm_scale),
+        cache_size_(cache_size),
         is_dependent_(is_dependent),
+        is_cache_persistent_(is_cache_persistent),
         clear_initial_links_(clear_initial_links),
         set_sb_next_to_last_links_(set_sb_next_to_last_links),
-        set_sb_last_links_(set_sb_last_links) {
+        set_sb_last_links_(set_sb_last_links),
+        use_lattice_cache_(use_lattice_cache),
+        vocabulary_checksum_(vocabulary_->ComputeChecksum()),
+        settings_(settings),
+        setting_(0),
+        num_evaluation_lookups_(0),
+        num_evaluation_hits_(0),
+        num_cache_lookups_(0),
+        num_cache_hits_(0),
+        states_(net->GetSequenceStateSize(), 1024) {
+    assert(!settings_.empty());
   }
 
   ~HtkLatticeRescorer() {
   }
 
+  virtual RescorerPointer Clone(const NetPointer &net) const;
   virtual void ReadLattice(const std::string &file_name);
   virtual void RescoreLattice();
   virtual void WriteLattice(const std::string &file_name);
+  virtual int num_settings() const {
+    return settings_.size();
+  }
+  virtual void SelectSetting(const int i);
 
 private:
   struct Node {
@@ -86,17 +122,48 @@ private:
 
   struct Hypothesis {
     Hypothesis() {
+      state = -1;
+      evaluation = 0;
       traceback_id = 0;
       score = 0.;
     }
     bool operator<(const Hypothesis &other) const {
       return score < other.score;
     }
-    State state;
+    // slot of states_ that the hypothesis holds a reference to
+    int state;
+    // of evaluations_ that led to the state, with several settings only
+    int evaluation;
     size_t traceback_id;
     Real score;
   };
 
+  // a hypothesis of a node followed by one of the outgoing links, with the
+  // network probability of the link word and the new state if evaluated
+  struct Expansion {
+    int hypothesis, link_id;
+    Real probability;
+    int state, evaluation;
+  };
+
+  // Network evaluation of a word after the history of another evaluation (the
+  // first one: the initial state, without probability), see evaluations_.
+  struct Evaluation {
+    Real probability;
+    int state;
+  };
+
+  // Network evaluation of a word after a history, shared by all hypotheses
+  // whose last dp_order_ words agree, which is the approximation recombination
+  // makes, too. The key holds these words followed by the word.
+  struct CacheEntry {
+    std::vector<int> key;
+    Real probability;
+    int state;
+  };
+
+  typedef std::list<CacheEntry> CacheList;
+
   struct Trace {
     Trace(const int link_id,
           const int history_word,
@@ -111,19 +178,74 @@ private:
     Real score;
   };
 
-  std::pair<size_t, size_t> ParseField(
-      const std::string &line,
-      const std::string &field,
-      int *const result) const;
-  std::pair<size_t, size_t> ParseField(
-      const std::string &line,
-      const std::string &field,
-      Real *const result) const;
-  std::pair<size_t, size_t> ParseField(
-      const std::string &line,
-      const std::string &field,
-      std::string *const result = nullptr) const;
-  void ParseLine(const std::string &line, int *num_links);
+  // Single-pass parsing of the lines of an HTK SLF lattice in buffer_: a
+  // field name=value of a line, the value possibly in double quotes.
+  struct Field {
+    bool Is(const char *name) const {
+      return strlen(name) == name_length &&
+             memcmp(name, begin, name_length) == 0;
+    }
+    int ToInt() const {
+      return strtol(value, nullptr, 10);
+    }
+    Real ToReal() const {
+      return strtod(value, nullptr);
+    }
+    const char *begin, *end, *value;
+    size_t name_length, value_length;
+  };
+
+  // the fields of a link that WriteHtkLattice() replaces, as offsets into
+  // buffer_
+  struct LinkText {
+    int link_id;
+    size_t am_score_begin, am_score_end, lm_score_begin, lm_score_end;
+  };
+
+  // Binary cache of a parsed lattice, the file name of the lattice followed
+  // by ".cache": this header, then nodes_ (with look-ahead scores), links_,
+  // the node IDs of sorted_nodes_, successor_links_ as num_nodes + 1 offsets
+  // into the link IDs, the OOV words as link IDs, num_oov_words + 1 offsets
+  // and their characters, and link_texts_. The cache is valid for the lattice
+  // file with the given size and modification time, read with the same
+  // vocabulary and options.
+  struct LatticeCacheHeader {
+    char magic[8];
+    uint64_t source_size, vocabulary_checksum;
+    int64_t source_time;
+    int32_t clear_initial_links, set_sb_next_to_last_links, set_sb_last_links,
+            semiring;
+    Real look_ahead_lm_scale;
+    uint64_t num_nodes, num_links, num_oov_words, oov_text_size,
+             num_link_texts;
+  };
+
+  static bool StartsWith(const char *begin,
+                         const char *end,
+                         const char *prefix) {
+    const size_t length = strlen(prefix);
+    return static_cast<size_t>(end - begin) >= length &&
+           memcmp(begin, prefix, length) == 0;
+  }
+
+  // the next line at position (without surrounding white space)
+  static bool NextLine(const char **position,
+                       const char *end,
+                       const char **line_begin,
+                       const char **line_end);
+  static bool NextField(const char **position,
+                        const char *end,
+                        Field *field);
+  // the fields with the given names, each of which occurs exactly once
+  static void ParseFields(const char *begin,
+                          const char *end,
+                          std::initializer_list<const char *> names,
+                          Field fields[]);
+  void ParseLine(const char *begin, const char *end, int *num_links);
+  void ParseLattice(const std::string &file_name);
+  // false if there is no valid cache of the lattice
+  bool ReadLatticeCache(const std::string &file_name);
+  void WriteLatticeCache(const std::string &file_name);
 
   int AddTraceback(const int link_id,
                    const int history_word,
@@ -185,6 +307,25 @@ private:
     return hash;
   }
 
+  // the words Hash() combines, followed by word
+  void GetCacheKey(int traceback_id,
+                   const int word,
+                   std::vector<int> *key) const {
+    key->clear();
+    for (int i = 0; i < dp_order_; ++i) {
+      while (GetLinkID(traceback_id) >= 0 &&
+             links_[GetLinkID(traceback_id)].lm_score == 0.)
+        traceback_id = GetPredecessorID(traceback_id);
+      key->push_back(GetHistoryWord(traceback_id));
+      traceback_id = GetPredecessorID(traceback_id);
+    }
+    key->push_back(word);
+  }
+
+  // least recently used entries are evicted first
+  const CacheEntry *LookUpCache(const std::vector<int> &key);
+  void AddToCache(const std::vector<int> &key, const Expansion &expansion);
+
   Real ScaledLogAdd(const Real scale, Real x, Real y) {
     if (y >= std::numeric_limits<Real>::max())
       return x;
@@ -208,11 +349,24 @@ private:
   }
 
   void SortTopologically();
-  void SortTopologicallyHelper(const int node_id,
-                               std::unordered_set<int> *visited);
   void ComputeLookAheadScores();
   void Reset();
+  void ReleaseHypotheses(std::priority_queue<Hypothesis> *hypotheses);
+  void ClearCache();
+  void ClearEvaluations();
+  // the evaluation of word after the history of evaluation, -1 if none
+  int LookUpEvaluation(const int evaluation, const int word);
+  void AddEvaluation(const int evaluation,
+                     const int word,
+                     Expansion *expansion);
+  // to tell the output files of several settings apart
+  std::string GetSettingSuffix() const;
   void Prune(const int time);
+  // Evaluates the given expansions in batches of up to the batch size of the
+  // network, each sequence of a batch continuing from its own hypothesis.
+  void EvaluateExpansions(const std::vector<Hypothesis> &hypotheses,
+                          const std::vector<int> &evaluated_expansions,
+                          std::vector<Expansion> *expansions);
   void TraceBack();
   void TraceBackCtm();
   void TraceBackLattice();
@@ -225,12 +379,33 @@ private:
   const size_t pruning_limit_;
   const LookAheadSemiring semiring_;
   const OutputFormat output_format_;
-  const Real look_ahead_lm_scale_, lm_scale_, pruning_threshold_, epsilon_;
+  const Real pruning_threshold_, epsilon_;
+  // of the current setting
+  Real look_ahead_lm_scale_, lm_scale_;
+  const size_t cache_size_;
   const bool is_dependent_,
+             is_cache_persistent_,
              clear_initial_links_,
              set_sb_next_to_last_links_,
-             set_sb_last_links_;
+             set_sb_last_links_,
+             use_lattice_cache_;
+  const uint64_t vocabulary_checksum_;
+  const std::vector<Setting> settings_;
+  int setting_;
+  // the LM scores of the links as read, which TraceBack() overwrites
+  std::vector<Real> lm_scores_;
+  // Network evaluations of the lattice shared by the passes of all settings,
+  // exact as their histories are the whole paths from the initial state. An
+  // evaluation holds a reference to its state.
+  std::vector<Evaluation> evaluations_;
+  std::unordered_map<std::pair<int, int>,
+                     int,
+                     boost::hash<std::pair<int, int>>> evaluation_by_history_;
+  size_t num_evaluation_lookups_, num_evaluation_hits_;
   std::vector<int> single_best_, topological_order_;
+  // the lattice file read, see WriteHtkLattice()
+  std::string buffer_;
+  std::vector<LinkText> link_texts_;
   std::unordered_map<int, std::string> oov_by_link_;
   std::vector<Node> nodes_;
   std::vector<Node *> sorted_nodes_;
@@ -240,4 +415,16 @@ private:
   std::unordered_map<int, std::vector<int>> nodes_by_time_;
   std::vector<Trace> traceback_;
   std::unordered_map<int, Real> best_score_by_time_;
+  // most recently used entries first
+  CacheList cache_;
+  std::unordered_map<std::vector<int>,
+                     CacheList::iterator,
+                     boost::hash<std::vector<int>>> cache_by_key_;
+  std::vector<int> cache_key_;
+  size_t num_cache_lookups_, num_cache_hits_;
+  // states of the hypotheses and of the cache
+  StateArena states_;
+  // activations of EvaluateExpansions()
+  std::vector<int> batch_words_, batch_targets_;
+  ProbabilitySequenceVector batch_probabilities_;
 };
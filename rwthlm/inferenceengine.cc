@@ -0,0 +1,163 @@
+/*
+ * Copyright 2014 RWTH Aachen University. All rights reserved.
+ *
+ * Licensed under the RWTH LM License (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include "inferenceengine.h"
+
+InferenceEngine::InferenceEngine(const ConstVocabularyPointer &vocabulary,
+                                 const NetPointer &net,
+                                 const int max_sessions,
+                                 const int max_rollback,
+                                 const int max_batch_size)
+    : vocabulary_(vocabulary),
+      net_(net),
+      max_rollback_(max_rollback),
+      state_size_(net->GetSequenceStateSize()),
+      slots_(max_sessions),
+      states_(static_cast<size_t>(max_sessions) * (max_rollback + 1) *
+              state_size_),
+      next_free_slots_(new std::atomic<int>[max_sessions]),
+      free_head_(PackHead(-1, 0)) {
+  assert(max_sessions > 0 && max_rollback >= 0 && max_batch_size > 0);
+  batch_net_ = net_->CloneForEvaluation(max_batch_size, 3);
+  for (int i = max_sessions - 1; i >= 0; --i) {
+    Slot &slot = slots_[i];
+    // one sequence that is short, as for rescoring, see Net::Reset(true)
+    slot.net = net_->CloneForEvaluation(1, 3);
+    slot.words.resize(max_rollback + 1);
+    slot.is_active = false;
+    PushFreeSlot(i);
+  }
+}
+
+int InferenceEngine::CreateSession() {
+  const int session = PopFreeSlot();
+  if (session < 0)
+    return -1;
+  Slot &slot = slots_[session];
+  assert(!slot.is_active);
+  slot.is_active = true;
+  slot.position = 0;
+  slot.num_states = 1;
+  slot.length = 0;
+  // zero state, sentence boundary as first history word
+  slot.net->Reset(false);
+  slot.net->ResetHistories();
+  slot.net->ExtractSequenceState(0, GetState(session, 0));
+  slot.words[0] = vocabulary_->sb_index();
+  return session;
+}
+
+void InferenceEngine::DestroySession(const int session) {
+  GetActiveSlot(session).is_active = false;
+  PushFreeSlot(session);
+}
+
+Real InferenceEngine::Score(const int session, const int word) {
+  return Evaluate(session, word);
+}
+
+Real InferenceEngine::Advance(const int session, const int word) {
+  const Real log_probability = Evaluate(session, word);
+  // the new state goes to the previous time step
+  Net *net = slots_[session].net.get();
+  net->Reset(true);
+  net->ExtractSequenceState(0, PushState(session, word));
+  return log_probability;
+}
+
+Real *InferenceEngine::PushState(const int session, const int word) {
+  Slot &slot = GetActiveSlot(session);
+  const int size = max_rollback_ + 1;
+  slot.position = (slot.position + 1) % size;
+  slot.num_states = std::min(slot.num_states + 1, size);
+  ++slot.length;
+  slot.words[slot.position] = word;
+  return GetState(session, slot.position);
+}
+
+void InferenceEngine::EvaluateBatch(std::vector<Step> *steps) {
+  const int batch_size = steps->size();
+  assert(batch_size > 0 && batch_size <= batch_net_->max_batch_size());
+  batch_words_.resize(batch_size);
+  batch_targets_.resize(batch_size);
+  batch_net_->Reset(true);
+  batch_net_->ResetHistories();
+  for (int j = 0; j < batch_size; ++j) {
+    const Step &step = (*steps)[j];
+    const Slot &slot = GetActiveSlot(step.session);
+    assert(step.word >= 0 && step.word < vocabulary_->GetVocabularySize());
+    batch_net_->SetSequenceState(GetState(step.session, slot.position), j);
+    batch_words_[j] = slot.words[slot.position];
+    batch_targets_[j] = step.word;
+  }
+  const Slice slice(batch_targets_.data(), batch_size);
+  const Real *y = batch_net_->Evaluate(slice, batch_words_.data());
+  batch_probabilities_.assign(batch_size, ProbabilitySequence());
+  batch_net_->ComputeLogProbability(slice, y, false, &batch_probabilities_);
+  batch_net_->Reset(true);
+  for (int j = 0; j < batch_size; ++j) {
+    Step &step = (*steps)[j];
+    step.log_probability = log(batch_probabilities_[j].front());
+    if (step.is_advance)
+      batch_net_->ExtractSequenceState(j, PushState(step.session, step.word));
+  }
+}
+
+void InferenceEngine::Rollback(const int session, const int num_words) {
+  Slot &slot = GetActiveSlot(session);
+  assert(num_words >= 0 && num_words < slot.num_states);
+  const int size = max_rollback_ + 1;
+  slot.position = (slot.position + size - num_words) % size;
+  slot.num_states -= num_words;
+  slot.length -= num_words;
+}
+
+Real InferenceEngine::Evaluate(const int session, const int word) {
+  assert(word >= 0 && word < vocabulary_->GetVocabularySize());
+  const Slot &slot = GetActiveSlot(session);
+  Net *net = slot.net.get();
+  // the state goes to the previous time step
+  net->Reset(true);
+  net->ResetHistories();
+  net->SetSequenceState(GetState(session, slot.position), 0);
+  const Slice slice(&word, 1);
+  const Real *y = net->Evaluate(slice, &slot.words[slot.position]);
+  return net->ComputeLogProbability(slice, y, false);
+}
+
+int InferenceEngine::PopFreeSlot() {
+  uint64_t head = free_head_.load(std::memory_order_acquire);
+  for (;;) {
+    const int slot = GetSlot(head);
+    if (slot < 0)
+      return -1;
+    const int next = next_free_slots_[slot].load(std::memory_order_relaxed);
+    if (free_head_.compare_exchange_weak(head,
+                                         PackHead(next, GetTag(head) + 1),
+                                         std::memory_order_acq_rel,
+                                         std::memory_order_acquire))
+      return slot;
+  }
+}
+
+void InferenceEngine::PushFreeSlot(const int slot) {
+  uint64_t head = free_head_.load(std::memory_order_relaxed);
+  do {
+    next_free_slots_[slot].store(GetSlot(head), std::memory_order_relaxed);
+  } while (!free_head_.compare_exchange_weak(head,
+                                             PackHead(slot, GetTag(head)),
+                                             std::memory_order_release,
+                                             std::memory_order_relaxed));
+}
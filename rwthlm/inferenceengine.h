@@ -0,0 +1,134 @@
+/*
+ * Copyright 2014 RWTH Aachen University. All rights reserved.
+ *
+ * Licensed under the RWTH LM License (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "function.h"
+#include "net.h"
+#include "vocabulary.h"
+
+// Serves many concurrent sessions (e.g., the sentences typed by the users of
+// an input method) with one network: Each session is a word sequence starting
+// with a sentence boundary. Its state lives in one of max_sessions slots that
+// are allocated up front, each holding a fixed number of states of
+// Net::GetSequenceStateSize() values, so that the cost of a call depends
+// neither on the number of sessions nor on what the other sessions do. A slot
+// evaluates with its own activations, see Net::CloneForEvaluation(), and the
+// weights of the network are only read.
+//
+// All methods are thread-safe, except that calls for one session must not
+// overlap and EvaluateBatch() must not be called concurrently with itself.
+// The weights of the network must not change while the engine is in use.
+class InferenceEngine {
+public:
+  // Score() or Advance() of a session, see EvaluateBatch()
+  struct Step {
+    int session, word;
+    bool is_advance;
+    Real log_probability;
+  };
+
+  InferenceEngine(const ConstVocabularyPointer &vocabulary,
+                  const NetPointer &net,
+                  const int max_sessions,
+                  const int max_rollback,
+                  const int max_batch_size);
+
+  // returns -1 if all slots are in use
+  int CreateSession();
+
+  void DestroySession(const int session);
+
+  // log probability of word following the words of the session so far
+  Real Score(const int session, const int word);
+
+  // appends word to the session, returns its log probability
+  Real Advance(const int session, const int word);
+
+  // removes the last num_words (at most max_rollback) words of the session
+  void Rollback(const int session, const int num_words);
+
+  // Evaluates the steps of at most max_batch_size distinct sessions as one
+  // batch, which is cheaper than evaluating them one by one, and sets their
+  // log probabilities.
+  void EvaluateBatch(std::vector<Step> *steps);
+
+  // number of words of the session, without the sentence boundary
+  int GetLength(const int session) const {
+    return slots_[session].length;
+  }
+
+private:
+  struct Slot {
+    NetPointer net;
+    // ring buffer of the last max_rollback + 1 words, see GetState()
+    std::vector<int> words;
+    int position, num_states, length;
+    bool is_active;
+  };
+
+  // The free slots form a lock-free stack. Its head holds the slot index + 1
+  // (0: empty) in the lower and a tag in the upper 32 bits. The tag changes
+  // with every pop, so a pop that raced with a pop and push of the same slot
+  // (ABA) does not succeed.
+  static uint64_t PackHead(const int slot, const uint32_t tag) {
+    return static_cast<uint64_t>(tag) << 32 | static_cast<uint32_t>(slot + 1);
+  }
+
+  static int GetSlot(const uint64_t head) {
+    return static_cast<int>(head & 0xffffffffu) - 1;
+  }
+
+  static uint32_t GetTag(const uint64_t head) {
+    return static_cast<uint32_t>(head >> 32);
+  }
+
+  int PopFreeSlot();
+
+  void PushFreeSlot(const int slot);
+
+  // the state after the word at position of the ring buffer of slot
+  Real *GetState(const int slot, const int position) {
+    return &states_[(static_cast<size_t>(slot) * (max_rollback_ + 1) +
+                     position) * state_size_];
+  }
+
+  Slot &GetActiveSlot(const int session) {
+    assert(session >= 0 && session < static_cast<int>(slots_.size()));
+    Slot &slot = slots_[session];
+    assert(slot.is_active);
+    return slot;
+  }
+
+  // evaluates word after the current state of the session, leaving the new
+  // state in the activations of the net of its slot
+  Real Evaluate(const int session, const int word);
+
+  // moves the ring buffer of the session to the next state, for Advance()
+  Real *PushState(const int session, const int word);
+
+  const ConstVocabularyPointer &vocabulary_;
+  const NetPointer &net_;
+  const int max_rollback_, state_size_;
+  std::vector<Slot> slots_;
+  // the states of all slots, max_rollback + 1 per slot
+  std::vector<Real> states_;
+  std::unique_ptr<std::atomic<int>[]> next_free_slots_;
+  std::atomic<uint64_t> free_head_;
+  // activations of EvaluateBatch()
+  NetPointer batch_net_;
+  std::vector<int> batch_words_, batch_targets_;
+  ProbabilitySequenceVector batch_probabilities_;
+};
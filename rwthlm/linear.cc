@@ -21,18 +21,28 @@ Linear::Linear(const int input_dimension,
                const int max_sequence_length,
                const bool is_recurrent,
                const bool use_bias,
+               const bool is_trainable,
                ActivationFunctionPointer activation_function)
-    : Function(input_dimension,
-               output_dimension,
-               max_batch_size,
-               max_sequence_length),
+    : Layer(input_dimension,
+            output_dimension,
+            max_batch_size,
+            max_sequence_length,
+            is_trainable),
+      delta_(nullptr),
+      weights_(nullptr),
+      bias_(nullptr),
+      momentum_weights_(nullptr),
+      momentum_bias_(nullptr),
       activation_function_(std::move(activation_function)){
   b_ = FastMalloc(output_dimension * max_batch_size * max_sequence_length);
-  delta_ = FastMalloc(output_dimension * max_batch_size * max_sequence_length);
-  weights_ = FastMalloc(output_dimension * input_dimension);
-  bias_ = use_bias ? FastMalloc(output_dimension) : nullptr;
-  momentum_weights_ = FastMalloc(output_dimension * input_dimension);
-  momentum_bias_ = use_bias ? FastMalloc(output_dimension) : nullptr;
+  if (is_trainable) {
+    delta_ = FastMalloc(output_dimension * max_batch_size *
+                        max_sequence_length);
+    weights_ = FastMalloc(output_dimension * input_dimension);
+    bias_ = use_bias ? FastMalloc(output_dimension) : nullptr;
+    momentum_weights_ = FastMalloc(output_dimension * input_dimension);
+    momentum_bias_ = use_bias ? FastMalloc(output_dimension) : nullptr;
+  }
   if (is_recurrent) {
     recurrency_ = RecurrencyPointer(new Recurrency(output_dimension,
                                                    max_batch_size,
@@ -40,7 +50,8 @@ Linear::Linear(const int input_dimension,
                                                    b_,
                                                    b_t_,
                                                    delta_,
-                                                   delta_t_));
+                                                   delta_t_,
+                                                   is_trainable));
   }
 }
 
@@ -147,11 +158,38 @@ void Linear::ResetMomentum() {
   if (momentum_bias_) {
     FastZero(output_dimension(), momentum_bias_);
   }
+  if (recurrency_)
+    recurrency_->ResetMomentum();
+}
+
+void Linear::ShareWeights(const Function &f,
+                          const bool share_sparse_updates) {
+  const Linear &linear = dynamic_cast<const Linear &>(f);
+  assert(!shares_weights() && !linear.shares_weights());
+  assert(input_dimension() == linear.input_dimension() &&
+         output_dimension() == linear.output_dimension());
+  set_shares_weights(true);
+  FastFree(weights_);
+  FastFree(bias_);
+  weights_ = linear.weights_;
+  bias_ = linear.bias_;
+  if (is_trainable())
+    ResetMomentum();
+  if (recurrency_)
+    recurrency_->ShareWeights(*linear.recurrency_, share_sparse_updates);
+}
+
+void Linear::GetUpdateBuffers(BufferVector *buffers) {
+  buffers->push_back(std::make_pair(momentum_weights_,
+                                    output_dimension() * input_dimension()));
+  if (momentum_bias_)
+    buffers->push_back(std::make_pair(momentum_bias_, output_dimension()));
+  if (recurrency_)
+    recurrency_->GetUpdateBuffers(buffers);
 }
 
 void Linear::Reset(const bool is_dependent) {
   if (is_dependent && recurrency_) {
-    assert(max_batch_size() == 1);
     FastCopy(b_ + GetOffset(), GetOffset(), b_);
     b_t_ = b_ + GetOffset();
   } else {
@@ -160,7 +198,8 @@ void Linear::Reset(const bool is_dependent) {
   delta_t_ = delta_;
   const int size = GetOffset() * max_sequence_length();
   FastZero(size - GetOffset(), b_t_);
-  FastZero(size, delta_);
+  if (delta_)
+    FastZero(size, delta_);
 }
 
 void Linear::ExtractState(State *state) const {
@@ -182,6 +221,16 @@ void Linear::SetState(const State &state, const int i) {
   }
 }
 
+void Linear::ExtractSequenceState(const int j, Real state[]) const {
+  if (recurrency_)
+    FastCopy(b_ + j * output_dimension(), output_dimension(), state);
+}
+
+void Linear::SetSequenceState(const Real state[], const int j) {
+  if (recurrency_)
+    FastCopy(state, output_dimension(), b_ + j * output_dimension());
+}
+
 void Linear::Read(std::ifstream *input_stream) {
   input_stream->read(reinterpret_cast<char *>(weights_),
                      output_dimension() * input_dimension() * sizeof(Real));
@@ -16,7 +16,7 @@
 #include "function.h"
 #include "recurrency.h"
 
-class Linear : public Function {
+class Linear : public Layer {
 public:
   Linear(const int input_dimension,
          const int output_dimension,
@@ -24,13 +24,16 @@ public:
          const int max_sequence_length,
          const bool is_recurrent,
          const bool use_bias,
+         const bool is_trainable,
          ActivationFunctionPointer activation_function);
 
   virtual ~Linear() {
     FastFree(b_);
     FastFree(delta_);
-    FastFree(weights_);
-    FastFree(bias_);
+    if (!shares_weights()) {
+      FastFree(weights_);
+      FastFree(bias_);
+    }
     FastFree(momentum_weights_);
     FastFree(momentum_bias_);
   }
@@ -55,12 +58,25 @@ public:
 
   virtual void SetState(const State &state, const int i = 0);
 
+  virtual int GetSequenceStateSize() const {
+    return recurrency_ ? output_dimension() : 0;
+  }
+
+  virtual void ExtractSequenceState(const int j, Real state[]) const;
+
+  virtual void SetSequenceState(const Real state[], const int j);
+
   virtual void Read(std::ifstream *input_stream);
 
   virtual void Write(std::ofstream *output_stream);
 
   virtual void RandomizeWeights(Random *random);
 
+  virtual void ShareWeights(const Function &f,
+                            const bool share_sparse_updates);
+
+  virtual void GetUpdateBuffers(BufferVector *buffers);
+
 private:
   friend class GradientTest;
 
@@ -20,11 +20,13 @@ LSTM::LSTM(const int input_dimension,
            const int output_dimension,
            const int max_batch_size,
            const int max_sequence_length,
-           const bool use_bias)
-    : Function(input_dimension,
-               output_dimension,
-               max_batch_size,
-               max_sequence_length),
+           const bool use_bias,
+           const bool is_trainable)
+    : Layer(input_dimension,
+            output_dimension,
+            max_batch_size,
+            max_sequence_length,
+            is_trainable),
       sigmoid_(),
       tanh_() {
   int size = output_dimension * max_batch_size * max_sequence_length;
@@ -42,12 +44,16 @@ LSTM::LSTM(const int input_dimension,
   forget_gate_b_t_ = forget_gate_b_;
   output_gate_b_t_ = output_gate_b_;
 
+  // deltas and weights are only needed for training
+  auto allocate = [is_trainable](const int size) {
+    return is_trainable ? FastMalloc(size) : nullptr;
+  };
   size = output_dimension * max_batch_size * max_sequence_length;
-  cec_epsilon_ = FastMalloc(size);
-  delta_ = FastMalloc(size);
-  input_gate_delta_ = FastMalloc(size);
-  forget_gate_delta_ = FastMalloc(size);
-  output_gate_delta_ = FastMalloc(size);
+  cec_epsilon_ = allocate(size);
+  delta_ = allocate(size);
+  input_gate_delta_ = allocate(size);
+  forget_gate_delta_ = allocate(size);
+  output_gate_delta_ = allocate(size);
 
   cec_epsilon_t_ = cec_epsilon_;
   delta_t_ = delta_;
@@ -56,43 +62,43 @@ LSTM::LSTM(const int input_dimension,
   output_gate_delta_t_ = output_gate_delta_;
 
   size = input_dimension * output_dimension;
-  weights_ = FastMalloc(size);
-  input_gate_weights_ = FastMalloc(size);
-  forget_gate_weights_ = FastMalloc(size);
-  output_gate_weights_ = FastMalloc(size);
-  momentum_weights_ = FastMalloc(size);
-  momentum_input_gate_weights_ = FastMalloc(size);
-  momentum_forget_gate_weights_ = FastMalloc(size);
-  momentum_output_gate_weights_ = FastMalloc(size);
+  weights_ = allocate(size);
+  input_gate_weights_ = allocate(size);
+  forget_gate_weights_ = allocate(size);
+  output_gate_weights_ = allocate(size);
+  momentum_weights_ = allocate(size);
+  momentum_input_gate_weights_ = allocate(size);
+  momentum_forget_gate_weights_ = allocate(size);
+  momentum_output_gate_weights_ = allocate(size);
 
   size = output_dimension * output_dimension;
-  recurrent_weights_ = FastMalloc(size);
-  input_gate_recurrent_weights_ = FastMalloc(size);
-  forget_gate_recurrent_weights_ = FastMalloc(size);
-  output_gate_recurrent_weights_ = FastMalloc(size);
-  momentum_recurrent_weights_ = FastMalloc(size);
-  momentum_input_gate_recurrent_weights_ = FastMalloc(size);
-  momentum_forget_gate_recurrent_weights_ = FastMalloc(size);
-  momentum_output_gate_recurrent_weights_ = FastMalloc(size);
+  recurrent_weights_ = allocate(size);
+  input_gate_recurrent_weights_ = allocate(size);
+  forget_gate_recurrent_weights_ = allocate(size);
+  output_gate_recurrent_weights_ = allocate(size);
+  momentum_recurrent_weights_ = allocate(size);
+  momentum_input_gate_recurrent_weights_ = allocate(size);
+  momentum_forget_gate_recurrent_weights_ = allocate(size);
+  momentum_output_gate_recurrent_weights_ = allocate(size);
 
-  input_gate_peephole_weights_ = FastMalloc(output_dimension);
-  forget_gate_peephole_weights_ = FastMalloc(output_dimension);
-  output_gate_peephole_weights_ = FastMalloc(output_dimension);
-  momentum_input_gate_peephole_weights_ = FastMalloc(output_dimension);
-  momentum_forget_gate_peephole_weights_ = FastMalloc(output_dimension);
-  momentum_output_gate_peephole_weights_ = FastMalloc(output_dimension);
+  input_gate_peephole_weights_ = allocate(output_dimension);
+  forget_gate_peephole_weights_ = allocate(output_dimension);
+  output_gate_peephole_weights_ = allocate(output_dimension);
+  momentum_input_gate_peephole_weights_ = allocate(output_dimension);
+  momentum_forget_gate_peephole_weights_ = allocate(output_dimension);
+  momentum_output_gate_peephole_weights_ = allocate(output_dimension);
 
-  bias_ = use_bias ? FastMalloc(output_dimension) : nullptr;
-  input_gate_bias_ = use_bias ? FastMalloc(output_dimension) : nullptr;
-  forget_gate_bias_ = use_bias ? FastMalloc(output_dimension) : nullptr;
-  output_gate_bias_ = use_bias ? FastMalloc(output_dimension) : nullptr;
-  momentum_bias_ = use_bias ? FastMalloc(output_dimension) : nullptr;
+  bias_ = use_bias ? allocate(output_dimension) : nullptr;
+  input_gate_bias_ = use_bias ? allocate(output_dimension) : nullptr;
+  forget_gate_bias_ = use_bias ? allocate(output_dimension) : nullptr;
+  output_gate_bias_ = use_bias ? allocate(output_dimension) : nullptr;
+  momentum_bias_ = use_bias ? allocate(output_dimension) : nullptr;
   momentum_input_gate_bias_ = use_bias ?
-      FastMalloc(output_dimension) : nullptr;
+      allocate(output_dimension) : nullptr;
   momentum_forget_gate_bias_ = use_bias ?
-      FastMalloc(output_dimension) : nullptr;
+      allocate(output_dimension) : nullptr;
   momentum_output_gate_bias_ = use_bias ?
-      FastMalloc(output_dimension) : nullptr;
+      allocate(output_dimension) : nullptr;
 }
 
 LSTM::~LSTM() {
@@ -107,17 +113,8 @@ LSTM::~LSTM() {
   FastFree(input_gate_delta_);
   FastFree(forget_gate_delta_);
   FastFree(output_gate_delta_);
-  FastFree(weights_);
-  FastFree(recurrent_weights_);
-  FastFree(input_gate_weights_);
-  FastFree(input_gate_recurrent_weights_);
-  FastFree(input_gate_peephole_weights_);
-  FastFree(forget_gate_weights_);
-  FastFree(forget_gate_recurrent_weights_);
-  FastFree(forget_gate_peephole_weights_);
-  FastFree(output_gate_weights_);
-  FastFree(output_gate_recurrent_weights_);
-  FastFree(output_gate_peephole_weights_);
+  if (!shares_weights())
+    FreeWeights();
   FastFree(momentum_weights_);
   FastFree(momentum_recurrent_weights_);
   FastFree(momentum_input_gate_weights_);
@@ -129,18 +126,37 @@ LSTM::~LSTM() {
   FastFree(momentum_output_gate_weights_);
   FastFree(momentum_output_gate_recurrent_weights_);
   FastFree(momentum_output_gate_peephole_weights_);
-  FastFree(bias_);
-  FastFree(input_gate_bias_);
-  FastFree(forget_gate_bias_);
-  FastFree(output_gate_bias_);
   FastFree(momentum_bias_);
   FastFree(momentum_input_gate_bias_);
   FastFree(momentum_forget_gate_bias_);
   FastFree(momentum_output_gate_bias_);
 }
 
+void LSTM::FreeWeights() {
+  FastFree(weights_);
+  FastFree(recurrent_weights_);
+  FastFree(input_gate_weights_);
+  FastFree(input_gate_recurrent_weights_);
+  FastFree(input_gate_peephole_weights_);
+  FastFree(forget_gate_weights_);
+  FastFree(forget_gate_recurrent_weights_);
+  FastFree(forget_gate_peephole_weights_);
+  FastFree(output_gate_weights_);
+  FastFree(output_gate_recurrent_weights_);
+  FastFree(output_gate_peephole_weights_);
+  FastFree(bias_);
+  FastFree(input_gate_bias_);
+  FastFree(forget_gate_bias_);
+  FastFree(output_gate_bias_);
+}
+
 const Real *LSTM::Evaluate(const Slice &slice, const Real x[]) {
   const bool start = b_t_ == b_;
+  // sentences starting now do not see the previous time step
+  const ResetMask mask(start ? nullptr : slice.resets(),
+                       slice.size(),
+                       output_dimension(),
+                       {b_t_ - GetOffset(), cec_b_t_ - GetOffset()});
 #pragma omp parallel sections
 {
 #pragma omp section
@@ -261,6 +277,20 @@ void LSTM::ComputeDelta(const Slice &slice, FunctionPointer f) {
   input_gate_b_t_ -= GetOffset();
   forget_gate_b_t_ -= GetOffset();
   output_gate_b_t_ -= GetOffset();
+  // no errors flow back from sentences starting at the next time step or
+  // into the previous time step of sentences starting now
+  const ResetMask next_mask(delta_t_ != delta_ ? slice.next_resets() : nullptr,
+                            slice.size(),
+                            output_dimension(),
+                            {delta_t_ - GetOffset(),
+                             input_gate_delta_t_ - GetOffset(),
+                             forget_gate_delta_t_ - GetOffset(),
+                             output_gate_delta_t_ - GetOffset(),
+                             cec_epsilon_t_ - GetOffset()});
+  const ResetMask mask(b_t_ != b_ ? slice.resets() : nullptr,
+                       slice.size(),
+                       output_dimension(),
+                       {cec_b_t_ - GetOffset()});
 
   // cell outputs
   f->AddDelta(slice, delta_t_);
@@ -443,6 +473,10 @@ const Real *LSTM::UpdateWeights(const Slice &slice,
   input_gate_delta_t_ -= GetOffset();
   forget_gate_delta_t_ -= GetOffset();
   output_gate_delta_t_ -= GetOffset();
+  const ResetMask mask(b_t_ != b_ ? slice.resets() : nullptr,
+                       slice.size(),
+                       output_dimension(),
+                       {b_t_ - GetOffset(), cec_b_t_ - GetOffset()});
 #pragma omp parallel sections
 {
 #pragma omp section
@@ -855,9 +889,67 @@ void LSTM::ResetMomentum() {
   }
 }
 
+void LSTM::ShareWeights(const Function &f,
+                        const bool share_sparse_updates) {
+  const LSTM &lstm = dynamic_cast<const LSTM &>(f);
+  assert(!shares_weights() && !lstm.shares_weights());
+  assert(input_dimension() == lstm.input_dimension() &&
+         output_dimension() == lstm.output_dimension());
+  set_shares_weights(true);
+  FreeWeights();
+  weights_ = lstm.weights_;
+  recurrent_weights_ = lstm.recurrent_weights_;
+  input_gate_weights_ = lstm.input_gate_weights_;
+  input_gate_recurrent_weights_ = lstm.input_gate_recurrent_weights_;
+  input_gate_peephole_weights_ = lstm.input_gate_peephole_weights_;
+  forget_gate_weights_ = lstm.forget_gate_weights_;
+  forget_gate_recurrent_weights_ = lstm.forget_gate_recurrent_weights_;
+  forget_gate_peephole_weights_ = lstm.forget_gate_peephole_weights_;
+  output_gate_weights_ = lstm.output_gate_weights_;
+  output_gate_recurrent_weights_ = lstm.output_gate_recurrent_weights_;
+  output_gate_peephole_weights_ = lstm.output_gate_peephole_weights_;
+  bias_ = lstm.bias_;
+  input_gate_bias_ = lstm.input_gate_bias_;
+  forget_gate_bias_ = lstm.forget_gate_bias_;
+  output_gate_bias_ = lstm.output_gate_bias_;
+  if (is_trainable())
+    ResetMomentum();
+}
+
+void LSTM::GetUpdateBuffers(BufferVector *buffers) {
+  int size = input_dimension() * output_dimension();
+  buffers->push_back(std::make_pair(momentum_weights_, size));
+  buffers->push_back(std::make_pair(momentum_input_gate_weights_, size));
+  buffers->push_back(std::make_pair(momentum_forget_gate_weights_, size));
+  buffers->push_back(std::make_pair(momentum_output_gate_weights_, size));
+
+  size = output_dimension() * output_dimension();
+  buffers->push_back(std::make_pair(momentum_recurrent_weights_, size));
+  buffers->push_back(std::make_pair(momentum_input_gate_recurrent_weights_,
+                                    size));
+  buffers->push_back(std::make_pair(momentum_forget_gate_recurrent_weights_,
+                                    size));
+  buffers->push_back(std::make_pair(momentum_output_gate_recurrent_weights_,
+                                    size));
+
+  size = output_dimension();
+  buffers->push_back(std::make_pair(momentum_input_gate_peephole_weights_,
+                                    size));
+  buffers->push_back(std::make_pair(momentum_forget_gate_peephole_weights_,
+                                    size));
+  buffers->push_back(std::make_pair(momentum_output_gate_peephole_weights_,
+                                    size));
+
+  if (momentum_bias_) {
+    buffers->push_back(std::make_pair(momentum_bias_, size));
+    buffers->push_back(std::make_pair(momentum_input_gate_bias_, size));
+    buffers->push_back(std::make_pair(momentum_forget_gate_bias_, size));
+    buffers->push_back(std::make_pair(momentum_output_gate_bias_, size));
+  }
+}
+
 void LSTM::Reset(const bool is_dependent) {
   if (is_dependent) {
-    assert(max_batch_size() == 1);
     FastCopy(b_ + GetOffset(), GetOffset(), b_);
     FastCopy(cec_b_ + GetOffset(), GetOffset(), cec_b_);
     b_t_ = b_ + GetOffset();
@@ -887,11 +979,13 @@ void LSTM::Reset(const bool is_dependent) {
   FastZero(size, forget_gate_b_);
   FastZero(size, output_gate_b_);
 
-  FastZero(size, cec_epsilon_);
-  FastZero(size, delta_);
-  FastZero(size, input_gate_delta_);
-  FastZero(size, forget_gate_delta_);
-  FastZero(size, output_gate_delta_);
+  if (is_trainable()) {
+    FastZero(size, cec_epsilon_);
+    FastZero(size, delta_);
+    FastZero(size, input_gate_delta_);
+    FastZero(size, forget_gate_delta_);
+    FastZero(size, output_gate_delta_);
+  }
 }
 
 void LSTM::ExtractState(State *state) const {
@@ -906,6 +1000,20 @@ void LSTM::SetState(const State &state, const int i) {
   FastCopy(state.states[i].data() + GetOffset(), GetOffset(), cec_b_);
 }
 
+void LSTM::ExtractSequenceState(const int j, Real state[]) const {
+  FastCopy(b_ + j * output_dimension(), output_dimension(), state);
+  FastCopy(cec_b_ + j * output_dimension(),
+           output_dimension(),
+           state + output_dimension());
+}
+
+void LSTM::SetSequenceState(const Real state[], const int j) {
+  FastCopy(state, output_dimension(), b_ + j * output_dimension());
+  FastCopy(state + output_dimension(),
+           output_dimension(),
+           cec_b_ + j * output_dimension());
+}
+
 void LSTM::RandomizeWeights(Random *random) {
 //  const Real sigma = 1. / sqrt(input_dimension());
   const Real sigma = 0.1;
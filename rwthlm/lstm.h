@@ -15,13 +15,14 @@
 #include "sigmoid.h"
 #include "tanh.h"
 
-class LSTM : public Function {
+class LSTM : public Layer {
 public:
   LSTM(const int input_dimension,
        const int output_dimension,
        const int max_batch_size,
        const int max_sequence_length,
-       const bool use_bias);
+       const bool use_bias,
+       const bool is_trainable);
 
   virtual ~LSTM();
 
@@ -45,15 +46,30 @@ public:
 
   virtual void SetState(const State &state, const int i = 0);
 
+  virtual int GetSequenceStateSize() const {
+    return 2 * output_dimension();
+  }
+
+  virtual void ExtractSequenceState(const int j, Real state[]) const;
+
+  virtual void SetSequenceState(const Real state[], const int j);
+
   virtual void RandomizeWeights(Random *random);
 
   virtual void Read(std::ifstream *input_stream);
 
   virtual void Write(std::ofstream *output_stream);
 
+  virtual void ShareWeights(const Function &f,
+                            const bool share_sparse_updates);
+
+  virtual void GetUpdateBuffers(BufferVector *buffers);
+
 private:
   friend class GradientTest;
 
+  void FreeWeights();
+
   void EvaluateSubUnit(const int batch_size,
                        const Real weights[],
                        const Real bias[],
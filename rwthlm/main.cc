@@ -13,16 +13,31 @@
 #include <cstdint>
 #include <cstdlib>
 #include <iostream>
+#include <string>
+#include <vector>
+#include <boost/algorithm/string.hpp>
 #include <boost/program_options.hpp>
 #include <boost/filesystem/operations.hpp>
+#include "corpus.h"
 #include "data.h"
 #include "gradienttest.h"
 #include "htklatticerescorer.h"
+#include "nbestrescorer.h"
 #include "trainer.h"
 #include "vocabulary.h"
 
 namespace po = boost::program_options;
 
+// comma-separated values, e.g., "0.5,0.6"
+std::vector<Real> ParseValues(const std::string &values) {
+  std::vector<std::string> tokens;
+  boost::split(tokens, values, boost::algorithm::is_any_of(","));
+  std::vector<Real> result;
+  for (const std::string &token : tokens)
+    result.push_back(std::stod(token));
+  return result;
+}
+
 void ParseCommandLine(const int argc,
                       const char *const argv[],
                       po::variables_map *options) {
@@ -43,6 +58,26 @@ void ParseCommandLine(const int argc,
       ("train", po::value<std::string>(), "training data file")
       ("dev", po::value<std::string>(), "development data file")
       ("ppl", po::value<std::string>(), "data file for computing perplexity")
+      ("shared-prefixes",
+       "with ppl: evaluate each distinct prefix of the sequences only once, "
+       "e.g., for candidates after the same context")
+      ("sessions",
+       "with ppl and word-wrapping verbatim: score each line word by word as "
+       "a session of the inference engine, threads sessions at a time")
+      ("batch-window", po::value<int>(),
+       "with sessions: batch the steps of the sessions that arrive within "
+       "this many microseconds, and print histograms of queue depth and "
+       "latency")
+      ("scores", po::value<std::string>(),
+       "with ppl and word-wrapping verbatim: write the log10 probability of "
+       "each line to this file (like shared-prefixes)")
+      ("score-format", po::value<std::string>()->default_value("tsv"),
+       "tsv (line, number of tokens, log10 probability, token scores) or "
+       "binary, see scorewriter.h")
+      ("token-scores", "write the log10 probability of each token to scores")
+      ("compile-corpus", po::value<std::string>(),
+       "write training data as pre-tokenized binary corpus to this file "
+       "(usable in place of the text file with the same vocabulary)")
       ("random-seed", po::value<uint32_t>()->default_value(1),
        "random number generator seed")
       ("learning-rate", po::value<Real>(), "initial learning rate")
@@ -54,10 +89,36 @@ void ParseCommandLine(const int argc,
        "maximum length of a sequence")
       ("max-epoch", po::value<int>()->default_value(0),
        "maximum number of epochs to train, zero means unlimited")
+      ("threads", po::value<int>()->default_value(1),
+       "number of batches trained or evaluated in parallel (data-parallel "
+       "training), or of lattices rescored in parallel")
+      ("asynchronous", "with --threads, update shared weights without "
+       "synchronization (Hogwild)")
+      ("max-staleness", po::value<size_t>()->default_value(0),
+       "with --asynchronous, maximum number of dense updates by other threads "
+       "a dense update may lag behind, zero means unlimited")
+      ("processes", po::value<int>()->default_value(1),
+       "number of processes training in parallel, each of them started "
+       "separately with the same options and its own --process-index")
+      ("process-index", po::value<int>()->default_value(0),
+       "index of this process, process 0 coordinates the training")
+      ("shared-memory", po::value<std::string>()->default_value("/rwthlm"),
+       "name of the POSIX shared memory segment of the processes")
       ("no-shuffling", "do not shuffle training data")
+      ("bucketing", "form batches of training sequences of similar length "
+       "(sorted across all data instead of within each batch)")
+      ("streaming", po::value<int>()->default_value(0),
+       "read training data in the background in shards of this many lines "
+       "(each shuffled on its own), zero means reading it all at once")
+      ("prefetch", po::value<int>()->default_value(16),
+       "with --streaming, maximum number of batches read ahead")
+      ("tokenization", po::value<std::string>()->default_value("words"),
+       "words (separated by whitespace) or characters (raw UTF-8 text, each "
+       "character is a word, runs of unknown characters map to <unk>)")
       ("word-wrapping",
        po::value<std::string>()->default_value("fixed"),
-       "concatenated, fixed or verbatim")
+       "concatenated, fixed, verbatim or continuous (rows of a batch are "
+       "refilled with the next sentence as soon as theirs ends)")
       ("feedforward", "training in feedforward style without recurrencies")
       ("no-bias", "do not use any bias")
       ("num-oovs", po::value<size_t>()->default_value(0),
@@ -72,12 +133,22 @@ void ParseCommandLine(const int argc,
        "Look ahead LM scale for lattice decoding (default: lm-scale)")
       ("lm-scale", po::value<Real>()->default_value(1.0),
        "LM scale for lattice decoding")
+      ("lambda-grid", po::value<std::string>(),
+       "comma-separated interpolation weights, each lattice is rescored with "
+       "each of them and each LM scale, sharing network evaluations")
+      ("lm-scale-grid", po::value<std::string>(),
+       "comma-separated LM scales, see lambda-grid")
       ("pruning-threshold", po::value<Real>(),
        "beam pruning threshold for lattice rescoring, zero means unlimited")
       ("pruning-limit", po::value<size_t>()->default_value(0),
        "maximum number of hypotheses per lattice node, zero means unlimited")
       ("dp-order", po::value<int>()->default_value(3),
        "dynamic programming order for lattice rescoring")
+      ("cache-size", po::value<size_t>()->default_value(0),
+       "number of neural network evaluations cached by their last dp-order "
+       "history words and word for lattice rescoring, zero means no cache")
+      ("persistent-cache",
+       "keep the cache across lattices, e.g., together with --dependent")
       ("output", po::value<std::string>()->default_value("lattice"),
        "ctm, lattice, or expanded-lattice")
       ("clear-initial-links",  // some options for compatibility with RWTH ASR software
@@ -85,12 +156,24 @@ void ParseCommandLine(const int argc,
       ("set-sb-next-to-last",
        "set link label of next to last links in a lattice to <sb>")
       ("set-sb-last",
-       "set link label of last links in a lattice to <sb>");
+       "set link label of last links in a lattice to <sb>")
+      ("nbest",
+       "rescore n-best lists (lines: am-score lm-score num-words words) "
+       "instead of lattices, with lambda and lm-scale")
+      ("log-linear",
+       "with nbest: interpolate the LM scores log-linearly with lambda instead "
+       "of linearly in probability space")
+      ("lattice-cache",
+       "read parsed lattices from binary files next to them (<lattice>.cache) "
+       "and write these if missing or outdated");
 
   hidden.add_options()
       ("positional", po::value<std::vector<std::string>>(),
           "positional arguments")
-      ("self-test", "compare gradient to difference quotient");
+      ("self-test", "compare gradient to difference quotient")
+      ("check-sessions",
+       "with sessions: also roll back, score and append each word again, and "
+       "fail unless they agree (debug only!)");
   all.add(visible).add(hidden);
 
   // define positional options
@@ -117,11 +200,49 @@ void ParseCommandLine(const int argc,
     }
 
     // help option?
-	if (options->count("help") || !options->count("positional")) {
+	if (options->count("help") || (!options->count("positional") &&
+                                   !options->count("compile-corpus"))) {
       std::cout << "Usage: rwthlm [OPTION]... [LATTICE]... NETWORK\n";
       std::cout << visible;
       exit(0);
     }
+
+    // usage errors the parser does not see
+    if (options->count("scores") &&
+        (!options->count("ppl") ||
+         (*options)["word-wrapping"].as<std::string>() != "verbatim" ||
+         options->count("feedforward"))) {
+      throw po::error("option '--scores' requires options '--ppl' and "
+                      "'--word-wrapping verbatim', and no '--feedforward'");
+    }
+    if (options->count("token-scores") && !options->count("scores"))
+      throw po::error("option '--token-scores' requires option '--scores'");
+    const std::string format = (*options)["score-format"].as<std::string>();
+    if (format != "tsv" && format != "binary") {
+      throw po::error("the argument ('" + format + "') for option "
+                      "'--score-format' is invalid, use tsv or binary");
+    }
+    // a session per line, starting after <sb>
+    if (options->count("sessions") &&
+        (!options->count("ppl") ||
+         (*options)["word-wrapping"].as<std::string>() != "verbatim" ||
+         options->count("feedforward") || options->count("debug-no-sb"))) {
+      throw po::error("option '--sessions' requires options '--ppl' and "
+                      "'--word-wrapping verbatim', and no '--feedforward' "
+                      "or '--debug-no-sb'");
+    }
+    if (options->count("log-linear") && !options->count("nbest"))
+      throw po::error("option '--log-linear' requires option '--nbest'");
+    if ((options->count("batch-window") || options->count("check-sessions")) &&
+        !options->count("sessions")) {
+      throw po::error("options '--batch-window' and '--check-sessions' "
+                      "require option '--sessions'");
+    }
+    if (options->count("batch-window") &&
+        (*options)["batch-window"].as<int>() < 0) {
+      throw po::error("the argument for option '--batch-window' must not be "
+                      "negative");
+    }
   } catch (std::exception &e) {
     // unable to parse: print error message
     std::cerr << e.what() << '\n';
@@ -132,25 +253,44 @@ void ParseCommandLine(const int argc,
 void EvaluateCommandLine(const po::variables_map &options) {
   try {
     // parse positional arguments
-    std::vector<std::string> positional = options["positional"].
-        as<std::vector<std::string>>();
-    assert(positional.size() >= 1);
-    std::string net_config = positional.back();
-    positional.pop_back();
+    std::vector<std::string> positional;
+    if (options.count("positional"))
+      positional = options["positional"].as<std::vector<std::string>>();
+    assert(positional.size() >= 1 || options.count("compile-corpus"));
+    std::string net_config;
+    if (!positional.empty()) {
+      net_config = positional.back();
+      positional.pop_back();
+    }
 
     // parse arguments for which default values have been defined
     const bool is_feedforward = options.count("feedforward") > 0,
-               debug_no_sb = options.count("debug-no-sb") > 0;
+               debug_no_sb = options.count("debug-no-sb") > 0,
+               bucketing = options.count("bucketing") > 0;
     const uint32_t seed = options["random-seed"].as<uint32_t>();
     assert(seed >= 0);
     const size_t num_oovs = options["num-oovs"].as<size_t>();
     const int max_batch_size = options["batch-size"].as<int>(),
               max_sequence_length = options["sequence-length"].as<int>(),
-              max_epoch = options["max-epoch"].as<int>();
+              max_epoch = options["max-epoch"].as<int>(),
+              num_threads = options["threads"].as<int>();
+    assert(num_threads >= 1);
+    const bool asynchronous = options.count("asynchronous") > 0;
+    const size_t max_staleness = options["max-staleness"].as<size_t>();
+    // asynchronous updates need several threads, staleness asynchronous ones
+    assert(!asynchronous || num_threads > 1);
+    assert(max_staleness == 0 || asynchronous);
+    const int num_processes = options["processes"].as<int>(),
+              process_index = options["process-index"].as<int>();
+    assert(num_processes >= 1 &&
+           process_index >= 0 && process_index < num_processes);
     const Real momentum = options["momentum"].as<Real>();
     const std::string unk = options.count("unk") ? 
                             options["map-unk"].as<std::string>() : "",
                       sb = options["map-sb"].as<std::string>();
+    const std::string tokenization = options["tokenization"].as<std::string>();
+    assert(tokenization == "words" || tokenization == "characters");
+    const bool is_character_level = tokenization == "characters";
     WordWrappingType word_wrapping_type;
     const std::string type = options["word-wrapping"].as<std::string>();
     if (type == "concatenated")
@@ -159,6 +299,8 @@ void EvaluateCommandLine(const po::variables_map &options) {
       word_wrapping_type = kFixed;
     else if (type == "verbatim")
       word_wrapping_type = kVerbatim;
+    else if (type == "continuous")
+      word_wrapping_type = kContinuous;
     else
       assert(false);
 
@@ -180,12 +322,14 @@ void EvaluateCommandLine(const po::variables_map &options) {
       if (boost::filesystem::exists(vocab_file)) {
         std::cout << "Reading vocabulary from file '" <<
             vocab_file << "' ..." << std::endl;
-        vocabulary = Vocabulary::ConstructFromVocabFile(vocab_file, unk, sb);
+        vocabulary = Vocabulary::ConstructFromVocabFile(
+            vocab_file, unk, sb, is_character_level);
       } else {
         assert(train_file != "");
         std::cout << "Creating vocabulary from training data file '" <<
                      train_file << "' ..." << std::endl;
-        vocabulary = Vocabulary::ConstructFromTrainFile(train_file, unk, sb);
+        vocabulary = Vocabulary::ConstructFromTrainFile(
+            train_file, unk, sb, is_character_level);
         std::cout << "Saving vocabulary to file '" << vocab_file << "' ..." <<
                      std::endl;
         vocabulary->Save(vocab_file);
@@ -194,13 +338,24 @@ void EvaluateCommandLine(const po::variables_map &options) {
       // set up vocabulary from scratch
       std::cout << "Creating vocabulary from training data file '" <<
           train_file << "' ..." << std::endl;
-      vocabulary = Vocabulary::ConstructFromTrainFile(train_file, unk, sb);
+      vocabulary = Vocabulary::ConstructFromTrainFile(
+          train_file, unk, sb, is_character_level);
     }
     if (options.count("remap")) {
       std::cout << "Writing remapped vocabulary ..." << std::endl;
       vocabulary->Save(options["remap"].as<std::string>());
     }
 
+    if (options.count("compile-corpus")) {
+      assert(train_file != "");
+      const std::string corpus_file = options["compile-corpus"].
+                                      as<std::string>();
+      std::cout << "Compiling training data to file '" << corpus_file <<
+                   "' ..." << std::endl;
+      CompiledCorpus::Compile(train_file, corpus_file, *vocabulary);
+      exit(0);
+    }
+
     // create neural network
     Random random(seed);
     const Real learning_rate = options.count("learning-rate") > 0 ?
@@ -234,6 +389,7 @@ void EvaluateCommandLine(const po::variables_map &options) {
                                         max_sequence_length,
                                         word_wrapping_type,
                                         debug_no_sb,
+                                        false,  // training data only
                                         vocabulary);
     }
 
@@ -245,11 +401,16 @@ void EvaluateCommandLine(const po::variables_map &options) {
                                                     max_sequence_length,
                                                     word_wrapping_type,
                                                     debug_no_sb,
+                                                    false,
                                                     vocabulary);
       std::cout << "perplexity:\n" << std::fixed << std::setprecision(20);
       // Perplexity evaluation: The neural network file must exist!
       assert(boost::filesystem::exists(net_config));
       Trainer trainer(max_epoch,
+                      num_threads,  // evaluates batches in parallel
+                      false,
+                      0,
+                      nullptr,
                       false,  // no shuffling here
                       options.count("verbose") > 0,
                       is_feedforward,
@@ -259,16 +420,62 @@ void EvaluateCommandLine(const po::variables_map &options) {
                       ppl_data,
                       ppl_data,
                       &random);
-      std::cout << trainer.ComputePerplexity(ppl_data) << '\n';
+      if (options.count("scores")) {
+        // a sequence per line, see ParseCommandLine()
+        assert(!is_feedforward && word_wrapping_type == kVerbatim);
+        const std::string format = options["score-format"].as<std::string>();
+        assert(format == "tsv" || format == "binary");
+        ScoreWriter scores(options["scores"].as<std::string>(),
+                           format == "tsv" ? ScoreWriter::kTsv :
+                                             ScoreWriter::kBinary,
+                           options.count("token-scores") != 0);
+        std::cout << trainer.ComputePerplexityWithPrefixTrie(ppl_data,
+                                                             &scores) << '\n';
+      } else if (options.count("shared-prefixes")) {
+        assert(!is_feedforward);
+        std::cout << trainer.ComputePerplexityWithPrefixTrie(ppl_data) << '\n';
+      } else if (options.count("sessions")) {
+        // see ParseCommandLine()
+        assert(!is_feedforward && word_wrapping_type == kVerbatim &&
+               !debug_no_sb);
+        const int batch_window = options.count("batch-window") ?
+                                 options["batch-window"].as<int>() : -1;
+        std::cout << trainer.ComputePerplexityWithSessions(
+                         ppl_data,
+                         batch_window,
+                         options.count("check-sessions") != 0) << '\n';
+      } else {
+        std::cout << trainer.ComputePerplexity(ppl_data) << '\n';
+      }
       exit(0);
     }
 
     // remaining positional arguments: lattices for rescoring
-    assert(positional.empty() == !options.count("lambda") &&
-           positional.empty() == !options.count("pruning-threshold"));
+    const bool has_grid = options.count("lambda-grid") ||
+                          options.count("lm-scale-grid");
+    assert(positional.empty() == !(options.count("lambda") ||
+                                   options.count("lambda-grid")) &&
+           positional.empty() == !(options.count("pruning-threshold") ||
+                                   options.count("nbest")));
+    if (!positional.empty() && options.count("nbest")) {
+      assert(!has_grid);
+      RescorerPointer rescorer(new NbestRescorer(
+          vocabulary,
+          net,
+          num_oovs,
+          options["lambda"].as<Real>(),
+          options["lm-scale"].as<Real>(),
+          options.count("log-linear") != 0,
+          num_threads));
+      rescorer->Rescore(positional);
+      exit(0);
+    }
     if (!positional.empty()) {
-      const Real lambda = options["lambda"].as<Real>();
-      assert(lambda >= 0. && lambda <= 1.);
+      const std::vector<Real> lambdas = options.count("lambda-grid") ?
+          ParseValues(options["lambda-grid"].as<std::string>()) :
+          std::vector<Real>(1, options["lambda"].as<Real>());
+      for (const Real lambda : lambdas)
+        assert(lambda >= 0. && lambda <= 1.);
 
       HtkLatticeRescorer::LookAheadSemiring semiring;
       const std::string name = options["look-ahead-semiring"].as<std::string>();
@@ -292,42 +499,102 @@ void EvaluateCommandLine(const po::variables_map &options) {
       else
         assert(false);
 
-      const Real lm_scale = options["lm-scale"].as<Real>(),
-                 look_ahead_lm_scale = options.count("look-ahead-lm-scale") ==
-                     0 ? lm_scale : options["look-ahead-lm-scale"].as<Real>(),
-                 beam = options["pruning-threshold"].as<Real>();
+      const std::vector<Real> lm_scales = options.count("lm-scale-grid") ?
+          ParseValues(options["lm-scale-grid"].as<std::string>()) :
+          std::vector<Real>(1, options["lm-scale"].as<Real>());
+      // the look-ahead LM scale follows the LM scale unless given
+      std::vector<HtkLatticeRescorer::Setting> settings;
+      for (const Real lambda : lambdas) {
+        for (const Real lm_scale : lm_scales) {
+          const HtkLatticeRescorer::Setting setting = {
+            lambda,
+            options.count("look-ahead-lm-scale") == 0 ?
+                lm_scale : options["look-ahead-lm-scale"].as<Real>(),
+            lm_scale
+          };
+          settings.push_back(setting);
+        }
+      }
+      const Real beam = options["pruning-threshold"].as<Real>();
       const size_t limit = options["pruning-limit"].as<size_t>();
+      // lattices in parallel must not depend on each other
+      assert(num_threads == 1 || (options.count("dependent") == 0 &&
+                                  options.count("persistent-cache") == 0));
+      // each setting would continue from its own previous lattice
+      assert(!has_grid || options.count("dependent") == 0);
       RescorerPointer rescorer(new HtkLatticeRescorer(
           vocabulary,
           net,
           output_format,
           num_oovs,
-          lambda,
           semiring,
-          look_ahead_lm_scale,
-		  lm_scale,
           beam == 0. ? std::numeric_limits<Real>::infinity() : beam,
           limit == 0 ? std::numeric_limits<size_t>::max() : limit,
           options["dp-order"].as<int>(),
           options.count("dependent") != 0,
+          options["cache-size"].as<size_t>(),
+          options.count("persistent-cache") != 0,
           options.count("clear-initial-links") != 0,
           options.count("set-sb-next-to-last") != 0,
-          options.count("set-sb-last") != 0));
+          options.count("set-sb-last") != 0,
+          options.count("lattice-cache") != 0,
+          settings,
+          num_threads));
       rescorer->Rescore(positional);
       exit(0);
     }
     
     DataPointer train_data;
     if (train_file != "") {
-      std::cout << "Reading training data from file '" << train_file <<
-                   "' ..." << std::endl;
-      train_data = std::make_shared<Data>(train_file,
-                                          max_batch_size,
-                                          max_sequence_length,
-                                          word_wrapping_type,
-                                          debug_no_sb,
-                                          vocabulary);
+      // feedforward training is serial, see Trainer::TrainEpoch()
+      assert(!is_feedforward || (num_threads == 1 && num_processes == 1));
+      const int shard_size = options["streaming"].as<int>();
+      assert(shard_size >= 0);
+      if (shard_size > 0) {
+        std::cout << "Streaming training data from file '" << train_file <<
+                     "' ..." << std::endl;
+        train_data = std::make_shared<Data>(train_file,
+                                            max_batch_size,
+                                            max_sequence_length,
+                                            word_wrapping_type,
+                                            debug_no_sb,
+                                            bucketing,
+                                            vocabulary,
+                                            shard_size,
+                                            options["prefetch"].as<int>());
+      } else {
+        std::cout << "Reading training data from file '" << train_file <<
+                     "' ..." << std::endl;
+        train_data = std::make_shared<Data>(train_file,
+                                            max_batch_size,
+                                            max_sequence_length,
+                                            word_wrapping_type,
+                                            debug_no_sb,
+                                            bucketing,
+                                            vocabulary);
+      }
+      ProcessGroupPointer process_group;
+      if (num_processes > 1) {
+        // the largest exchange: the weight updates of a single step
+        BufferVector buffers;
+        net->GetUpdateBuffers(&buffers);
+        size_t capacity = 0;
+        for (const auto &buffer : buffers)
+          capacity += buffer.second;
+        std::cout << "Attaching to shared memory as process " <<
+                     process_index << " of " << num_processes << " ..." <<
+                     std::endl;
+        process_group.reset(new ProcessGroup(
+            options["shared-memory"].as<std::string>(),
+            num_processes,
+            process_index,
+            capacity));
+      }
       Trainer trainer(max_epoch,
+                      num_threads,
+                      asynchronous,
+                      max_staleness,
+                      process_group.get(),
                       options.count("no-shuffling") == 0,
                       options.count("verbose") > 0,
                       is_feedforward,
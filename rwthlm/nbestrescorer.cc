@@ -0,0 +1,105 @@
+/*
+ * Copyright 2014 RWTH Aachen University. All rights reserved.
+ *
+ * Licensed under the RWTH LM License (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include "file.h"
+#include "nbestrescorer.h"
+
+RescorerPointer NbestRescorer::Clone(const NetPointer &net) const {
+  return RescorerPointer(new NbestRescorer(vocabulary_,
+                                           net,
+                                           num_oov_words_,
+                                           nn_lambda_,
+                                           lm_scale_,
+                                           is_log_linear_));
+}
+
+void NbestRescorer::Reset() {
+  hypotheses_.clear();
+  trie_.Clear();
+}
+
+void NbestRescorer::ReadLattice(const std::string &file_name) {
+  ReadableFile file(file_name);
+  std::string line;
+  size_t num_words = 0;
+  while (file.GetLine(&line)) {
+    std::istringstream stream(line);
+    Hypothesis hypothesis;
+    size_t size;
+    if (!(stream >> hypothesis.am_score >> hypothesis.lm_score >> size))
+      continue;  // empty line
+    // between sentence boundaries
+    words_.assign(1, vocabulary_->sb_index());
+    hypothesis.num_unknown_words = 0;
+    std::string word;
+    while (stream >> word) {
+      hypothesis.words.push_back(word);
+      words_.push_back(vocabulary_->GetIndex(word));
+      if (words_.back() == vocabulary_->unk_index())
+        ++hypothesis.num_unknown_words;
+    }
+    assert(hypothesis.words.size() == size);
+    words_.push_back(vocabulary_->sb_index());
+    hypothesis.node = trie_.AddSequence(words_.data(), words_.size());
+    num_words += size + 1;
+    hypotheses_.push_back(hypothesis);
+  }
+  assert(!hypotheses_.empty());
+  log_stream() << hypotheses_.size() << " hypotheses, " << num_words <<
+               " words, " << trie_.num_nodes() - 1 << " trie nodes" <<
+               std::endl;
+}
+
+void NbestRescorer::RescoreLattice() {
+  trie_.Evaluate(net_.get());
+  for (Hypothesis &hypothesis : hypotheses_) {
+    // as in HtkLatticeRescorer::RescoreLattice()
+    const Real nn_log_probability =
+        trie_.GetLogProbability(hypothesis.node) -
+        hypothesis.num_unknown_words * log(num_oov_words_ + 1.);
+    if (is_log_linear_) {
+      hypothesis.lm_score = (1. - nn_lambda_) * hypothesis.lm_score +
+          nn_lambda_ * nn_log_probability;
+    } else {
+      // log-add, sentence probabilities may underflow
+      const Real x = log(1. - nn_lambda_) + hypothesis.lm_score,
+                 y = log(nn_lambda_) + nn_log_probability;
+      hypothesis.lm_score = std::max(x, y) +
+          log1p(exp(std::min(x, y) - std::max(x, y)));
+    }
+  }
+  std::stable_sort(hypotheses_.begin(), hypotheses_.end(),
+      [this](const Hypothesis &hypothesis1, const Hypothesis &hypothesis2) {
+        return GetScore(hypothesis1) > GetScore(hypothesis2);
+      });
+  const Hypothesis &best = hypotheses_.front();
+  log_stream() << "best: " << std::setw(10) << std::fixed <<
+               std::setprecision(5) << GetScore(best) << '\n';
+  for (const std::string &word : best.words)
+    log_stream() << "\tW=" << word << '\n';
+  log_stream() << std::flush;
+}
+
+void NbestRescorer::WriteLattice(const std::string &file_name) {
+  WritableFile out_file(ExtendedFileName(file_name, ".rescored"));
+  for (const Hypothesis &hypothesis : hypotheses_) {
+    out_file << std::to_string(hypothesis.am_score) << ' ' <<
+                std::to_string(hypothesis.lm_score) << ' ' <<
+                hypothesis.words.size();
+    for (const std::string &word : hypothesis.words)
+      out_file << ' ' << word;
+    out_file << '\n';
+  }
+}
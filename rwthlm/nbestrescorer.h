@@ -0,0 +1,75 @@
+/*
+ * Copyright 2014 RWTH Aachen University. All rights reserved.
+ *
+ * Licensed under the RWTH LM License (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+#include <string>
+#include <vector>
+#include "fast.h"
+#include "prefixtrie.h"
+#include "rescorer.h"
+
+// Rescores n-best lists, one per file. Each line is a hypothesis
+// "am_score lm_score num_words word_1 ... word_n" with log scores (base e).
+// The hypotheses, each followed by <sb>, form a prefix trie whose nodes are
+// evaluated exactly once, see PrefixTrie. As for lattices, the new LM score
+// interpolates linearly in probability space, log((1 - lambda) * exp(lm_score)
+// + lambda * network probability), with the probability of <unk> shared among
+// num_oov_words + 1 words, but of whole sentences, since there are no LM
+// scores of words. With is_log_linear, it is (1 - lambda) * lm_score + lambda *
+// network log probability instead. The list is written to <file>.rescored,
+// best first by am_score + lm_scale * lm_score.
+class NbestRescorer : public Rescorer {
+public:
+  NbestRescorer(const ConstVocabularyPointer &vocabulary,
+                const NetPointer &net,
+                const int num_oov_words,
+                const Real nn_lambda,
+                const Real lm_scale,
+                const bool is_log_linear,
+                const int num_threads = 1)
+      : Rescorer(vocabulary, net, num_oov_words, nn_lambda, num_threads),
+        lm_scale_(lm_scale),
+        is_log_linear_(is_log_linear) {
+    assert(nn_lambda >= 0. && nn_lambda <= 1.);
+  }
+
+  ~NbestRescorer() {
+  }
+
+  virtual RescorerPointer Clone(const NetPointer &net) const;
+  virtual void ReadLattice(const std::string &file_name);
+  virtual void RescoreLattice();
+  virtual void WriteLattice(const std::string &file_name);
+  virtual std::string file_type() const {
+    return "n-best list";
+  }
+
+private:
+  struct Hypothesis {
+    Real am_score, lm_score;
+    // as read, including OOV words
+    std::vector<std::string> words;
+    // trie node of the final <sb>
+    int node, num_unknown_words;
+  };
+
+  virtual void Reset();
+  Real GetScore(const Hypothesis &hypothesis) const {
+    return hypothesis.am_score + lm_scale_ * hypothesis.lm_score;
+  }
+
+  const Real lm_scale_;
+  const bool is_log_linear_;
+  std::vector<Hypothesis> hypotheses_;
+  PrefixTrie trie_;
+  std::vector<int> words_;
+};
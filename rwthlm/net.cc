@@ -36,8 +36,9 @@ Net::Net(const ConstVocabularyPointer &vocabulary,
          const bool is_feedforward,
          const Real learning_rate,
          const Real momentum,
-         Random *random)
-    : Function(1, 0, max_batch_size, max_sequence_length),
+         Random *random,
+         const bool is_trainable)
+    : Function(1, 0, max_batch_size, max_sequence_length, is_trainable),
       num_oovs_(num_oovs),
       is_feedforward_(is_feedforward),
       vocabulary_(vocabulary),
@@ -48,28 +49,44 @@ Net::Net(const ConstVocabularyPointer &vocabulary,
       random_(random) {
 }
 
-const Real *Net::Evaluate(const Slice &slice, const Real x[]) {
-  for (FunctionPointer f : functions_)
-    x = f->Evaluate(slice, x);
+TableLookup *Net::GetTableLookup() const {
+  // the first layer is always a table lookup, see SetUpFunction()
+  return static_cast<TableLookup *>(functions_.front().get());
+}
+
+Layer *Net::GetLayer(const size_t i) const {
+  assert(i > 0);
+  return static_cast<Layer *>(functions_[i].get());
+}
+
+const Real *Net::Evaluate(const Slice &slice, const int words[]) {
+  const Real *x = GetTableLookup()->Evaluate(slice, words);
+  for (size_t i = 1; i < functions_.size(); ++i)
+    x = GetLayer(i)->Evaluate(slice, x);
   return x;
 }
 
 void Net::ComputeDelta(const Slice &slice, FunctionPointer f) {
+  assert(is_trainable());
   for (FunctionPointer g : boost::adaptors::reverse(functions_)) {
     g->ComputeDelta(slice, f);
     f = g;
   }
 }
 
-const Real *Net::UpdateWeights(const Slice &slice, const Real x[]) {
-  return UpdateWeights(slice, learning_rate(), x);
+const Real *Net::UpdateWeights(const Slice &slice, const int words[]) {
+  return UpdateWeights(slice, learning_rate(), words);
 }
 
 const Real *Net::UpdateWeights(const Slice &slice,
                                const Real learning_rate,
-                               const Real x[]) {
-  for (FunctionPointer f : functions_)
-    x = f->UpdateWeights(slice, learning_rate, x);
+                               const int words[]) {
+  assert(is_trainable());
+  const Real *x = GetTableLookup()->UpdateWeights(slice,
+                                                  learning_rate,
+                                                  words);
+  for (size_t i = 1; i < functions_.size(); ++i)
+    x = GetLayer(i)->UpdateWeights(slice, learning_rate, x);
   return x;
 }
 
@@ -78,7 +95,6 @@ void Net::AddDelta(const Slice &slice, Real delta_t[]) {
 }
 
 void Net::Reset(const bool is_dependent) {
-  assert(!is_dependent || max_batch_size() == 1);
   for (FunctionPointer f : functions_)
     f->Reset(is_dependent);
 }
@@ -94,6 +110,27 @@ void Net::SetState(const State &state, const int i) {
     f->SetState(state, j++);
 }
 
+int Net::GetSequenceStateSize() const {
+  int size = 0;
+  for (FunctionPointer f : functions_)
+    size += f->GetSequenceStateSize();
+  return size;
+}
+
+void Net::ExtractSequenceState(const int j, Real state[]) const {
+  for (FunctionPointer f : functions_) {
+    f->ExtractSequenceState(j, state);
+    state += f->GetSequenceStateSize();
+  }
+}
+
+void Net::SetSequenceState(const Real state[], const int j) {
+  for (FunctionPointer f : functions_) {
+    f->SetSequenceState(state, j);
+    state += f->GetSequenceStateSize();
+  }
+}
+
 void Net::RandomizeWeights(Random *random) {
   for (FunctionPointer f : functions_)
     f->RandomizeWeights(random);
@@ -121,7 +158,7 @@ void Net::Write(std::ofstream *output_stream) {
     f->Write(output_stream);
 }
 
-Real Net::ComputeLogProbability(const std::vector<int> &slice,
+Real Net::ComputeLogProbability(const Slice &slice,
                                 const Real x[],
                                 const bool verbose,
                                 ProbabilitySequenceVector *probabilities) {
@@ -131,6 +168,46 @@ Real Net::ComputeLogProbability(const std::vector<int> &slice,
                                                   probabilities);
 }
 
+void Net::ShareWeights(const Function &f,
+                       const bool share_sparse_updates) {
+  const Net &net = dynamic_cast<const Net &>(f);
+  assert(functions_.size() == net.functions_.size());
+  set_shares_weights(true);
+  for (size_t i = 0; i < functions_.size(); ++i)
+    functions_[i]->ShareWeights(*net.functions_[i], share_sparse_updates);
+}
+
+NetPointer Net::Replicate(const bool share_sparse_updates) const {
+  NetPointer net(new Net(vocabulary_,
+                         max_batch_size(),
+                         max_sequence_length(),
+                         num_oovs_,
+                         is_feedforward_,
+                         learning_rate_,
+                         momentum_,
+                         random_));
+  net->BuildNetworkLayers(net_config_, use_bias_);
+  net->ShareWeights(*this, share_sparse_updates);
+  return net;
+}
+
+NetPointer Net::CloneForEvaluation(const int max_batch_size,
+                                   const int max_sequence_length) const {
+  assert(!shares_weights());
+  NetPointer net(new Net(vocabulary_,
+                         max_batch_size,
+                         max_sequence_length,
+                         num_oovs_,
+                         is_feedforward_,
+                         learning_rate_,
+                         momentum_,
+                         random_,
+                         false));
+  net->BuildNetworkLayers(net_config_, use_bias_);
+  net->ShareWeights(*this, false);
+  return net;
+}
+
 ActivationFunctionPointer Net::SetUpActivationFunction(const char type) const {
   ActivationFunctionPointer f;
   switch (type) {
@@ -190,6 +267,7 @@ FunctionPointer Net::SetUpFunction(const char type,
                                           type == 'r' || type == 'R',
                                           use_bias,
                                           is_feedforward_,
+                                          is_trainable(),
                                           std::move(g));
     } else {
         f = std::make_shared<Linear>(output_dimension(),
@@ -198,6 +276,7 @@ FunctionPointer Net::SetUpFunction(const char type,
                                      max_sequence_length(),
                                      type == 'r' || type == 'R',
                                      use_bias,
+                                     is_trainable(),
                                      std::move(g));
     }
     break;
@@ -208,7 +287,8 @@ FunctionPointer Net::SetUpFunction(const char type,
                                dimension,
                                max_batch_size(),
                                max_sequence_length(),
-                               use_bias);
+                               use_bias,
+                               is_trainable());
     break;
   case 'x':
     f = std::make_shared<Output>(output_dimension(),
@@ -216,6 +296,7 @@ FunctionPointer Net::SetUpFunction(const char type,
                                  max_sequence_length(),
                                  num_oovs_,
                                  use_bias,
+                                 is_trainable(),
                                  vocabulary_,
                                  std::move(g));
     break;
@@ -227,6 +308,8 @@ FunctionPointer Net::SetUpFunction(const char type,
 
 void Net::BuildNetworkLayers(const std::string &net_config,
                              const bool use_bias) {
+  net_config_ = net_config;
+  use_bias_ = use_bias;
   std::vector<std::string> tokens;
   boost::split(tokens, net_config, boost::algorithm::is_any_of("-"));
   // first token is arbitrary name
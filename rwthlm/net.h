@@ -22,6 +22,10 @@
 #include "function.h"
 #include "output.h"
 
+class Net;
+typedef std::unique_ptr<Net> NetPointer;
+class TableLookup;
+
 class Net : public Function {
 public:
   Net(const ConstVocabularyPointer &vocabulary,
@@ -31,20 +35,22 @@ public:
       const bool is_feedforward,
       const Real learning_rate,
       const Real momentum,
-      Random *random);
+      Random *random,
+      const bool is_trainable = true);
 
   virtual ~Net() {
   }
 
-  virtual const Real *Evaluate(const Slice &slice, const Real x[]);
+  // words: the previous word of each sequence of the slice
+  const Real *Evaluate(const Slice &slice, const int words[]);
 
   virtual void ComputeDelta(const Slice &slice, FunctionPointer f);
 
-  virtual const Real *UpdateWeights(const Slice &slice, const Real x[]);
+  const Real *UpdateWeights(const Slice &slice, const int words[]);
 
-  virtual const Real *UpdateWeights(const Slice &slice,
-                                    const Real learning_rate,
-                                    const Real x[]);
+  const Real *UpdateWeights(const Slice &slice,
+                            const Real learning_rate,
+                            const int words[]);
 
   void UpdateMomentumWeights() {
     UpdateMomentumWeights(momentum());
@@ -73,6 +79,12 @@ public:
 
   virtual void SetState(const State &state, const int i = 0);
 
+  virtual int GetSequenceStateSize() const;
+
+  virtual void ExtractSequenceState(const int j, Real state[]) const;
+
+  virtual void SetSequenceState(const Real state[], const int j);
+
   virtual void RandomizeWeights(Random *random);
 
   virtual Real ComputeLogProbability(
@@ -85,6 +97,31 @@ public:
 
   virtual void Write(std::ofstream *output_stream);
 
+  virtual void ShareWeights(const Function &f,
+                            const bool share_sparse_updates);
+
+  virtual void GetUpdateBuffers(BufferVector *buffers) {
+    for (auto &f : functions_)
+      f->GetUpdateBuffers(buffers);
+  }
+
+  // Creates a network of the same topology that shares the weights of this
+  // network, but has its own activations (for data-parallel training). With
+  // share_sparse_updates, sparse updates go to the shared weights directly.
+  NetPointer Replicate(const bool share_sparse_updates) const;
+
+  // Creates a network of the same topology that reads the weights of this
+  // network and owns nothing but its activations, i.e., the state of one
+  // stream of evaluation. Such clones are cheap, and any number of them can
+  // evaluate concurrently as long as the weights do not change.
+  NetPointer CloneForEvaluation() const {
+    return CloneForEvaluation(max_batch_size(), max_sequence_length());
+  }
+
+  // the same with activations for other batch and sequence sizes
+  NetPointer CloneForEvaluation(const int max_batch_size,
+                                const int max_sequence_length) const;
+
   void Read(const std::string &file_name);
 
   void Write(const std::string &file_name);
@@ -148,6 +185,11 @@ public:
 private:
   friend class GradientTest;
 
+  TableLookup *GetTableLookup() const;
+
+  // i > 0: the layers above the table lookup
+  Layer *GetLayer(const size_t i) const;
+
   ActivationFunctionPointer SetUpActivationFunction(const char type) const;
 
   FunctionPointer SetUpFunction(const char type,
@@ -160,12 +202,12 @@ private:
                           const bool use_bias);
 
   const bool is_feedforward_;
+  bool use_bias_;
   const int num_oovs_;
+  std::string net_config_;
   int epoch_;
   Real learning_rate_, momentum_, best_perplexity_;
   std::vector<FunctionPointer> functions_;
   Random *random_;
   const ConstVocabularyPointer &vocabulary_;
 };
-
-typedef std::unique_ptr<Net> NetPointer;
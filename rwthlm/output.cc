@@ -21,14 +21,24 @@ Output::Output(const int input_dimension,
                const int max_sequence_length,
                const int num_oovs,
                const bool use_bias,
+               const bool is_trainable,
                ConstVocabularyPointer vocabulary,
                ActivationFunctionPointer activation_function)
-    : Function(
+    : Layer(
           input_dimension,
           vocabulary->GetVocabularySize() + vocabulary->GetNumClasses() -
               vocabulary->ComputeShortlistSize(),
           max_batch_size,
-          max_sequence_length),
+          max_sequence_length,
+          is_trainable),
+      class_delta_(nullptr),
+      class_weights_(nullptr),
+      class_bias_(nullptr),
+      word_delta_(nullptr),
+      word_weights_(nullptr),
+      word_bias_(nullptr),
+      momentum_class_weights_(nullptr),
+      momentum_class_bias_(nullptr),
       activation_function_(std::move(activation_function)),
       num_classes_(vocabulary->GetNumClasses()),
       max_class_size_(vocabulary->GetMaxClassSize()),
@@ -39,17 +49,22 @@ Output::Output(const int input_dimension,
       vocabulary_(vocabulary) {
   class_b_ = FastMalloc((num_classes_ + max_class_size_) * max_batch_size *
                         max_sequence_length);
-  class_delta_ = FastMalloc((num_classes_ + max_class_size_) * max_batch_size *
-                            max_sequence_length);
-  class_weights_ = FastMalloc(num_classes_ * input_dimension);
-  class_bias_ = use_bias ? FastMalloc(num_classes_) : nullptr;
-  momentum_class_weights_ = FastMalloc(num_classes_ * input_dimension);
-  momentum_class_bias_ = use_bias ? FastMalloc(num_classes_) : nullptr;
-
   word_b_ = class_b_ + num_classes_ * max_batch_size;
-  word_delta_ = class_delta_ + num_classes_ * max_batch_size;
-  word_weights_ = FastMalloc(num_out_of_shortlist_words_ * input_dimension);
-  word_bias_ = use_bias ? FastMalloc(num_out_of_shortlist_words_) : nullptr;
+  if (is_trainable) {
+    class_delta_ = FastMalloc((num_classes_ + max_class_size_) *
+                              max_batch_size * max_sequence_length);
+    class_weights_ = FastMalloc(num_classes_ * input_dimension);
+    class_bias_ = use_bias ? FastMalloc(num_classes_) : nullptr;
+    momentum_class_weights_ = FastMalloc(num_classes_ * input_dimension);
+    momentum_class_bias_ = use_bias ? FastMalloc(num_classes_) : nullptr;
+
+    word_delta_ = class_delta_ + num_classes_ * max_batch_size;
+    word_weights_ = FastMalloc(num_out_of_shortlist_words_ * input_dimension);
+    word_bias_ = use_bias ? FastMalloc(num_out_of_shortlist_words_) : nullptr;
+  }
+  // sparse updates are applied to the word weights directly
+  word_weight_updates_ = word_weights_;
+  word_bias_updates_ = word_bias_;
 
   int sum = 0;
   for (int i = 0; i < num_classes_; ++i) {
@@ -64,10 +79,15 @@ Output::Output(const int input_dimension,
 Output::~Output() {
   FastFree(class_b_);
   FastFree(class_delta_);
-  FastFree(class_weights_);
-  FastFree(class_bias_);
-  FastFree(word_weights_);
-  FastFree(word_bias_);
+  if (!shares_weights()) {
+    FastFree(class_weights_);
+    FastFree(class_bias_);
+  }
+  // word weight updates go to the own weights unless weights are shared
+  if (word_weight_updates_ != word_weights_ || !shares_weights()) {
+    FastFree(word_weight_updates_);
+    FastFree(word_bias_updates_);
+  }
   FastFree(momentum_class_weights_);
   FastFree(momentum_class_bias_);
 }
@@ -209,7 +229,7 @@ const Real *Output::UpdateWeights(const Slice &slice,
       FastMultiplyByConstantAdd(-learning_rate,
                                 word_delta_t_ + i * max_class_size_,
                                 class_size,
-                                word_bias_ + word_offset_[clazz]);
+                                word_bias_updates_ + word_offset_[clazz]);
     }
     FastOuterProduct(
         -learning_rate,
@@ -217,7 +237,7 @@ const Real *Output::UpdateWeights(const Slice &slice,
         class_size,
         x + i * input_dimension(),
         input_dimension(),
-        word_weights_ + word_offset_[clazz] * input_dimension());
+        word_weight_updates_ + word_offset_[clazz] * input_dimension());
   }
   word_b_t_ += GetOffset();
   return result;
@@ -246,7 +266,57 @@ void Output::UpdateMomentumWeights(const Real momentum) {
 
 void Output::ResetMomentum() {
   FastZero(num_classes_ * input_dimension(), momentum_class_weights_);
-  FastZero(num_classes_, momentum_class_bias_);
+  if (momentum_class_bias_)
+    FastZero(num_classes_, momentum_class_bias_);
+}
+
+void Output::ShareWeights(const Function &f,
+                          const bool share_sparse_updates) {
+  const Output &output = dynamic_cast<const Output &>(f);
+  assert(!shares_weights() && !output.shares_weights());
+  assert(input_dimension() == output.input_dimension() &&
+         num_classes_ == output.num_classes_ &&
+         num_out_of_shortlist_words_ == output.num_out_of_shortlist_words_);
+  set_shares_weights(true);
+  FastFree(class_weights_);
+  FastFree(class_bias_);
+  class_weights_ = output.class_weights_;
+  class_bias_ = output.class_bias_;
+  word_weights_ = output.word_weights_;
+  word_bias_ = output.word_bias_;
+  // there are no updates without training
+  if (!is_trainable())
+    return;
+  if (share_sparse_updates) {
+    FastFree(word_weight_updates_);
+    FastFree(word_bias_updates_);
+    word_weight_updates_ = word_weights_;
+    word_bias_updates_ = word_bias_;
+  } else {
+    // own word weights are kept for collecting the updates
+    FastZero(num_out_of_shortlist_words_ * input_dimension(),
+             word_weight_updates_);
+    if (word_bias_updates_)
+      FastZero(num_out_of_shortlist_words_, word_bias_updates_);
+  }
+  ResetMomentum();
+}
+
+void Output::GetUpdateBuffers(BufferVector *buffers) {
+  buffers->push_back(std::make_pair(momentum_class_weights_,
+                                    num_classes_ * input_dimension()));
+  if (momentum_class_bias_)
+    buffers->push_back(std::make_pair(momentum_class_bias_, num_classes_));
+  // sparse updates already applied to the shared weights
+  if (word_weight_updates_ == word_weights_ && shares_weights())
+    return;
+  buffers->push_back(std::make_pair(
+      word_weight_updates_,
+      num_out_of_shortlist_words_ * input_dimension()));
+  if (word_bias_updates_) {
+    buffers->push_back(std::make_pair(word_bias_updates_,
+                                      num_out_of_shortlist_words_));
+  }
 }
 
 void Output::Reset(const bool is_dependent) {
@@ -257,8 +327,10 @@ void Output::Reset(const bool is_dependent) {
 
   FastZero((num_classes_ + max_class_size_) * max_batch_size() *
            max_sequence_length(), class_b_);
-  FastZero((num_classes_ + max_class_size_) * max_batch_size() *
-           max_sequence_length(), class_delta_);
+  if (class_delta_) {
+    FastZero((num_classes_ + max_class_size_) * max_batch_size() *
+             max_sequence_length(), class_delta_);
+  }
 }
 
 void Output::RandomizeWeights(Random *random) {
@@ -348,8 +420,7 @@ Real Output::ComputeLogProbability(const Slice &slice,
       const double z = std::accumulate(x + num_classes_ * i, x + num_classes_ * (i + 1), 0.);
       assert(z > 0.99999 && z < 1.00001);
 */
-      if (vocabulary_->HasUnk() &&
-          slice[i] == vocabulary_->GetIndex(vocabulary_->unk()))
+      if (slice[i] == vocabulary_->unk_index())
         probability /= num_oovs_ + 1.;  // <unk> may represent multiple words
       log_probability += log(probability);
       if (class_size > 1) {
@@ -16,13 +16,14 @@
 #include "random.h"
 #include "vocabulary.h"
 
-class Output : public Function {
+class Output : public Layer {
 public:
   Output(const int input_dimension,
          const int max_batch_size,
          const int max_sequence_length,
          const int num_oovs,
          const bool use_bias,
+         const bool is_trainable,
          ConstVocabularyPointer vocabulary,
          ActivationFunctionPointer activation_function);
 
@@ -50,12 +51,27 @@ public:
   virtual void SetState(const State &state, const int i = 0) {
   }
 
+  virtual int GetSequenceStateSize() const {
+    return 0;
+  }
+
+  virtual void ExtractSequenceState(const int j, Real state[]) const {
+  }
+
+  virtual void SetSequenceState(const Real state[], const int j) {
+  }
+
   virtual void RandomizeWeights(Random *random);
 
   virtual void Read(std::ifstream *input_stream);
 
   virtual void Write(std::ofstream *output_stream);
 
+  virtual void ShareWeights(const Function &f,
+                            const bool share_sparse_updates);
+
+  virtual void GetUpdateBuffers(BufferVector *buffers);
+
   virtual int GetOffset() {
     return (num_classes_ + max_class_size_) * max_batch_size();
   }
@@ -86,6 +102,8 @@ private:
        *word_delta_t_,
        *word_weights_,
        *word_bias_,
+       *word_weight_updates_,
+       *word_bias_updates_,
        *momentum_class_weights_,
        *momentum_class_bias_;
 
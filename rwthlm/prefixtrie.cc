@@ -0,0 +1,102 @@
+/*
+ * Copyright 2014 RWTH Aachen University. All rights reserved.
+ *
+ * Licensed under the RWTH LM License (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <algorithm>
+#include "prefixtrie.h"
+
+void PrefixTrie::Clear() {
+  nodes_.clear();
+  child_by_word_.clear();
+  levels_.clear();
+  // the root stands for the zero state, without word
+  Node root;
+  root.parent = -1;
+  root.word = -1;
+  root.depth = 0;
+  root.index = 0;
+  root.probability = 1.;
+  nodes_.push_back(root);
+  levels_.push_back(std::vector<int>(1, 0));
+}
+
+int PrefixTrie::AddSequence(const int words[], const int length) {
+  assert(length > 0);
+  int node = 0;
+  for (int i = 0; i < length; ++i)
+    node = GetChild(node, words[i]);
+  return node;
+}
+
+int PrefixTrie::GetChild(const int parent, const int word) {
+  const auto result = child_by_word_.insert(std::make_pair(
+      std::make_pair(parent, word), static_cast<int>(nodes_.size())));
+  if (!result.second)
+    return result.first->second;
+  Node node;
+  node.parent = parent;
+  node.word = word;
+  node.depth = nodes_[parent].depth + 1;
+  if (levels_.size() == node.depth)
+    levels_.push_back(std::vector<int>());
+  node.index = levels_[node.depth].size();
+  node.probability = 1.;
+  levels_[node.depth].push_back(nodes_.size());
+  nodes_.push_back(node);
+  return nodes_.size() - 1;
+}
+
+void PrefixTrie::Evaluate(Net *net) {
+  if (levels_.size() < 2)
+    return;
+  const int state_size = net->GetSequenceStateSize();
+  const size_t max_batch_size = net->max_batch_size();
+  // states after the nodes of the previous level, by index: the first words
+  // start from the zero state
+  std::vector<Real> states(levels_[1].size() * state_size), next_states;
+  net->Reset(false);
+  net->ResetHistories();
+  net->ExtractSequenceState(0, states.data());
+  for (size_t i = 1; i < levels_[1].size(); ++i) {
+    std::copy(states.begin(), states.begin() + state_size,
+              states.begin() + i * state_size);
+  }
+  for (size_t depth = 2; depth < levels_.size(); ++depth) {
+    const std::vector<int> &level = levels_[depth];
+    next_states.resize(level.size() * state_size);
+    for (size_t begin = 0; begin < level.size(); begin += max_batch_size) {
+      const size_t size = std::min(level.size() - begin, max_batch_size);
+      // each sequence of the batch continues the state of its parent
+      net->Reset(true);
+      net->ResetHistories();
+      batch_words_.resize(size);
+      batch_targets_.resize(size);
+      for (size_t j = 0; j < size; ++j) {
+        const Node &node = nodes_[level[begin + j]],
+                   &parent = nodes_[node.parent];
+        net->SetSequenceState(&states[parent.index * state_size], j);
+        batch_words_[j] = parent.word;
+        batch_targets_[j] = node.word;
+      }
+      const Slice slice(batch_targets_.data(), size);
+      const Real *y = net->Evaluate(slice, batch_words_.data());
+      batch_probabilities_.assign(size, ProbabilitySequence());
+      net->ComputeLogProbability(slice, y, false, &batch_probabilities_);
+      net->Reset(true);
+      for (size_t j = 0; j < size; ++j) {
+        nodes_[level[begin + j]].probability =
+            batch_probabilities_[j].front();
+        net->ExtractSequenceState(j, &next_states[(begin + j) * state_size]);
+      }
+    }
+    states.swap(next_states);
+  }
+}
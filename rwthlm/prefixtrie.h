@@ -0,0 +1,94 @@
+/*
+ * Copyright 2014 RWTH Aachen University. All rights reserved.
+ *
+ * Licensed under the RWTH LM License (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+#include <cassert>
+#include <cmath>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <boost/functional/hash.hpp>
+#include "fast.h"
+#include "function.h"
+#include "net.h"
+
+// Word sequences sharing prefixes (e.g., n-best lists or candidates after the
+// same context), evaluated once per distinct prefix: the nodes of the trie
+// are evaluated level by level in batches, each sequence of a batch
+// continuing from the state after the parent node. As in a sequence of Data,
+// the first word of a sequence is only the history of the first prediction
+// (e.g., <sb>) and starts from the zero state.
+class PrefixTrie {
+public:
+  PrefixTrie() {
+    Clear();
+  }
+
+  void Clear();
+
+  // the node of the last word
+  int AddSequence(const int words[], const int length);
+
+  // A sequence length of 3 suffices for net, see Net::Reset(true).
+  void Evaluate(Net *net);
+
+  int GetParent(const int node) const {
+    return nodes_[node].parent;
+  }
+
+  int GetWord(const int node) const {
+    return nodes_[node].word;
+  }
+
+  // the first word of a sequence is not predicted
+  bool IsFirstWord(const int node) const {
+    return nodes_[node].depth == 1;
+  }
+
+  // of the word of the node after its history, see Evaluate()
+  Real GetProbability(const int node) const {
+    return nodes_[node].probability;
+  }
+
+  // of the words up to the node after the first word
+  Real GetLogProbability(int node) const {
+    Real log_probability = 0.;
+    for (; !IsFirstWord(node); node = GetParent(node))
+      log_probability += log(GetProbability(node));
+    return log_probability;
+  }
+
+  // number of distinct prefixes
+  size_t num_nodes() const {
+    return nodes_.size() - 1;
+  }
+
+private:
+  struct Node {
+    int parent, word;
+    // the root has depth 0, index: position within the nodes of the depth
+    size_t depth, index;
+    Real probability;
+  };
+
+  // the child of parent for word, added if missing
+  int GetChild(const int parent, const int word);
+
+  std::vector<Node> nodes_;
+  std::unordered_map<std::pair<int, int>,
+                     int,
+                     boost::hash<std::pair<int, int>>> child_by_word_;
+  // node IDs by depth
+  std::vector<std::vector<int>> levels_;
+  std::vector<int> batch_words_, batch_targets_;
+  ProbabilitySequenceVector batch_probabilities_;
+};
@@ -0,0 +1,216 @@
+/*
+ * Copyright 2014 RWTH Aachen University. All rights reserved.
+ *
+ * Licensed under the RWTH LM License (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <thread>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "fast.h"
+#include "processgroup.h"
+
+// Written by the coordinator before it sets ready. The ID of the coordinator
+// process identifies the run: A segment whose coordinator no longer exists is
+// left over from a run that crashed during start-up.
+struct ProcessGroup::Header {
+  static const int kReady = 0x72776c6d;
+  pthread_barrier_t barrier;
+  std::atomic<int> ready;
+  pid_t coordinator;
+  int num_processes;
+  size_t capacity;
+};
+
+namespace {
+
+// the values start at a page boundary
+const size_t kHeaderSize = 4096;
+
+void Wait() {
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+}
+
+bool IsAlive(const pid_t process) {
+  return kill(process, 0) == 0 || errno == EPERM;
+}
+
+// whether fd still is the segment of that name, i.e., it has not been
+// replaced by a new coordinator in the meantime
+bool IsCurrent(const std::string &name, const int fd) {
+  const int current_fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (current_fd < 0)
+    return false;
+  struct stat status, current_status;
+  const bool is_current = fstat(fd, &status) == 0 &&
+                          fstat(current_fd, &current_status) == 0 &&
+                          status.st_ino == current_status.st_ino;
+  close(current_fd);
+  return is_current;
+}
+
+}  // namespace
+
+ProcessGroup::ProcessGroup(const std::string &name,
+                           const int num_processes,
+                           const int index,
+                           const size_t capacity)
+    : name_(name),
+      num_processes_(num_processes),
+      index_(index),
+      capacity_(capacity),
+      size_(kHeaderSize + (num_processes + 1) * capacity * sizeof(Real)) {
+  static_assert(sizeof(Header) <= kHeaderSize, "header too large");
+  assert(num_processes > 1 && index >= 0 && index < num_processes);
+  const int fd = is_coordinator() ? Create() : Attach();
+  void *address = mmap(nullptr,
+                       size_,
+                       PROT_READ | PROT_WRITE,
+                       MAP_SHARED,
+                       fd,
+                       0);
+  assert(address != MAP_FAILED);
+  close(fd);
+  header_ = reinterpret_cast<Header *>(address);
+  values_ = reinterpret_cast<Real *>(static_cast<char *>(address) +
+                                     kHeaderSize);
+
+  if (is_coordinator()) {
+    pthread_barrierattr_t attributes;
+    pthread_barrierattr_init(&attributes);
+    pthread_barrierattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    const int result = pthread_barrier_init(&header_->barrier,
+                                            &attributes,
+                                            num_processes_);
+    assert(result == 0);
+    pthread_barrierattr_destroy(&attributes);
+    header_->ready.store(Header::kReady, std::memory_order_release);
+  }
+
+  // once all processes are attached, the name is no longer needed
+  Barrier();
+  if (is_coordinator())
+    shm_unlink(name_.c_str());
+}
+
+int ProcessGroup::Create() {
+  // remove the segment of a previous training that did not terminate
+  shm_unlink(name_.c_str());
+  const int fd = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  assert(fd >= 0);
+  const int result = ftruncate(fd, size_);
+  assert(result == 0);
+  // the header is complete before ready is set, see Attach()
+  void *address = mmap(nullptr, kHeaderSize, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, 0);
+  assert(address != MAP_FAILED);
+  Header *header = reinterpret_cast<Header *>(address);
+  header->coordinator = getpid();
+  header->num_processes = num_processes_;
+  header->capacity = capacity_;
+  munmap(address, kHeaderSize);
+  return fd;
+}
+
+int ProcessGroup::Attach() {
+  for (;;) {
+    // wait for the coordinator to create the segment and set its size
+    const int fd = shm_open(name_.c_str(), O_RDWR, 0);
+    struct stat status;
+    if (fd < 0 || fstat(fd, &status) != 0 ||
+        static_cast<size_t>(status.st_size) < kHeaderSize) {
+      if (fd >= 0)
+        close(fd);
+      Wait();
+      continue;
+    }
+    void *address = mmap(nullptr, kHeaderSize, PROT_READ, MAP_SHARED, fd, 0);
+    assert(address != MAP_FAILED);
+    const Header *header = reinterpret_cast<const Header *>(address);
+    bool is_ready;
+    while (!(is_ready = header->ready.load(std::memory_order_acquire) ==
+                        Header::kReady) && IsCurrent(name_, fd))
+      Wait();
+    if (is_ready && IsAlive(header->coordinator)) {
+      // all processes must have been started with the same network, instead
+      // of waiting for each other forever
+      assert(header->num_processes == num_processes_ &&
+             header->capacity == capacity_ &&
+             static_cast<size_t>(status.st_size) == size_);
+      munmap(address, kHeaderSize);
+      return fd;
+    }
+    // left over or replaced: wait for the segment of the coordinator
+    munmap(address, kHeaderSize);
+    close(fd);
+    Wait();
+  }
+}
+
+ProcessGroup::~ProcessGroup() {
+  munmap(header_, size_);
+}
+
+void ProcessGroup::Barrier() {
+  const int result = pthread_barrier_wait(&header_->barrier);
+  assert(result == 0 || result == PTHREAD_BARRIER_SERIAL_THREAD);
+}
+
+void ProcessGroup::AllReduce(const BufferVector &source,
+                             const BufferVector &destination) {
+  assert(source.size() == destination.size());
+  size_t size = 0;
+  for (size_t i = 0; i < source.size(); ++i) {
+    assert(source[i].second == destination[i].second);
+    size += source[i].second;
+  }
+  assert(size <= capacity_);
+
+  Real *values = slot(index_);
+  for (const auto &buffer : source) {
+    FastCopy(buffer.first, buffer.second, values);
+    FastZero(buffer.second, buffer.first);
+    values += buffer.second;
+  }
+  Barrier();
+
+  // each process sums up its share of the values
+  const size_t begin = size * index_ / num_processes_,
+               end = size * (index_ + 1) / num_processes_;
+  Real *result = slot(num_processes_) + begin;
+  FastCopy(slot(0) + begin, end - begin, result);
+  for (int i = 1; i < num_processes_; ++i)
+    FastAdd(slot(i) + begin, end - begin, result, result);
+  Barrier();
+
+  values = slot(num_processes_);
+  for (const auto &buffer : destination) {
+    FastAdd(values, buffer.second, buffer.first, buffer.first);
+    values += buffer.second;
+  }
+}
+
+void ProcessGroup::Broadcast(const int size, Real x[]) {
+  assert(static_cast<size_t>(size) <= capacity_);
+  // the result slot may still be read by a previous AllReduce()
+  Barrier();
+  if (is_coordinator())
+    FastCopy(x, size, slot(num_processes_));
+  Barrier();
+  if (!is_coordinator())
+    FastCopy(slot(num_processes_), size, x);
+}
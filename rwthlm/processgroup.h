@@ -0,0 +1,73 @@
+/*
+ * Copyright 2014 RWTH Aachen University. All rights reserved.
+ *
+ * Licensed under the RWTH LM License (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <string>
+#include "function.h"
+
+// A group of rwthlm processes on one host that communicate through a POSIX
+// shared memory segment. Process 0 creates the segment and coordinates the
+// training, the other processes attach to it.
+class ProcessGroup {
+public:
+  // capacity: maximum number of values exchanged in a single AllReduce()
+  ProcessGroup(const std::string &name,
+               const int num_processes,
+               const int index,
+               const size_t capacity);
+
+  virtual ~ProcessGroup();
+
+  int num_processes() const {
+    return num_processes_;
+  }
+
+  int index() const {
+    return index_;
+  }
+
+  bool is_coordinator() const {
+    return index_ == 0;
+  }
+
+  void Barrier();
+
+  // Adds the sum of the source buffers of all processes to the destination
+  // buffers (of identical sizes) and zeroes the source buffers. The sum is
+  // computed in process order, so all processes obtain bit-identical results.
+  void AllReduce(const BufferVector &source, const BufferVector &destination);
+
+  // Copies x of the coordinator to x of all other processes.
+  void Broadcast(const int size, Real x[]);
+
+private:
+  struct Header;
+
+  // the file descriptor of the segment, see Header
+  int Create();
+  int Attach();
+
+  Real *slot(const int index) {
+    return values_ + index * capacity_;
+  }
+
+  const std::string name_;
+  const int num_processes_, index_;
+  const size_t capacity_, size_;
+  Header *header_;
+  // one slot per process, plus one for the result
+  Real *values_;
+};
+
+typedef std::unique_ptr<ProcessGroup> ProcessGroupPointer;
@@ -20,20 +20,34 @@ Recurrency::Recurrency(const int output_dimension,
                        Real *&b,
                        Real *&b_t,
                        Real *&delta,
-                       Real *&delta_t)
-    : Function(0, output_dimension, max_batch_size, max_sequence_length),
+                       Real *&delta_t,
+                       const bool is_trainable)
+    : Function(0,
+               output_dimension,
+               max_batch_size,
+               max_sequence_length,
+               is_trainable),
       b_(b),
       b_t_(b_t),
       delta_(delta),
-      delta_t_(delta_t) {
-  recurrent_weights_ = FastMalloc(output_dimension * output_dimension);
-  momentum_recurrent_weights_ = FastMalloc(output_dimension *
-                                           output_dimension);
+      delta_t_(delta_t),
+      recurrent_weights_(nullptr),
+      momentum_recurrent_weights_(nullptr) {
+  if (is_trainable) {
+    recurrent_weights_ = FastMalloc(output_dimension * output_dimension);
+    momentum_recurrent_weights_ = FastMalloc(output_dimension *
+                                             output_dimension);
+  }
 }
 
 const Real *Recurrency::Evaluate(const Slice &slice, const Real x[]) {
   // b_{-1} = 0
   if (b_t_ != b_) {
+    // as well as for sentences starting now
+    const ResetMask mask(slice.resets(),
+                         slice.size(),
+                         output_dimension(),
+                         {b_t_ - GetOffset()});
     FastMatrixMatrixMultiply(1.0,
                              recurrent_weights_,
                              false,
@@ -50,6 +64,11 @@ const Real *Recurrency::Evaluate(const Slice &slice, const Real x[]) {
 void Recurrency::ComputeDelta(const Slice &slice, FunctionPointer f) {
   // delta_{T+1} = 0
   if (delta_t_ != delta_) {
+    // as well as for sentences starting at T+1
+    const ResetMask mask(slice.next_resets(),
+                         slice.size(),
+                         output_dimension(),
+                         {delta_t_ - GetOffset()});
     // batch_size_t >= batch_size_{t+1}, so delta_{t+1}_ must be filled with 0
     FastMatrixMatrixMultiply(1.0,
                              recurrent_weights_,
@@ -71,6 +90,10 @@ const Real *Recurrency::UpdateWeights(const Slice &slice,
                                       const Real x[]) {
   // b_{-1} = 0 
   if (b_t_ != b_) {
+    const ResetMask mask(slice.resets(),
+                         slice.size(),
+                         output_dimension(),
+                         {b_t_ - GetOffset()});
     FastMatrixMatrixMultiply(-learning_rate,
                              delta_t_,
                              false,
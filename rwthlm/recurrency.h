@@ -24,10 +24,12 @@ public:
              Real *&b,
              Real *&b_t,
              Real *&delta,
-             Real *&delta_t);
+             Real *&delta_t,
+             const bool is_trainable);
 
   virtual ~Recurrency() {
-    FastFree(recurrent_weights_);
+    if (!shares_weights())
+      FastFree(recurrent_weights_);
     FastFree(momentum_recurrent_weights_);
   }
 
@@ -66,12 +68,39 @@ public:
   virtual void SetState(const State &state, const int i = 0) {
   }
 
+  virtual int GetSequenceStateSize() const {
+    return 0;
+  }
+
+  virtual void ExtractSequenceState(const int j, Real state[]) const {
+  }
+
+  virtual void SetSequenceState(const Real state[], const int j) {
+  }
+
   virtual void Read(std::ifstream *input_stream);
 
   virtual void Write(std::ofstream *output_stream);
 
   virtual void RandomizeWeights(Random *random);
 
+  virtual void ShareWeights(const Function &f,
+                            const bool share_sparse_updates) {
+    const Recurrency &recurrency = dynamic_cast<const Recurrency &>(f);
+    assert(!shares_weights() && !recurrency.shares_weights());
+    assert(output_dimension() == recurrency.output_dimension());
+    set_shares_weights(true);
+    FastFree(recurrent_weights_);
+    recurrent_weights_ = recurrency.recurrent_weights_;
+    if (is_trainable())
+      ResetMomentum();
+  }
+
+  virtual void GetUpdateBuffers(BufferVector *buffers) {
+    buffers->push_back(std::make_pair(momentum_recurrent_weights_,
+                                      output_dimension() * output_dimension()));
+  }
+
 private:
   friend class GradientTest;
 
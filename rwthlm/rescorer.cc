@@ -0,0 +1,62 @@
+/*
+ * Copyright 2014 RWTH Aachen University. All rights reserved.
+ *
+ * Licensed under the RWTH LM License (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <sstream>
+#include <omp.h>
+#include "rescorer.h"
+
+void Rescorer::Rescore(const std::vector<std::string> &file_names) {
+  std::cout << "Rescoring ..." << std::endl;
+  if (num_threads_ == 1) {
+    for (auto &file_name : file_names)
+      RescoreFile(file_name);
+    return;
+  }
+
+  // the rescorers refer to their nets, which therefore must not move
+  if (nets_.empty()) {
+    nets_.resize(num_threads_);
+    for (int i = 0; i < num_threads_; ++i) {
+      nets_[i] = net_->CloneForEvaluation();
+      rescorers_.push_back(Clone(nets_[i]));
+    }
+  }
+  const size_t num_files = file_names.size();
+  std::vector<std::string> logs(num_files);
+  std::vector<bool> is_done(num_files, false);
+  size_t next_file = 0, next_log = 0;
+#pragma omp parallel num_threads(num_threads_)
+  {
+    Rescorer *rescorer = rescorers_[omp_get_thread_num()].get();
+    while (true) {
+      // each thread takes the next lattice
+      size_t i;
+#pragma omp critical(next_lattice)
+      i = next_file++;
+      if (i >= num_files)
+        break;
+      std::ostringstream log;
+      rescorer->log_stream_ = &log;
+      rescorer->RescoreFile(file_names[i]);
+      rescorer->log_stream_ = &std::cout;
+#pragma omp critical(print_log)
+      {
+        logs[i] = log.str();
+        is_done[i] = true;
+        for (; next_log < num_files && is_done[next_log]; ++next_log) {
+          std::cout << logs[next_log] << std::flush;
+          std::string().swap(logs[next_log]);
+        }
+      }
+    }
+  }
+}
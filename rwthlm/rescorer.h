@@ -12,6 +12,7 @@
  */
 #pragma once
 #include <cassert>
+#include <iostream>
 #include <memory>
 #include <regex>
 #include <set>
@@ -20,38 +21,61 @@
 #include <boost/filesystem.hpp>
 #include "net.h"
 
+class Rescorer;
+typedef std::unique_ptr<Rescorer> RescorerPointer;
+
 class Rescorer {
 public:
+  // With num_threads > 1, independent lattices are rescored in parallel, see
+  // Rescore().
   Rescorer(const ConstVocabularyPointer &vocabulary,
            const NetPointer &net,
            const int num_oov_words,
-           const Real nn_lambda)
+           const Real nn_lambda,
+           const int num_threads = 1)
       : vocabulary_(vocabulary),
         net_(net),
         nn_lambda_(nn_lambda),
-        num_oov_words_(num_oov_words) {
+        num_oov_words_(num_oov_words),
+        num_threads_(num_threads),
+        log_stream_(&std::cout) {
+    assert(num_threads >= 1);
   }
 
   virtual ~Rescorer() {
   }
 
-  void Rescore(const std::vector<std::string> &file_names) {
-    std::cout << "Rescoring ..." << std::endl;
-    for (auto &file_name : file_names) {
-      std::cout << "lattice '" << file_name << "' ..." << std::endl;
-      Reset();
-      ReadLattice(file_name);
-      RescoreLattice();
-      WriteLattice(file_name);
-    }
-  }
+  // In parallel, each thread reads, rescores and writes whole lattices with
+  // its own copy of the rescorer, see Clone(). The log of a lattice is printed
+  // as soon as the logs of all lattices before it are, so that it looks the
+  // same as without threads.
+  void Rescore(const std::vector<std::string> &file_names);
 
 protected:
+  // a rescorer with the same settings that evaluates with net instead and
+  // rescores lattices one by one
+  virtual RescorerPointer Clone(const NetPointer &net) const = 0;
+
   virtual void Reset() = 0;
   virtual void ReadLattice(const std::string &file_name) = 0;
   virtual void RescoreLattice() = 0;
   virtual void WriteLattice(const std::string &file_name) = 0;
 
+  // A lattice read once is rescored and written for each of num_settings()
+  // settings, e.g., interpolation weights, see SelectSetting().
+  virtual int num_settings() const {
+    return 1;
+  }
+
+  // prepares the lattice read for rescoring with setting i
+  virtual void SelectSetting(const int i) {
+  }
+
+  // what a file to rescore contains, for the log
+  virtual std::string file_type() const {
+    return "lattice";
+  }
+
   static std::string ExtendedFileName(const std::string &file_name,
                                       const std::string &extension) {
     const bool ends_with_gz = boost::algorithm::ends_with(file_name, ".gz");
@@ -67,10 +91,30 @@ protected:
                          file_name.size() - (ends_with_gz ? 3 : 0)).rfind('.'));
   }
 
-  const Real nn_lambda_;
-  const int num_oov_words_;
+  std::ostream &log_stream() {
+    return *log_stream_;
+  }
+
+  // of the current setting
+  Real nn_lambda_;
+  const int num_oov_words_, num_threads_;
   const ConstVocabularyPointer &vocabulary_;
   const NetPointer &net_;
-};
 
-typedef std::unique_ptr<Rescorer> RescorerPointer;
+private:
+  void RescoreFile(const std::string &file_name) {
+    log_stream() << file_type() << " '" << file_name << "' ..." << std::endl;
+    Reset();
+    ReadLattice(file_name);
+    for (int i = 0; i < num_settings(); ++i) {
+      SelectSetting(i);
+      RescoreLattice();
+      WriteLattice(file_name);
+    }
+  }
+
+  std::ostream *log_stream_;
+  // one per thread
+  std::vector<NetPointer> nets_;
+  std::vector<RescorerPointer> rescorers_;
+};
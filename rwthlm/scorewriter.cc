@@ -0,0 +1,65 @@
+/*
+ * Copyright 2014 RWTH Aachen University. All rights reserved.
+ *
+ * Licensed under the RWTH LM License (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <cassert>
+#include <cstdio>
+#include "scorewriter.h"
+
+ScoreWriter::ScoreWriter(const std::string &file_name,
+                         const Format format,
+                         const bool has_token_scores)
+    : file_(file_name),
+      format_(format),
+      has_token_scores_(has_token_scores) {
+  buffer_.reserve(kBufferSize);
+  if (format_ == kBinary) {
+    const int32_t flags = has_token_scores_ ? 1 : 0;
+    Append("RWTHLMS1", 8);
+    Append(&flags, sizeof(flags));
+  }
+}
+
+void ScoreWriter::AppendNumber(const double x) {
+  char text[32];
+  const int length = snprintf(text, sizeof(text), "%.5f", x);
+  assert(length > 0 && length < static_cast<int>(sizeof(text)));
+  Append(text, length);
+}
+
+void ScoreWriter::Write(const int64_t sentence,
+                        const Real log_probabilities[],
+                        const int num_tokens) {
+  double total = 0.;
+  for (int i = 0; i < num_tokens; ++i)
+    total += log_probabilities[i];
+  if (format_ == kBinary) {
+    const int32_t n = num_tokens;
+    Append(&sentence, sizeof(sentence));
+    Append(&n, sizeof(n));
+    Append(&total, sizeof(total));
+    for (int i = 0; has_token_scores_ && i < num_tokens; ++i) {
+      const double x = log_probabilities[i];
+      Append(&x, sizeof(x));
+    }
+    return;
+  }
+  char text[48];
+  const int length = snprintf(text, sizeof(text), "%lld\t%d\t",
+                              static_cast<long long>(sentence), num_tokens);
+  Append(text, length);
+  AppendNumber(total);
+  for (int i = 0; has_token_scores_ && i < num_tokens; ++i) {
+    Append(i == 0 ? "\t" : " ", 1);
+    AppendNumber(log_probabilities[i]);
+  }
+  Append("\n", 1);
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright 2014 RWTH Aachen University. All rights reserved.
+ *
+ * Licensed under the RWTH LM License (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "fast.h"
+#include "file.h"
+
+// Per-sentence scores for programs that rank candidates, one record per
+// sentence with log probabilities (base 10, as in the verbose output):
+//
+// kTsv: sentence ID, number of tokens, total log probability and optionally
+// the log probabilities of the tokens separated by spaces, tab-separated. The
+// log probabilities have 5 decimals.
+//
+// kBinary: "RWTHLMS1", int32 1 if there are token scores, 0 otherwise, then
+// per sentence int64 ID, int32 number of tokens, double total and optionally
+// the doubles of the tokens (native byte order).
+//
+// Records are formatted into a large buffer that is written at once, instead
+// of going through the formatting of an ostream for each number.
+class ScoreWriter {
+public:
+  enum Format {
+    kTsv, kBinary
+  };
+
+  static const size_t kBufferSize = 1 << 20;
+
+  ScoreWriter(const std::string &file_name,
+              const Format format,
+              const bool has_token_scores);
+
+  // writes the rest of the buffer
+  ~ScoreWriter() {
+    Flush();
+  }
+
+  void Write(const int64_t sentence,
+             const Real log_probabilities[],
+             const int num_tokens);
+
+private:
+  void Append(const void *data, const size_t size) {
+    if (buffer_.size() + size > kBufferSize)
+      Flush();
+    const char *begin = static_cast<const char *>(data);
+    buffer_.insert(buffer_.end(), begin, begin + size);
+  }
+
+  // fixed with 5 decimals, as in the verbose output
+  void AppendNumber(const double x);
+
+  void Flush() {
+    file_.Write(buffer_.data(), buffer_.size());
+    buffer_.clear();
+  }
+
+  WritableFile file_;
+  const Format format_;
+  const bool has_token_scores_;
+  std::vector<char> buffer_;
+};
@@ -0,0 +1,77 @@
+/*
+ * Copyright 2014 RWTH Aachen University. All rights reserved.
+ *
+ * Licensed under the RWTH LM License (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+#include <cassert>
+#include <vector>
+#include "fast.h"
+
+// The states of many sequences (e.g., lattice hypotheses) in slots of
+// state_size values, see Function::GetSequenceStateSize(). A slot is
+// referenced by its index, so that the owners of a state only pass an
+// integer around. Slots are shared by counting references and reused once
+// the last reference is released. The memory grows as needed, which moves
+// the slots: a pointer from Get() is only valid until the next Allocate().
+class StateArena {
+public:
+  StateArena(const int state_size, const int initial_num_slots)
+      : state_size_(state_size) {
+    assert(state_size >= 0 && initial_num_slots > 0);
+    states_.reserve(static_cast<size_t>(state_size) * initial_num_slots);
+    num_references_.reserve(initial_num_slots);
+  }
+
+  // a slot with one reference
+  int Allocate() {
+    int slot;
+    if (free_slots_.empty()) {
+      slot = num_references_.size();
+      num_references_.push_back(0);
+      states_.resize(states_.size() + state_size_);
+    } else {
+      slot = free_slots_.back();
+      free_slots_.pop_back();
+    }
+    num_references_[slot] = 1;
+    return slot;
+  }
+
+  void AddReference(const int slot) {
+    assert(num_references_[slot] > 0);
+    ++num_references_[slot];
+  }
+
+  void Release(const int slot) {
+    assert(num_references_[slot] > 0);
+    if (--num_references_[slot] == 0)
+      free_slots_.push_back(slot);
+  }
+
+  Real *Get(const int slot) {
+    assert(num_references_[slot] > 0);
+    return states_.data() + static_cast<size_t>(slot) * state_size_;
+  }
+
+  const Real *Get(const int slot) const {
+    assert(num_references_[slot] > 0);
+    return states_.data() + static_cast<size_t>(slot) * state_size_;
+  }
+
+  size_t num_used_slots() const {
+    return num_references_.size() - free_slots_.size();
+  }
+
+private:
+  const int state_size_;
+  std::vector<Real> states_;
+  std::vector<int> num_references_, free_slots_;
+};
@@ -22,20 +22,32 @@ TableLookup::TableLookup(const int input_dimension,
                          const bool is_recurrent,
                          const bool use_bias,
                          const bool is_feedforward,
+                         const bool is_trainable,
                          ActivationFunctionPointer activation_function)
     : Function(input_dimension,
                output_dimension,
                max_batch_size,
-               max_sequence_length),
+               max_sequence_length,
+               is_trainable),
       order_(order),
       is_feedforward_(is_feedforward),
       word_dimension_(output_dimension / order),
+      delta_(nullptr),
+      weights_(nullptr),
+      bias_(nullptr),
       activation_function_(std::move(activation_function)) {
   assert(order == 0 || output_dimension == word_dimension_ * order);
   b_ = FastMalloc(output_dimension * max_batch_size * max_sequence_length);
-  delta_ = FastMalloc(output_dimension * max_batch_size * max_sequence_length);
-  weights_ = FastMalloc(word_dimension_ * input_dimension);
-  bias_ = use_bias ? FastMalloc(word_dimension_) : nullptr;
+  if (is_trainable) {
+    delta_ = FastMalloc(output_dimension * max_batch_size *
+                        max_sequence_length);
+    weights_ = FastMalloc(word_dimension_ * input_dimension);
+    bias_ = use_bias ? FastMalloc(word_dimension_) : nullptr;
+  }
+  // sparse updates are applied to the weights directly
+  weight_updates_ = weights_;
+  bias_updates_ = bias_;
+  histories_.resize(order_ * max_batch_size);
   if (is_recurrent) {
     recurrency_ = RecurrencyPointer(new Recurrency(output_dimension,
                                                    max_batch_size,
@@ -43,14 +55,15 @@ TableLookup::TableLookup(const int input_dimension,
                                                    b_,
                                                    b_t_,
                                                    delta_,
-                                                   delta_t_));
+                                                   delta_t_,
+                                                   is_trainable));
   }
   ResetHistories();
 }
 
-const Real *TableLookup::Evaluate(const Slice &slice, const Real x[]) {
+const Real *TableLookup::Evaluate(const Slice &slice, const int words[]) {
   Real *result = b_t_;
-  UpdateHistories(slice.size(), x);
+  UpdateHistories(slice, words);
   if (bias_) {
     for (size_t i = 0; i < slice.size() * order_; ++i)
       FastCopy(bias_, word_dimension_, b_t_ + i * word_dimension_);
@@ -58,14 +71,15 @@ const Real *TableLookup::Evaluate(const Slice &slice, const Real x[]) {
   
 #pragma omp parallel for
   for (int i = 0; i < slice.size() * order_; ++i) {
-    const int word = histories_[i / order_][i % order_];
+    const int word = GetHistoryWord(i / order_, i % order_);
     FastAdd(&weights_[word * word_dimension_],
             word_dimension_,
             b_t_ + i * word_dimension_,
             b_t_ + i * word_dimension_);
   }
+  // the recurrency does not depend on the input
   if (recurrency_)
-    recurrency_->Evaluate(slice, x);
+    recurrency_->Evaluate(slice, nullptr);
   activation_function_->Evaluate(output_dimension(), slice.size(), result);
   b_t_ = result + GetOffset();
   return result;
@@ -87,28 +101,28 @@ void TableLookup::AddDelta(const Slice &slice, Real delta_t[]) {
 
 const Real *TableLookup::UpdateWeights(const Slice &slice,
                                        const Real learning_rate,
-                                       const Real x[]) {
+                                       const int words[]) {
   delta_t_ -= GetOffset();
   if (!is_feedforward_)
-    UpdateHistories(slice.size(), x);
+    UpdateHistories(slice, words);
   if (bias_) {
     for (size_t i = 0; i < slice.size() * order_; ++i) {
       FastMultiplyByConstantAdd(-learning_rate,
                                 delta_t_ + i * word_dimension_,
                                 word_dimension_,
-                                bias_);
+                                bias_updates_);
     }
   }
   for (size_t i = 0; i < slice.size() * order_; ++i) {
-    const int word = histories_[i / order_][i % order_];
+    const int word = GetHistoryWord(i / order_, i % order_);
     FastMultiplyByConstantAdd(
         -learning_rate,
         delta_t_ + i * word_dimension_,
         word_dimension_,
-        weights_ + word_dimension_ * word);
+        weight_updates_ + word_dimension_ * word);
   }
   if (recurrency_)
-    recurrency_->UpdateWeights(slice, learning_rate, x);
+    recurrency_->UpdateWeights(slice, learning_rate, nullptr);
   const Real *result = b_t_;
   b_t_ += GetOffset();
   return result;
@@ -124,15 +138,77 @@ void TableLookup::ResetMomentum() {
     recurrency_->ResetMomentum();
 }
 
-void TableLookup::UpdateHistories(const size_t size, const Real x[]) {
-  if (histories_.empty()) {
-    for (size_t i = 0; i < size; ++i)
-      histories_.push_back(std::vector<int>(order_, static_cast<int>(x[i])));
+void TableLookup::ShareWeights(const Function &f,
+                               const bool share_sparse_updates) {
+  const TableLookup &table_lookup = dynamic_cast<const TableLookup &>(f);
+  assert(!shares_weights() && !table_lookup.shares_weights());
+  assert(word_dimension_ == table_lookup.word_dimension_ &&
+         input_dimension() == table_lookup.input_dimension());
+  set_shares_weights(true);
+  weights_ = table_lookup.weights_;
+  bias_ = table_lookup.bias_;
+  if (recurrency_)
+    recurrency_->ShareWeights(*table_lookup.recurrency_, share_sparse_updates);
+  // there are no updates without training
+  if (!is_trainable())
+    return;
+  if (share_sparse_updates) {
+    FastFree(weight_updates_);
+    FastFree(bias_updates_);
+    weight_updates_ = weights_;
+    bias_updates_ = bias_;
+  } else {
+    // own weights are kept for collecting the updates
+    FastZero(word_dimension_ * input_dimension(), weight_updates_);
+    if (bias_updates_)
+      FastZero(word_dimension_, bias_updates_);
+  }
+}
+
+void TableLookup::GetUpdateBuffers(BufferVector *buffers) {
+  // sparse updates already applied to the shared weights
+  if (weight_updates_ != weights_ || !shares_weights()) {
+    buffers->push_back(std::make_pair(weight_updates_,
+                                      word_dimension_ * input_dimension()));
+    if (bias_updates_)
+      buffers->push_back(std::make_pair(bias_updates_, word_dimension_));
+  }
+  if (recurrency_)
+    recurrency_->GetUpdateBuffers(buffers);
+}
+
+void TableLookup::UpdateHistories(const Slice &slice, const int words[]) {
+  const size_t size = slice.size();
+  if (num_histories_ == 0) {
+    assert(size <= static_cast<size_t>(max_batch_size()));
+    for (size_t i = 0; i < size; ++i) {
+      std::fill(histories_.begin() + i * order_,
+                histories_.begin() + (i + 1) * order_,
+                words[i]);
+    }
+    num_histories_ = size;
+    history_position_ = 0;
   } else {
+    // the oldest word is overwritten
+    assert(size <= num_histories_);
+    history_position_ = (history_position_ + order_ - 1) % order_;
     for (size_t i = 0; i < size; ++i) {
-      std::vector<int> &history(histories_[i]);
-      history.insert(history.begin(), static_cast<int>(x[i]));
-      history.pop_back();
+      histories_[i * order_ + history_position_] = words[i];
+      // a sequence without history so far, see SetSequenceState()
+      if (histories_[i * order_ + (history_position_ + 1) % order_] ==
+          kNoWord) {
+        std::fill(histories_.begin() + i * order_,
+                  histories_.begin() + (i + 1) * order_,
+                  words[i]);
+      }
+    }
+    // a new sentence starts with a new history
+    for (size_t i = 0; slice.resets() && i < size; ++i) {
+      if (slice.resets()[i]) {
+        std::fill(histories_.begin() + i * order_,
+                  histories_.begin() + (i + 1) * order_,
+                  words[i]);
+      }
     }
   }
 }
@@ -156,7 +232,6 @@ void TableLookup::RandomizeWeights(Random *random) {
 
 void TableLookup::Reset(const bool is_dependent) {
   if (is_dependent && recurrency_) {
-    assert(max_batch_size() == 1);
     FastCopy(b_ + GetOffset(), GetOffset(), b_);
     b_t_ = b_ + GetOffset();
   } else {
@@ -165,15 +240,18 @@ void TableLookup::Reset(const bool is_dependent) {
   delta_t_ = delta_;
   const int size = GetOffset() * max_sequence_length();
   FastZero(size - GetOffset(), b_t_);
-  FastZero(size, delta_);
+  if (delta_)
+    FastZero(size, delta_);
 }
 
 void TableLookup::ExtractState(State *state) const {
   std::vector<Real> hidden_layer;
   if (recurrency_)
     hidden_layer.insert(hidden_layer.end(), b_, b_ + GetOffset());
-  for (const auto &history : histories_)
-    hidden_layer.insert(hidden_layer.end(), history.begin(), history.end());
+  for (size_t i = 0; i < num_histories_; ++i) {
+    for (size_t j = 0; j < order_; ++j)
+      hidden_layer.push_back(GetHistoryWord(i, j));
+  }
   state->states.push_back(hidden_layer);
 }
 
@@ -182,8 +260,34 @@ void TableLookup::SetState(const State &state, const int i) {
   if (recurrency_)
     FastCopy(s.data(), GetOffset(), b_);
   ResetHistories();
-  for (int j = recurrency_ ? GetOffset() : 0; j < s.size(); j += order_)
-    histories_.push_back(std::vector<int>(s.begin() + j, s.begin() + j + order_));
+  for (int j = recurrency_ ? GetOffset() : 0; j < s.size(); j += order_) {
+    std::copy(s.begin() + j,
+              s.begin() + j + order_,
+              histories_.begin() + num_histories_ * order_);
+    ++num_histories_;
+  }
+}
+
+void TableLookup::ExtractSequenceState(const int j, Real state[]) const {
+  if (recurrency_) {
+    FastCopy(b_ + j * output_dimension(), output_dimension(), state);
+    state += output_dimension();
+  }
+  const bool has_history = static_cast<size_t>(j) < num_histories_;
+  for (size_t k = 0; k < order_; ++k)
+    state[k] = has_history ? GetHistoryWord(j, k) : kNoWord;
+}
+
+void TableLookup::SetSequenceState(const Real state[], const int j) {
+  if (recurrency_) {
+    FastCopy(state, output_dimension(), b_ + j * output_dimension());
+    state += output_dimension();
+  }
+  for (size_t k = 0; k < order_; ++k) {
+    histories_[j * order_ + (history_position_ + k) % order_] =
+        static_cast<int>(state[k]);
+  }
+  num_histories_ = std::max(num_histories_, static_cast<size_t>(j) + 1);
 }
 
 void TableLookup::Read(std::ifstream *input_stream) {
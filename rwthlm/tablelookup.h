@@ -26,33 +26,39 @@ public:
               const bool is_recurrent,
               const bool use_bias,
               const bool is_feedforward,
+              const bool is_trainable,
               ActivationFunctionPointer activation_function);
 
   virtual ~TableLookup() {
     FastFree(b_);
     FastFree(delta_);
-    FastFree(weights_);
-    FastFree(bias_);
+    // weight updates go to the own weights unless weights are shared
+    if (weight_updates_ != weights_ || !shares_weights()) {
+      FastFree(weight_updates_);
+      FastFree(bias_updates_);
+    }
   }
 
-  virtual const Real *Evaluate(const Slice &slice, const Real b_t[]);
+  // words: the previous word of each sequence of the slice
+  const Real *Evaluate(const Slice &slice, const int words[]);
 
   virtual void ComputeDelta(const Slice &slice, FunctionPointer f);
 
   virtual void AddDelta(const Slice &slice, Real delta_t[]);
 
-  virtual const Real *UpdateWeights(const Slice &slice,
-                                    const Real learning_rate,
-                                    const Real x[]);
+  const Real *UpdateWeights(const Slice &slice,
+                            const Real learning_rate,
+                            const int words[]);
 
   virtual void UpdateMomentumWeights(const Real momentum);
 
   virtual void ResetMomentum();
 
-  void UpdateHistories(const size_t size, const Real x[]);
+  void UpdateHistories(const Slice &slice, const int words[]);
 
   virtual void ResetHistories() {
-    histories_.clear();
+    num_histories_ = 0;
+    history_position_ = 0;
   }
 
   virtual void Reset(const bool is_dependent);
@@ -61,19 +67,44 @@ public:
 
   virtual void SetState(const State &state, const int i = 0);
 
+  virtual int GetSequenceStateSize() const {
+    return (recurrency_ ? output_dimension() : 0) + order_;
+  }
+
+  virtual void ExtractSequenceState(const int j, Real state[]) const;
+
+  virtual void SetSequenceState(const Real state[], const int j);
+
   virtual void Read(std::ifstream *input_stream);
 
   virtual void Write(std::ofstream *output_stream);
 
   virtual void RandomizeWeights(Random *random);
 
+  virtual void ShareWeights(const Function &f,
+                            const bool share_sparse_updates);
+
+  virtual void GetUpdateBuffers(BufferVector *buffers);
+
 private:
   friend class GradientTest;
 
+  // history of a sequence that does not have one yet
+  static const int kNoWord = -1;
+
+  // the j-th last word (j < order_) of the i-th sequence
+  int GetHistoryWord(const size_t i, const size_t j) const {
+    return histories_[i * order_ + (history_position_ + j) % order_];
+  }
+
   const bool is_feedforward_;
   const size_t order_, word_dimension_;
-  std::vector<std::vector<int>> histories_;
-  Real *b_, *b_t_, *delta_, *delta_t_, *weights_, *bias_;
+  // one ring buffer of order_ words per sequence, all sequences share the
+  // position of the last word
+  std::vector<int> histories_;
+  size_t num_histories_, history_position_;
+  Real *b_, *b_t_, *delta_, *delta_t_, *weights_, *bias_, *weight_updates_,
+       *bias_updates_;
   RecurrencyPointer recurrency_;
   const ActivationFunctionPointer activation_function_;
 };
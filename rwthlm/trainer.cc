@@ -10,17 +10,23 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#include <atomic>
 #include <cmath>
 #include <memory>
+#include <stdexcept>
 #include <string>
 #include <sstream>
 #include <vector>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/filesystem/operations.hpp>
+#include <omp.h>
 #include "fast.h"
+#include "batchscheduler.h"
 #include "identity.h"
+#include "inferenceengine.h"
 #include "linear.h"
 #include "output.h"
+#include "prefixtrie.h"
 #include "sigmoid.h"
 #include "softmax.h"
 #include "tablelookup.h"
@@ -33,6 +39,10 @@ const Real Trainer::kMaxRelativeIncrease = 2.0;
 namespace bp = boost::posix_time;
 
 Trainer::Trainer(const int max_epoch,
+                 const int num_threads,
+                 const bool asynchronous,
+                 const size_t max_staleness,
+                 ProcessGroup *process_group,
                  const bool shuffle,
                  const bool verbose,
                  const bool is_feedforward,
@@ -51,20 +61,41 @@ Trainer::Trainer(const int max_epoch,
       is_feedforward_(is_feedforward),
       random_(random),
       shuffle_(shuffle),
-      max_epoch_(max_epoch) {
+      asynchronous_(asynchronous),
+      max_epoch_(max_epoch),
+      num_threads_(num_threads),
+      max_staleness_(max_staleness),
+      process_group_(process_group) {
+  assert(num_threads == 1 || process_group == nullptr);
 }
 
 void Trainer::Train(const uint32_t seed) {
   // Note: rwthlm will train forever unless you stop it ...
   std::cout << "Training ..." << std::endl;
+  const bp::ptime start_time(bp::second_clock::local_time());
   while (max_epoch_ == 0 || net_->epoch() < max_epoch_) {
     Shuffle(seed);
     const bp::ptime time(bp::second_clock::local_time());
     TrainEpoch();
     net_->set_epoch(net_->epoch() + 1);
+    const bp::ptime end_time(bp::second_clock::local_time());
     std::cout << "epoch " << net_->epoch() << " took " << std::fixed <<
-                 std::setprecision(2) << (bp::second_clock::local_time() -
-				 time).total_seconds() / 60. << " minutes" << std::endl;
+                 std::setprecision(2) << (end_time - time).total_seconds() /
+                 60. << " minutes (" << (end_time - start_time).
+                 total_seconds() / 60. << " minutes in total)" << std::endl;
+    if (process_group_ != nullptr && !process_group_->is_coordinator()) {
+      // the coordinator evaluates the development data and decides
+      Real decision[2];
+      process_group_->Broadcast(2, decision);
+      if (decision[0] != 0.) {
+        // the coordinator has written the network of the previous epoch
+        const int new_epoch = net_->epoch();
+        net_->Read(net_config_);
+        net_->set_learning_rate(decision[1]);
+        net_->set_epoch(new_epoch);
+      }
+      continue;
+    }
     const Real perplexity = ComputePerplexity(dev_data_);
     std::cout << "development perplexity = " << std::setw(20) << std::fixed <<
                  std::setprecision(15) << perplexity << std::scientific <<
@@ -72,7 +103,8 @@ void Trainer::Train(const uint32_t seed) {
     if (net_->momentum() > 0.0)
       std::cout << ", momentum = " << std::fixed << net_->momentum();
     std::cout << std::endl;
-    if (net_->best_perplexity() > perplexity) {
+    const bool is_improved = net_->best_perplexity() > perplexity;
+    if (is_improved) {
       net_->set_best_perplexity(perplexity);
       net_->Write(net_config_);
     } else {
@@ -83,10 +115,29 @@ void Trainer::Train(const uint32_t seed) {
       net_->set_epoch(new_epoch);
       net_->Write(net_config_);
     }
+    if (process_group_ != nullptr) {
+      Real decision[2] = { is_improved ? 0. : 1., net_->learning_rate() };
+      process_group_->Broadcast(2, decision);
+    }
   }
 }
 
 void Trainer::TrainEpoch() {
+  // a replica would apply its momentum after each time step, whereas
+  // evaluation in parallel works for feedforward networks as well
+  assert((num_threads_ == 1 && process_group_ == nullptr) ||
+         !is_feedforward_);
+  if (process_group_ != nullptr) {
+    TrainEpochMultiProcess();
+    return;
+  }
+  if (num_threads_ > 1) {
+    if (asynchronous_)
+      TrainEpochAsynchronous();
+    else
+      TrainEpochParallel();
+    return;
+  }
   Real log_probability = 0.;
   int64_t num_running_words = 0;
   for (const Batch &batch : *training_data_) {
@@ -98,7 +149,7 @@ void Trainer::TrainEpoch() {
     if (is_feedforward_)
       TrainBatchFeedforward(batch, &log_probability, &num_running_words);
     else
-      TrainBatch(batch, &log_probability, &num_running_words);
+      TrainBatch(batch, net_.get(), &log_probability, &num_running_words);
     if (verbose_) {
       std::cout << "training perplexity = " << std::fixed <<
                    std::setprecision(2) << exp(-log_probability /
@@ -110,48 +161,287 @@ void Trainer::TrainEpoch() {
   }
 }
 
+void Trainer::TrainEpochParallel() {
+  // one replica per thread, all of them reading the weights of net_
+  while (static_cast<int>(replicas_.size()) < num_threads_)
+    replicas_.push_back(net_->Replicate(false));
+  Real log_probability = 0.;
+  int64_t num_running_words = 0;
+  // read ahead only one group of batches (the data may be streamed)
+  DataIterator it = training_data_->begin();
+  const DataIterator end = training_data_->end();
+  while (it != end) {
+    std::vector<Batch> batches;
+    for (; it != end && static_cast<int>(batches.size()) < num_threads_; ++it)
+      batches.push_back(*it);
+    const int num_batches = batches.size();
+    std::vector<Real> log_probabilities(num_batches, 0.);
+    std::vector<int64_t> num_words(num_batches, 0);
+    bp::ptime time;
+    if (verbose_)
+      time = bp::microsec_clock::local_time();
+#pragma omp parallel for num_threads(num_batches) schedule(static, 1)
+    for (int j = 0; j < num_batches; ++j) {
+      Net *replica = replicas_[j].get();
+      replica->Reset(false);
+      replica->ResetHistories();
+      TrainBatch(batches[j],
+                 replica,
+                 &log_probabilities[j],
+                 &num_words[j]);
+    }
+    ReduceWeightUpdates(num_batches);
+    net_->UpdateMomentumWeights();
+    // sum up in fixed order, independent of thread scheduling
+    for (int j = 0; j < num_batches; ++j) {
+      log_probability += log_probabilities[j];
+      num_running_words += num_words[j];
+    }
+    if (verbose_) {
+      std::cout << "training perplexity = " << std::fixed <<
+                   std::setprecision(2) << exp(-log_probability /
+                   num_running_words) << std::endl;
+      std::cout << "time = " << std::fixed << std::setprecision(3) <<
+                   (bp::microsec_clock::local_time() - time).
+                   total_milliseconds() / 1000. << " seconds" << std::endl;
+    }
+  }
+}
+
+void Trainer::TrainEpochAsynchronous() {
+  // Hogwild: no replica waits for the others. Sparse updates are applied to
+  // the weights of net_ during TrainBatch(), dense updates of a replica after
+  // each of its batches, all of them without locking.
+  if (replicas_.empty()) {
+    for (int i = 0; i < num_threads_; ++i)
+      replicas_.push_back(net_->Replicate(true));
+  }
+  DataIterator it = training_data_->begin();
+  const DataIterator end = training_data_->end();
+  int64_t num_batches = 0;
+
+  // number of dense updates applied to net_ so far in this epoch
+  std::atomic<int64_t> num_updates(0), num_stale_updates(0);
+  std::vector<Real> log_probabilities(num_threads_, 0.);
+  std::vector<int64_t> num_words(num_threads_, 0);
+#pragma omp parallel num_threads(num_threads_)
+  {
+    const int thread = omp_get_thread_num();
+    Net *replica = replicas_[thread].get();
+    while (true) {
+      // each thread takes the next batch (the data may be streamed)
+      bool is_end;
+      std::unique_ptr<Batch> batch;
+#pragma omp critical(next_batch)
+      {
+        is_end = it == end;
+        if (!is_end) {
+          batch.reset(new Batch(*it));
+          ++it;
+          ++num_batches;
+        }
+      }
+      if (is_end)
+        break;
+      bp::ptime time;
+      if (verbose_)
+        time = bp::microsec_clock::local_time();
+      const int64_t version = num_updates.load();
+      replica->Reset(false);
+      replica->ResetHistories();
+      TrainBatch(*batch,
+                 replica,
+                 &log_probabilities[thread],
+                 &num_words[thread]);
+      // drop dense updates computed on too old weights (zero: no bound)
+      const int64_t staleness = num_updates.load() - version;
+      if (max_staleness_ == 0 ||
+          staleness <= static_cast<int64_t>(max_staleness_)) {
+        replica->UpdateMomentumWeights(net_->momentum());
+        ++num_updates;
+      } else {
+        replica->ResetMomentum();
+        ++num_stale_updates;
+      }
+      if (verbose_) {
+#pragma omp critical
+        {
+          std::cout << "training perplexity = " << std::fixed <<
+                       std::setprecision(2) << exp(-log_probabilities[thread] /
+                       num_words[thread]) << " (thread " << thread << ")" <<
+                       std::endl;
+          std::cout << "time = " << std::fixed << std::setprecision(3) <<
+                       (bp::microsec_clock::local_time() - time).
+                       total_milliseconds() / 1000. << " seconds" << std::endl;
+        }
+      }
+    }
+  }
+
+  // sum up in fixed order, independent of thread scheduling
+  Real log_probability = 0.;
+  int64_t num_running_words = 0;
+  for (int i = 0; i < num_threads_; ++i) {
+    log_probability += log_probabilities[i];
+    num_running_words += num_words[i];
+  }
+  std::cout << "training perplexity = " << std::fixed << std::setprecision(2) <<
+               exp(-log_probability / num_running_words) << ", " <<
+               num_stale_updates.load() << " of " << num_batches <<
+               " dense updates dropped as stale" << std::endl;
+}
+
+void Trainer::TrainEpochMultiProcess() {
+  // Each process keeps a copy of the network and trains every n-th batch of
+  // the (identically shuffled) training data on a replica. After each step,
+  // all processes add up the same sum of updates, so the copies stay equal.
+  if (replicas_.empty())
+    replicas_.push_back(net_->Replicate(false));
+  Net *replica = replicas_.front().get();
+  BufferVector replica_buffers, net_buffers;
+  replica->GetUpdateBuffers(&replica_buffers);
+  net_->GetUpdateBuffers(&net_buffers);
+  const size_t num_processes = process_group_->num_processes(),
+               index = process_group_->index();
+  Real log_probability = 0.;
+  int64_t num_running_words = 0;
+  // all processes read all batches, but train only their own ones
+  DataIterator it = training_data_->begin();
+  const DataIterator end = training_data_->end();
+  while (it != end) {
+    std::vector<Batch> batches;
+    for (; it != end && batches.size() < num_processes; ++it)
+      batches.push_back(*it);
+    bp::ptime time;
+    if (verbose_)
+      time = bp::microsec_clock::local_time();
+    // a process without a batch in the last step contributes zero updates
+    if (index < batches.size()) {
+      replica->Reset(false);
+      replica->ResetHistories();
+      TrainBatch(batches[index],
+                 replica,
+                 &log_probability,
+                 &num_running_words);
+    }
+    process_group_->AllReduce(replica_buffers, net_buffers);
+    net_->UpdateMomentumWeights();
+    if (verbose_) {
+      std::cout << "training perplexity = " << std::fixed <<
+                   std::setprecision(2) << exp(-log_probability /
+                   num_running_words) << " (process " << index << ")" <<
+                   std::endl;
+      std::cout << "time = " << std::fixed << std::setprecision(3) <<
+                   (bp::microsec_clock::local_time() - time).
+                   total_milliseconds() / 1000. << " seconds" << std::endl;
+    }
+  }
+
+  Real sums[2] = { log_probability, static_cast<Real>(num_running_words) },
+       totals[2] = { 0., 0. };
+  process_group_->AllReduce(BufferVector(1, std::make_pair(sums, 2)),
+                            BufferVector(1, std::make_pair(totals, 2)));
+  if (process_group_->is_coordinator()) {
+    std::cout << "training perplexity = " << std::fixed <<
+                 std::setprecision(2) << exp(-totals[0] / totals[1]) <<
+                 std::endl;
+  }
+}
+
+void Trainer::ReduceWeightUpdates(const int num_replicas) {
+  std::vector<BufferVector> buffers(num_replicas);
+  for (int i = 0; i < num_replicas; ++i)
+    replicas_[i]->GetUpdateBuffers(&buffers[i]);
+
+  // tree sum: in each round, replica i takes over the updates of i + step
+  for (int step = 1; step < num_replicas; step *= 2) {
+    BufferPairVector pairs;
+    for (int i = 0; i + step < num_replicas; i += 2 * step)
+      pairs.push_back(std::make_pair(&buffers[i + step], &buffers[i]));
+    AddWeightUpdates(pairs);
+  }
+
+  // finally, the network itself takes over the sum from replica 0
+  BufferVector net_buffers;
+  net_->GetUpdateBuffers(&net_buffers);
+  AddWeightUpdates(BufferPairVector(1, std::make_pair(&buffers[0],
+                                                      &net_buffers)));
+}
+
+void Trainer::AddWeightUpdates(const BufferPairVector &pairs) {
+  // split buffers into chunks of similar size for load balancing
+  struct Chunk {
+    Real *source, *destination;
+    int size;
+  };
+  std::vector<Chunk> chunks;
+  for (const auto &pair : pairs) {
+    const BufferVector &source = *pair.first, &destination = *pair.second;
+    assert(source.size() == destination.size());
+    for (size_t i = 0; i < source.size(); ++i) {
+      assert(source[i].second == destination[i].second);
+      for (int offset = 0; offset < source[i].second;
+           offset += kReductionChunkSize) {
+        Chunk chunk;
+        chunk.source = source[i].first + offset;
+        chunk.destination = destination[i].first + offset;
+        chunk.size = std::min(static_cast<int>(kReductionChunkSize),
+                              source[i].second - offset);
+        chunks.push_back(chunk);
+      }
+    }
+  }
+#pragma omp parallel for num_threads(num_threads_) schedule(dynamic)
+  for (int i = 0; i < static_cast<int>(chunks.size()); ++i) {
+    const Chunk &chunk = chunks[i];
+    FastAdd(chunk.source, chunk.size, chunk.destination, chunk.destination);
+    // each replica is a source only once: prepare it for the next batch
+    FastZero(chunk.size, chunk.source);
+  }
+}
+
 void Trainer::TrainBatch(const Batch &batch,
+                         Net *net,
                          Real *log_probability,
                          int64_t *num_running_words) {
+  const BatchMatrix matrix(batch);
   // forward pass
-  auto previous_slice(*batch.Begin(0));
-  for (auto next_slice : batch) {
-    const Real *x = net_->Evaluate(next_slice, Caster(previous_slice).Cast());
-    *log_probability += net_->ComputeLogProbability(next_slice, x, false);
-    *num_running_words += next_slice.size();
-    previous_slice = next_slice;
+  for (int t = 0; t < matrix.length(); ++t) {
+    const Slice slice = matrix.GetSlice(t);
+    const Real *x = net->Evaluate(slice, matrix.GetInputs(t));
+    *log_probability += net->ComputeLogProbability(slice, x, false);
+    *num_running_words += slice.size();
   }
 
   // backward pass
-  auto slice = batch.End(1);
-  do {
-    --slice;
-    net_->ComputeDelta(*slice, FunctionPointer());
-  } while (slice != batch.Begin(1));
-  net_->ResetHistories();
+  for (int t = matrix.length() - 1; t >= 0; --t)
+    net->ComputeDelta(matrix.GetSlice(t), FunctionPointer());
+  net->ResetHistories();
 
-  // weight update
-  previous_slice = *batch.Begin(0);
-  for (auto next_slice : batch) {
-    net_->UpdateWeights(next_slice, Caster(previous_slice).Cast());
-    previous_slice = next_slice;
+  // weight update (a replica uses the learning rate of the network itself)
+  for (int t = 0; t < matrix.length(); ++t) {
+    net->UpdateWeights(matrix.GetSlice(t),
+                       net_->learning_rate(),
+                       matrix.GetInputs(t));
   }
-  net_->UpdateMomentumWeights();
+  // replicas leave their updates to ReduceWeightUpdates()
+  if (!net->shares_weights())
+    net->UpdateMomentumWeights();
 }
 
 void Trainer::TrainBatchFeedforward(const Batch &batch,
                                     Real *log_probability,
                                     int64_t *num_running_words) {
+  const BatchMatrix matrix(batch);
   // forward pass
-  auto previous_slice(*batch.Begin(0));
-  for (auto next_slice : batch) {
+  for (int t = 0; t < matrix.length(); ++t) {
+    const Slice slice = matrix.GetSlice(t);
     net_->Reset(false);
-    const Real *x = net_->Evaluate(next_slice, Caster(previous_slice).Cast());
-    *log_probability += net_->ComputeLogProbability(next_slice, x, false);
-    *num_running_words += next_slice.size();
-    net_->ComputeDelta(next_slice, FunctionPointer());
-    net_->UpdateWeights(next_slice, Caster(previous_slice).Cast());
-    previous_slice = next_slice;
+    const Real *x = net_->Evaluate(slice, matrix.GetInputs(t));
+    *log_probability += net_->ComputeLogProbability(slice, x, false);
+    *num_running_words += slice.size();
+    net_->ComputeDelta(slice, FunctionPointer());
+    net_->UpdateWeights(slice, matrix.GetInputs(t));
     net_->UpdateMomentumWeights();
   }
 }
@@ -177,7 +467,7 @@ Real Trainer::AutoAdjustLearningRate(const Real factor,
       if (is_feedforward_)
         TrainBatchFeedforward(batch, &log_probability, &num_running_words);
       else
-        TrainBatch(batch, &log_probability, &num_running_words);
+        TrainBatch(batch, net_.get(), &log_probability, &num_running_words);
       const Real new_ppl = exp(-log_probability / num_running_words);
       // keep track of whether error falls consistently
       if (new_ppl < ppl)
@@ -214,7 +504,8 @@ Real Trainer::AutoAdjustLearningRate(const Real factor,
 
 void Trainer::AutoInitializeLearningRate(const int seed) {
   std::cout << "Determining initial learning rate ..." << std::endl;
-  assert(training_data_->GetNumBatches() >= kMaxNumBatches);
+  assert(training_data_->is_streaming() ||
+         training_data_->GetNumBatches() >= kMaxNumBatches);
   Shuffle(seed);
 
   // increase learning rate until strong perplexity increase/fluctuation
@@ -237,19 +528,203 @@ void Trainer::AutoInitializeLearningRate(const int seed) {
 }
 
 Real Trainer::ComputePerplexity(DataPointer data) {
+  // verbose output is printed word by word in order
+  if (num_threads_ > 1 && !verbose_)
+    return ComputePerplexityParallel(data);
   int num_running_words = 0;
   Real log_probability = 0.;
   for (auto &batch : *data) {
     net_->Reset(false);
     net_->ResetHistories();
-    Sequence slice(*batch.Begin(0));
-    for (auto next_slice : batch) {
+    const BatchMatrix matrix(batch);
+    for (int t = 0; t < matrix.length(); ++t) {
+      const Slice slice = matrix.GetSlice(t);
       if (is_feedforward_)
         net_->Reset(false);
-      const Real *x = net_->Evaluate(next_slice, Caster(slice).Cast());
-      log_probability += net_->ComputeLogProbability(next_slice, x, verbose_);
-      slice = next_slice;
-      num_running_words += next_slice.size();
+      const Real *x = net_->Evaluate(slice, matrix.GetInputs(t));
+      log_probability += net_->ComputeLogProbability(slice, x, verbose_);
+      num_running_words += slice.size();
+    }
+  }
+  return exp(-log_probability / num_running_words);
+}
+
+Real Trainer::ComputePerplexityWithPrefixTrie(DataPointer data,
+                                              ScoreWriter *scores) {
+  assert(!is_feedforward_);
+  const SequenceStorage &sequences = data->sequences();
+  PrefixTrie trie;
+  // -1: empty sequence (an empty line without <sb>)
+  std::vector<int> last_nodes(sequences.size(), -1);
+  for (size_t i = 0; i < sequences.size(); ++i) {
+    if (sequences.GetLength(i) > 0) {
+      last_nodes[i] = trie.AddSequence(sequences.GetWords(i),
+                                       sequences.GetLength(i));
+    }
+  }
+  // one time step at a time, as for rescoring
+  const NetPointer evaluator = net_->CloneForEvaluation(net_->max_batch_size(),
+                                                        3);
+  trie.Evaluate(evaluator.get());
+
+  int64_t num_running_words = 0;
+  Real log_probability = 0.;
+  std::vector<int> nodes;
+  std::vector<Real> log10_probabilities;
+  for (size_t i = 0; i < sequences.size(); ++i) {
+    nodes.clear();
+    for (int node = last_nodes[i]; node >= 0 && !trie.IsFirstWord(node);
+         node = trie.GetParent(node))
+      nodes.push_back(node);
+    log10_probabilities.clear();
+    for (auto it = nodes.rbegin(); it != nodes.rend(); ++it) {
+      const Real probability = trie.GetProbability(*it);
+      log_probability += log(probability);
+      log10_probabilities.push_back(log(probability) / log(10.));
+      if (verbose_)
+        PrintProbability(trie.GetWord(*it), probability);
+    }
+    num_running_words += nodes.size();
+    if (scores != nullptr) {
+      scores->Write(i, log10_probabilities.data(),
+                    log10_probabilities.size());
+    }
+  }
+  return exp(-log_probability / num_running_words);
+}
+
+void Trainer::PrintProbability(const int word, const Real probability) const {
+  std::cout << "\tp( " << vocabulary_->GetWord(word) << " | ... ) \t = " <<
+               "[1gram] " << std::setprecision(8) << probability << " [ " <<
+               std::setprecision(5) << log(probability) / log(10.) << " ]\n";
+}
+
+Real Trainer::ComputePerplexityWithSessions(DataPointer data,
+                                            const int batch_window,
+                                            const bool check_sessions) {
+  assert(!is_feedforward_);
+  const SequenceStorage &sequences = data->sequences();
+  // one session per thread, a rollback of one word for the checks
+  InferenceEngine engine(vocabulary_,
+                         net_,
+                         num_threads_,
+                         check_sessions ? 1 : 0,
+                         num_threads_);
+  std::unique_ptr<BatchScheduler> scheduler;
+  if (batch_window >= 0) {
+    scheduler.reset(new BatchScheduler(&engine,
+                                       num_threads_,
+                                       std::chrono::microseconds(batch_window)));
+  }
+  auto score = [&](const int session, const int word) {
+    return scheduler ? scheduler->Score(session, word) :
+                       engine.Score(session, word);
+  };
+  auto advance = [&](const int session, const int word) {
+    return scheduler ? scheduler->Advance(session, word) :
+                       engine.Advance(session, word);
+  };
+  // batches of different sizes may round differently
+  auto agree = [&](const Real x, const Real y) {
+    return scheduler ? fabs(x - y) <= 1e-4 * fabs(y) : x == y;
+  };
+  std::vector<std::vector<Real>> log_probabilities(sequences.size());
+  size_t next_sequence = 0;
+  int num_disagreements = 0;
+#pragma omp parallel num_threads(num_threads_)
+  for (;;) {
+    size_t i;
+#pragma omp critical(next_sequence)
+    i = next_sequence++;
+    if (i >= sequences.size())
+      break;
+    const int *words = sequences.GetWords(i);
+    const int length = sequences.GetLength(i);
+    // a session starts after <sb>
+    assert(length > 0 && words[0] == vocabulary_->sb_index());
+    const int session = engine.CreateSession();
+    assert(session >= 0);
+    for (int t = 1; t < length; ++t) {
+      const Real log_probability = advance(session, words[t]);
+      if (check_sessions) {
+        // back to the state before the word, scoring leaves the session as it
+        // is, and the same word again
+        engine.Rollback(session, 1);
+        const Real scored_log_probability = score(session, words[t]),
+                   advanced_log_probability = advance(session, words[t]);
+        if (!agree(scored_log_probability, log_probability) ||
+            !agree(advanced_log_probability, log_probability) ||
+            engine.GetLength(session) != t) {
+#pragma omp atomic
+          ++num_disagreements;
+        }
+      }
+      log_probabilities[i].push_back(log_probability);
+    }
+    engine.DestroySession(session);
+  }
+  if (num_disagreements > 0) {
+    throw std::runtime_error(std::to_string(num_disagreements) +
+                             " steps of the sessions disagree");
+  }
+
+  // in file order, summed up as ComputePerplexity() does
+  int64_t num_running_words = 0;
+  Real log_probability = 0.;
+  for (size_t i = 0; i < sequences.size(); ++i) {
+    for (size_t t = 0; t < log_probabilities[i].size(); ++t) {
+      log_probability += log_probabilities[i][t];
+      if (verbose_) {
+        PrintProbability(sequences.GetWord(i, t + 1),
+                         exp(log_probabilities[i][t]));
+      }
+    }
+    num_running_words += log_probabilities[i].size();
+  }
+  if (scheduler)
+    scheduler->PrintHistograms();
+  return exp(-log_probability / num_running_words);
+}
+
+Real Trainer::ComputePerplexityParallel(DataPointer data) {
+  // one evaluation clone per thread, all of them reading the weights of net_
+  while (static_cast<int>(evaluators_.size()) < num_threads_)
+    evaluators_.push_back(net_->CloneForEvaluation());
+  int num_running_words = 0;
+  Real log_probability = 0.;
+  // read ahead only one group of batches (the data may be streamed)
+  DataIterator it = data->begin();
+  const DataIterator end = data->end();
+  while (it != end) {
+    std::vector<Batch> batches;
+    for (; it != end && static_cast<int>(batches.size()) < num_threads_; ++it)
+      batches.push_back(*it);
+    const int num_batches = batches.size();
+    // the log probability of each time step of each batch
+    std::vector<std::vector<Real>> log_probabilities(num_batches);
+    std::vector<int> num_words(num_batches, 0);
+#pragma omp parallel for num_threads(num_batches) schedule(static, 1)
+    for (int j = 0; j < num_batches; ++j) {
+      Net *evaluator = evaluators_[j].get();
+      evaluator->Reset(false);
+      evaluator->ResetHistories();
+      const BatchMatrix matrix(batches[j]);
+      for (int t = 0; t < matrix.length(); ++t) {
+        const Slice slice = matrix.GetSlice(t);
+        if (is_feedforward_)
+          evaluator->Reset(false);
+        const Real *x = evaluator->Evaluate(slice, matrix.GetInputs(t));
+        log_probabilities[j].push_back(
+            evaluator->ComputeLogProbability(slice, x, false));
+        num_words[j] += slice.size();
+      }
+    }
+    // sum up in the same order as ComputePerplexity() does, so the result is
+    // identical for any number of threads
+    for (int j = 0; j < num_batches; ++j) {
+      for (const Real x : log_probabilities[j])
+        log_probability += x;
+      num_running_words += num_words[j];
     }
   }
   return exp(-log_probability / num_running_words);
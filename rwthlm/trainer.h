@@ -17,25 +17,18 @@
 #include "data.h"
 #include "function.h"
 #include "net.h"
+#include "processgroup.h"
 #include "random.h"
+#include "scorewriter.h"
 #include "vocabulary.h"
 
-class Caster {
-public:
-  Caster(const Slice &slice) : real_slice_(slice.begin(), slice.end()) {
-  }
-
-  const Real *Cast() {
-    return real_slice_.data();
-  }
-
-private:
-  const std::vector<Real> real_slice_;
-};
-
 class Trainer {
 public:
   Trainer(const int max_epoch,
+          const int num_threads,
+          const bool asynchronous,
+          const size_t max_staleness,
+          ProcessGroup *process_group,
           const bool shuffle,
           const bool verbose,
           const bool is_feedforward,
@@ -57,10 +50,28 @@ public:
 
   Real ComputePerplexity(DataPointer data);
 
+  // The same, but sequences with a common prefix share its evaluation, see
+  // PrefixTrie. Verbose output is printed sequence by sequence, and so are
+  // the records of scores, if given.
+  Real ComputePerplexityWithPrefixTrie(DataPointer data,
+                                       ScoreWriter *scores = nullptr);
+
+  // The same, but each sequence (starting with <sb>) is scored word by word
+  // as a session of an InferenceEngine, with num_threads sessions at a time.
+  // Verbose output is printed sequence by sequence. With batch_window >= 0,
+  // the steps go through a BatchScheduler with this window in microseconds,
+  // whose histograms are printed at the end. With check_sessions (testing
+  // only), each word is also rolled back, scored and appended again, and a
+  // std::runtime_error is thrown unless all of them agree.
+  Real ComputePerplexityWithSessions(DataPointer data,
+                                     const int batch_window = -1,
+                                     const bool check_sessions = false);
+
 private:
   friend class GradientTest;
 
-  static const int kMaxNumBatches = 30, kMinNumDecreases = 25;
+  static const int kMaxNumBatches = 30, kMinNumDecreases = 25,
+                   kReductionChunkSize = 16384;
   static const Real kAutoInitialLearningRate, kMaxRelativeIncrease;
 
   static bool IsFiniteNumber(const Real x) {
@@ -80,10 +91,30 @@ private:
     }
   }
 
+  void TrainEpochParallel();
+
+  void TrainEpochAsynchronous();
+
+  void TrainEpochMultiProcess();
+
+  Real ComputePerplexityParallel(DataPointer data);
+
+  // in the verbose format of Output::ComputeLogProbability()
+  void PrintProbability(const int word, const Real probability) const;
+
   void TrainBatch(const Batch &batch,
+                  Net *net,
                   Real *log_probability,
                   int64_t *num_running_words);
 
+  void ReduceWeightUpdates(const int num_replicas);
+
+  // (source, destination) pairs of update buffers
+  typedef std::vector<std::pair<BufferVector *, BufferVector *>>
+      BufferPairVector;
+
+  void AddWeightUpdates(const BufferPairVector &pairs);
+
   void TrainBatchFeedforward(const Batch &batch,
                              Real *log_probability,
                              int64_t *num_running_words);
@@ -92,10 +123,13 @@ private:
                               const int seed,
                               Real learning_rate);
 
-  const bool shuffle_, verbose_, is_feedforward_;
-  const int max_epoch_;
+  const bool shuffle_, verbose_, is_feedforward_, asynchronous_;
+  const int max_epoch_, num_threads_;
+  const size_t max_staleness_;
+  ProcessGroup *process_group_;
   const std::string net_config_;
   const NetPointer &net_;
+  std::vector<NetPointer> replicas_, evaluators_;
   const DataPointer training_data_, dev_data_;
   ConstVocabularyPointer vocabulary_;
   Random *random_;
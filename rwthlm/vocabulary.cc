@@ -12,24 +12,30 @@
  */
 #include <cassert>
 #include <cstdint>
+#include <cstring>
 #include <set>
 #include <vector>
 #include <sstream>
 #include <boost/tuple/tuple.hpp>
 #include <boost/tuple/tuple_comparison.hpp>
 #include <boost/algorithm/string/trim.hpp>
+#include "corpus.h"
 #include "file.h"
 #include "vocabulary.h"
 
 ConstVocabularyPointer Vocabulary::ConstructFromVocabFile(
     const std::string &vocab_file,
     const std::string &unk,
-    const std::string &sb) {
+    const std::string &sb,
+    const bool is_character_level) {
   assert(sb != "");
-  VocabularyPointer v = VocabularyPointer(new Vocabulary(unk, sb));
+  VocabularyPointer v = VocabularyPointer(new Vocabulary(unk,
+                                                         sb,
+                                                         is_character_level));
 
   // we do not know the number of classes yet
   IntToInt class_by_index_map;
+  StringToInt index_by_word;
 
   // read words (and, if available, word classes) from vocab file
   int index = 0, max_class = -1;
@@ -40,8 +46,8 @@ ConstVocabularyPointer Vocabulary::ConstructFromVocabFile(
     std::istringstream iss(line);
     std::string word;
     iss >> word;
-    assert(v->index_by_word_.find(word) == v->index_by_word_.end());
-    v->index_by_word_[word] = index;
+    assert(index_by_word.find(word) == index_by_word.end());
+    index_by_word[word] = index;
     // class information available?
     if (!iss.eof()) {
       assert(class_by_index_map.find(index) == class_by_index_map.end());
@@ -57,23 +63,21 @@ ConstVocabularyPointer Vocabulary::ConstructFromVocabFile(
   }
 
   // add <sb> automatically if not present (mkcls compatibility)
-  if (v->index_by_word_.find(sb) == v->index_by_word_.end()) {
-    v->index_by_word_[sb] = index;
+  if (index_by_word.find(sb) == index_by_word.end()) {
+    index_by_word[sb] = index;
     class_by_index_map[index] = max_class + 1;
   }
 
-  assert(v->index_by_word_.find(sb) != v->index_by_word_.end());
-  assert(unk == "" || v->index_by_word_.find(unk) != v->index_by_word_.end());
-  Remap(class_by_index_map, v);
-  v->sb_index_ = v->index_by_word_.find(sb)->second;
-
-  // initialize index to word map
-  for (const auto &tuple : v->index_by_word_)
-    v->word_by_index_[tuple.second] = tuple.first;
+  assert(index_by_word.find(sb) != index_by_word.end());
+  assert(unk == "" || index_by_word.find(unk) != index_by_word.end());
+  Remap(class_by_index_map, &index_by_word, v);
+  v->SetWords(index_by_word);
   return v;
 }
 
-void Vocabulary::Remap(const IntToInt &class_by_index, VocabularyPointer v) {
+void Vocabulary::Remap(const IntToInt &class_by_index,
+                       StringToInt *index_by_word,
+                       VocabularyPointer v) {
   // count number of words belonging to each class
   IntToInt size_by_class;
   for (auto ic : class_by_index)
@@ -108,7 +112,7 @@ void Vocabulary::Remap(const IntToInt &class_by_index, VocabularyPointer v) {
   for (const auto cs : size_by_class)
     v->class_size_[new_class_by_old_class[cs.first]] = cs.second;
   v->class_by_index_.resize(num_words);
-  for (auto &wi : v->index_by_word_) {
+  for (auto &wi : *index_by_word) {
     const int new_index = new_index_by_old_index[wi.second];
     v->class_by_index_[new_index] = new_class_by_old_class[
         class_by_index.find(wi.second)->second];
@@ -119,14 +123,34 @@ void Vocabulary::Remap(const IntToInt &class_by_index, VocabularyPointer v) {
 ConstVocabularyPointer Vocabulary::ConstructFromTrainFile(
     const std::string &train_file,
     const std::string &unk,
-    const std::string &sb) {
+    const std::string &sb,
+    const bool is_character_level) {
+  // a compiled corpus needs the vocabulary it was compiled with
+  assert(!CompiledCorpus::IsCompiledCorpus(train_file));
   // read text from file, add words to vocabulary
   int index = 0;
-  VocabularyPointer v = VocabularyPointer(new Vocabulary(unk, sb));
+  VocabularyPointer v = VocabularyPointer(new Vocabulary(unk,
+                                                         sb,
+                                                         is_character_level));
+  StringToInt index_by_word;
   std::string line, word;
   ReadableFile file(train_file);
   int64_t num_sentences = 0;
   while (file.GetLine(&line)) {
+    if (is_character_level) {
+      const char *end = line.data() + line.size();
+      int length;
+      for (const char *c = line.data(); c != end; c += length) {
+        const int code_point = DecodeCodePoint(c, end, &length);
+        // invalid byte sequences will map to <unk>
+        if (code_point < 0 || IsSpace(code_point))
+          continue;
+        word.assign(c, length);
+        if (index_by_word.find(word) == index_by_word.end())
+          index_by_word[word] = index++;
+      }
+      continue;
+    }
     boost::trim(line);
     std::istringstream iss(line);
     bool first_word = true;
@@ -136,40 +160,195 @@ ConstVocabularyPointer Vocabulary::ConstructFromTrainFile(
         first_word = false;
       }
       iss >> word;
-      auto it = v->index_by_word_.find(word);
-      if (it == v->index_by_word_.end()) {
-        it = v->index_by_word_.insert(std::make_pair(word, index++)).first;
+      auto it = index_by_word.find(word);
+      if (it == index_by_word.end()) {
+        it = index_by_word.insert(std::make_pair(word, index++)).first;
       }
     }
   }
 
   // training data contain <sb> token?
-  if (!v->Contains(sb)) {
-    v->index_by_word_[sb] = index;
-    v->sb_index_ = index;
-  }
+  if (index_by_word.find(sb) == index_by_word.end())
+    index_by_word[sb] = index;
 
   // put each word into a single class
-  const size_t vocabulary_size = v->index_by_word_.size();
+  const size_t vocabulary_size = index_by_word.size();
   v->class_size_.resize(vocabulary_size, 1);
   v->class_by_index_.resize(vocabulary_size);
   for (size_t i = 0; i < vocabulary_size; ++i)
     v->class_by_index_[i] = i;
-
-  // initialize index to word map
-  for (const auto &tuple : v->index_by_word_)
-    v->word_by_index_[tuple.second] = tuple.first;
+  v->SetWords(index_by_word);
   return v;
 }
 
+void Vocabulary::SetWords(const StringToInt &index_by_word) {
+  const int num_words = index_by_word.size();
+  std::vector<const std::string *> sorted_words(num_words);
+  for (const auto &wi : index_by_word)
+    sorted_words[wi.second] = &wi.first;
+  words_.clear();
+  offsets_.assign(1, 0);
+  bool are_characters = true;
+  for (const std::string *word : sorted_words) {
+    words_.append(*word);
+    words_.push_back('\0');
+    offsets_.push_back(words_.size());
+    are_characters = are_characters && (*word == sb_ || *word == unk_ ||
+                                        GetCodePoint(word->data(),
+                                                     word->size()) >= 0);
+  }
+  // character level text can only be mapped to single characters
+  assert(are_characters || !is_character_level_);
+
+  // power of two, at least twice the number of words
+  size_t num_slots = 1;
+  while (num_slots < 2 * static_cast<size_t>(num_words))
+    num_slots *= 2;
+  slots_.assign(num_slots, -1);
+  for (int i = 0; i < num_words; ++i) {
+    size_t slot = Hash(GetWord(i), offsets_[i + 1] - offsets_[i] - 1);
+    while (slots_[slot & (num_slots - 1)] >= 0)
+      ++slot;
+    slots_[slot & (num_slots - 1)] = i;
+  }
+
+  index_by_code_point_.clear();
+  if (are_characters) {
+    for (int i = 0; i < num_words; ++i) {
+      const int code_point = GetCodePoint(GetWord(i),
+                                          offsets_[i + 1] - offsets_[i] - 1);
+      if (code_point < 0)
+        continue;
+      if (code_point >= static_cast<int>(index_by_code_point_.size()))
+        index_by_code_point_.resize(code_point + 1, -1);
+      index_by_code_point_[code_point] = i;
+    }
+  }
+
+  sb_index_ = Find(sb_.data(), sb_.size());
+  unk_index_ = unk_ == "" ? -1 : Find(unk_.data(), unk_.size());
+}
+
+void Vocabulary::ConvertCharacters(const std::string &line,
+                                   std::vector<int> *indices) const {
+  assert(is_character_level_);
+  const char *end = line.data() + line.size();
+  bool is_unknown = false;
+  int length;
+  for (const char *c = line.data(); c != end; c += length) {
+    const int code_point = DecodeCodePoint(c, end, &length);
+    if (IsSpace(code_point)) {
+      is_unknown = false;
+      continue;
+    }
+    int index = -1;
+    if (code_point >= 0) {
+      if (!index_by_code_point_.empty()) {
+        if (code_point < static_cast<int>(index_by_code_point_.size()))
+          index = index_by_code_point_[code_point];
+      } else {
+        index = Find(c, length);
+      }
+    }
+    if (index >= 0) {
+      indices->push_back(index);
+    } else if (!is_unknown) {
+      assert(unk_index_ >= 0);
+      indices->push_back(unk_index_);
+    }
+    is_unknown = index < 0;
+  }
+}
+
+int Vocabulary::Find(const char *word, const size_t length) const {
+  if (!index_by_code_point_.empty()) {
+    const int code_point = GetCodePoint(word, length);
+    if (code_point >= 0) {
+      return code_point < static_cast<int>(index_by_code_point_.size()) ?
+             index_by_code_point_[code_point] : -1;
+    }
+  }
+  const size_t mask = slots_.size() - 1;
+  for (size_t slot = Hash(word, length); ; ++slot) {
+    const int index = slots_[slot & mask];
+    if (index < 0 || (length == static_cast<size_t>(
+        offsets_[index + 1] - offsets_[index] - 1) &&
+        memcmp(word, GetWord(index), length) == 0))
+      return index;
+  }
+}
+
+size_t Vocabulary::Hash(const char *word, const size_t length) {
+  // FNV-1a
+  uint64_t result = 14695981039346656037ULL;
+  for (size_t i = 0; i < length; ++i) {
+    result ^= static_cast<unsigned char>(word[i]);
+    result *= 1099511628211ULL;
+  }
+  return result ^ (result >> 32);
+}
+
+int Vocabulary::DecodeCodePoint(const char *begin,
+                                const char *end,
+                                int *length) {
+  *length = 1;
+  if (begin == end)
+    return -1;
+  const unsigned char first = *begin;
+  int code_point;
+  if (first < 0x80) {
+    return first;
+  } else if ((first & 0xe0) == 0xc0) {
+    *length = 2;
+    code_point = first & 0x1f;
+  } else if ((first & 0xf0) == 0xe0) {
+    *length = 3;
+    code_point = first & 0x0f;
+  } else if ((first & 0xf8) == 0xf0) {
+    *length = 4;
+    code_point = first & 0x07;
+  } else {
+    return -1;
+  }
+  if (end - begin < *length) {
+    *length = 1;
+    return -1;
+  }
+  for (int i = 1; i < *length; ++i) {
+    const unsigned char c = begin[i];
+    if ((c & 0xc0) != 0x80) {
+      // continue decoding after the valid prefix
+      *length = i;
+      return -1;
+    }
+    code_point = (code_point << 6) | (c & 0x3f);
+  }
+  return code_point <= 0x10ffff ? code_point : -1;
+}
+
 void Vocabulary::Save(const std::string &file_name) const {
-  std::vector<const std::string *> sorted_words(GetVocabularySize());
-  for (auto it = index_by_word_.begin(); it != index_by_word_.end(); ++it)
-    sorted_words[it->second] = &it->first;
   WritableFile file(file_name);
   for (int i = 0; i < GetVocabularySize(); ++i) {
-    file << *sorted_words[i] << "\t" << GetClass(i);
-    if (i != sorted_words.size() - 1)
+    file << GetWord(i) << "\t" << GetClass(i);
+    if (i != GetVocabularySize() - 1)
       file << '\n';
   }
 }
+
+uint64_t Vocabulary::ComputeChecksum() const {
+  // FNV-1a over all words in index order, followed by <unk> and <sb>
+  uint64_t result = 14695981039346656037ULL;
+  auto add = [&result](const char *word) {
+    for (; *word != '\0'; ++word) {
+      result ^= static_cast<unsigned char>(*word);
+      result *= 1099511628211ULL;
+    }
+    result ^= '\n';
+    result *= 1099511628211ULL;
+  };
+  for (int i = 0; i < GetVocabularySize(); ++i)
+    add(GetWord(i));
+  add(unk_.c_str());
+  add(sb_.c_str());
+  return result;
+}
@@ -13,9 +13,11 @@
 #pragma once
 #include <cassert>
 #include <algorithm>
+#include <cstdint>
 #include <memory>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 class Vocabulary;
 
@@ -24,20 +26,27 @@ typedef std::shared_ptr<const Vocabulary> ConstVocabularyPointer;
 
 class Vocabulary {
 public:
+  // is_character_level: text is tokenized into characters instead of words,
+  // see ConvertCharacters()
   static ConstVocabularyPointer ConstructFromVocabFile(
       const std::string &vocab_file,
       const std::string &unk,
-      const std::string &sb);
+      const std::string &sb,
+      const bool is_character_level);
 
   static ConstVocabularyPointer ConstructFromTrainFile(
       const std::string &train_file,
       const std::string &unk,
-      const std::string &sb);
+      const std::string &sb,
+      const bool is_character_level);
 
   void Save(const std::string &file_name) const;
+
+  // identifies the mapping from words to indices (e.g. of compiled corpora)
+  uint64_t ComputeChecksum() const;
   
   bool Contains(const std::string &word) const {
-    return index_by_word_.find(word) != index_by_word_.end();
+    return Find(word.data(), word.size()) >= 0;
   }
 
   int ComputeShortlistSize() const {
@@ -51,18 +60,17 @@ public:
   }
 
   int GetIndex(const std::string &word) const {
-    const StringToInt::const_iterator it = index_by_word_.find(word);
-    if (it == index_by_word_.end()) {
-      assert(unk_ != "");
-      return index_by_word_.find(unk_)->second;
+    const int index = Find(word.data(), word.size());
+    if (index < 0) {
+      assert(unk_index_ >= 0);
+      return unk_index_;
     }
-    return it->second;
+    return index;
   }
 
-  std::string GetWord(const int index) const {
-    const IntToString::const_iterator it = word_by_index_.find(index);
-    assert (it != word_by_index_.end());
-    return it->second;
+  const char *GetWord(const int index) const {
+    assert(index >= 0 && index < GetVocabularySize());
+    return words_.data() + offsets_[index];
   }
 
   int GetClass(const int index) const {
@@ -80,7 +88,7 @@ public:
 
   // includes <sb> and <unk>
   int GetVocabularySize() const {
-    return index_by_word_.size();
+    return offsets_.size() - 1;
   }
 
   int GetNumClasses() const {
@@ -88,8 +96,7 @@ public:
   }
 
   bool HasUnk() const {
-    const StringToInt::const_iterator it = index_by_word_.find(unk());
-    return it != index_by_word_.end();
+    return unk_index_ >= 0;
   }
 
   bool IsSentenceBoundary(const std::string &word) const {
@@ -100,30 +107,85 @@ public:
     return sb_index_;
   }
 
-  std::string sb() const {
+  // Appends the indices of the characters of raw UTF-8 text (whitespace is
+  // skipped). A run of characters not in the vocabulary maps to a single
+  // <unk>, like a non-Chinese word maps to one "o" in our preprocessed
+  // corpora.
+  void ConvertCharacters(const std::string &line,
+                         std::vector<int> *indices) const;
+
+  bool is_character_level() const {
+    return is_character_level_;
+  }
+
+  // -1 if there is no <unk>
+  int unk_index() const {
+    return unk_index_;
+  }
+
+  const std::string &sb() const {
     return sb_;
   }
 
-  std::string unk() const {
+  const std::string &unk() const {
     return unk_;
   }
 
 private:
+  // only used while constructing a vocabulary
   typedef std::unordered_map<std::string, int> StringToInt;
-  typedef std::unordered_map<int, std::string> IntToString;
   typedef std::unordered_map<int, int> IntToInt;
 
-  Vocabulary(const std::string &unk, const std::string &sb) :
-      unk_(unk), sb_(sb) {
+  Vocabulary(const std::string &unk,
+             const std::string &sb,
+             const bool is_character_level) :
+      unk_(unk), sb_(sb), is_character_level_(is_character_level),
+      sb_index_(-1), unk_index_(-1) {
   };
 
-  static void Remap(const IntToInt &class_by_index, VocabularyPointer v);
+  static void Remap(const IntToInt &class_by_index,
+                    StringToInt *index_by_word,
+                    VocabularyPointer v);
+
+  // Builds the lookup tables below from the final word indices.
+  void SetWords(const StringToInt &index_by_word);
+
+  // index of a word, -1 if it is not contained
+  int Find(const char *word, const size_t length) const;
+
+  static size_t Hash(const char *word, const size_t length);
+
+  // Decodes the UTF-8 encoded character at begin: returns its code point
+  // (-1 for an invalid byte sequence) and sets length to its number of bytes.
+  static int DecodeCodePoint(const char *begin, const char *end, int *length);
+
+  // the code point of a word consisting of a single character, -1 otherwise
+  static int GetCodePoint(const char *word, const size_t length) {
+    int character_length;
+    const int code_point = DecodeCodePoint(word, word + length,
+                                           &character_length);
+    return static_cast<size_t>(character_length) == length ? code_point : -1;
+  }
+
+  static bool IsSpace(const int code_point) {
+    return code_point == ' ' || (code_point >= '\t' && code_point <= '\r') ||
+           code_point == 0x3000;  // ideographic space
+  }
 
   // vocabulary has to contain </sb> and may contain <unk>
   const std::string unk_, sb_;
-  int sb_index_;
-  StringToInt index_by_word_;
-  IntToString word_by_index_;
+  const bool is_character_level_;
+  int sb_index_, unk_index_;
+  // all words in index order, each terminated by '\0': word i starts at
+  // words_[offsets_[i]]
+  std::string words_;
+  std::vector<int> offsets_;
+  // open addressing hash table (linear probing, at most half full) of word
+  // indices, -1 denotes an empty slot
+  std::vector<int> slots_;
+  // if all words but <sb> and <unk> are single characters: word index by
+  // Unicode code point (-1 if not contained), empty otherwise
+  std::vector<int> index_by_code_point_;
   std::vector<int> class_by_index_;
   std::vector<int> class_size_;
 };